@@ -1,521 +1,10561 @@
-/**
- * Virtual machine for executing binary file from synacor challange
- *
- * https://challenge.synacor.com/
- * 
- * TODO:
- *  - objdump
- *  - strings
- */
-
-/*************************************************************
- * Includes
- */
-
-#include <stdarg.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-
-/*************************************************************
- * Defines
- */
- 
-#define STACK_SIZE		32768
-#define FMT_VM_TAG		"[vm] "
-#define FMT_VM_FAIL		"\n[vm] Aborted!\n"
-
-#define ARCH_MODULO		32768
-
-/**
- * Info from arch_spec file for storage constants
- *   - numbers 0..32767 mean a literal value
- *   - numbers 32768..32775 instead mean registers 0..7
- *   - numbers 32776..65535 are invalid
- */
- 
-#define REGISTERS_SIZE			8
-#define	STORAGE_SIZE			65535
-#define STORAGE_MEM_LOW			0
-#define STORAGE_MEM_HIGH		32767
-#define STORAGE_REG_LOW			32768
-#define STORAGE_REG_HIGH		32775
-#define STORAGE_INV_LOW			32776
-#define MEMORY_SIZE				32767
-
-#define VALUE_MAX_LITERAL		32767
-#define VALUE_MAX_REGISTER		32775
-
-/*************************************************************
- * Declarations
- */
-
-/* Registers functions */
-void			reg_init		(void);
-unsigned short 	reg_read		(unsigned short address);
-void 			reg_write		(unsigned short address, unsigned short value);
-
-/* Memory functions */
-void			mem_init		(void);
-unsigned short 	mem_read		(unsigned short address);
-void 			mem_write		(unsigned short address, unsigned short value);
-
-/* Stack functions */
-void			stack_init		(void);
-int				stack_is_empty	(void);
-int				stack_is_full	(void);
-unsigned short 	stack_pop		(void);
-void		 	stack_push		(unsigned short val);
-
-/* Binary file functions */
-int binary_init					(int argc, char *argv[]);
-int binary_load					(void);
-int binary_exec					(void);
-
-/* CPU operation */
-int operation_exec				(unsigned short opcode, unsigned short a, unsigned short b, unsigned short c, int *jmp); 
-
-/* Helper functions */
-unsigned short 	val_get			(unsigned short input);
-
-void vm_info					(const char *fmt, ...);
-void vm_fail					(const char *fmt, ...);
-
-/*************************************************************
- * Data types
- */
- 
-typedef struct {
-	int 			size;
-	int				length;
-	char			*path;
-} binary_t;
-
-typedef struct {
-	int 			position;
-	unsigned short 	contents	[STACK_SIZE];
-} stack_t;
-
-typedef struct {
-	unsigned short 	contents	[MEMORY_SIZE];
-} memory_t;
-
-typedef struct {
-	unsigned short 	contents	[REGISTERS_SIZE];
-} registers_t;
-
-/*************************************************************
- * Global variables
- */
- 
-/* Binary info */
-binary_t 		binary;
-
-/* Storage */
-stack_t 		stack;
-memory_t 		memory;
-registers_t		registers;
-
-/*************************************************************
- * Functions
- */
-
-/**
- * Main program function
- */
-
-int main(int argc, char *argv[])
-{
-	int ret;
-	
-	/* Set binary file path */
-	ret = binary_init(argc, argv);
-	if (ret < 0) {
-		vm_fail("Please provide path to binary file ...");
-	}
-	
-	/* Initializes registers, memory and stack */
-	reg_init();
-	mem_init();
-	stack_init();
-
-	/* Load program file */	
-	ret = binary_load();
-	if (ret < 0) {
-		vm_fail("Loading failed ...\n");
-	}
-	
-	/* Execute program */
-	ret = binary_exec();
-	if (ret < 0) {
-		vm_fail("Execution failed ...\n");
-	}
-	
-	return 0;
-}
-
-/**
- * Initializes binary file
- */
-
-int binary_init(int argc, char *argv[])
-{
-	/* Set path to binary file - first argument */
-	binary.path = argv[1];
-	
-	return (argc < 2) ? -1 : 0;
-}
-
-/**
- * Loads binary file into memory
- */
- 
-int binary_load() 
-{
-	int ret;
-	FILE *fp;
-
-	/* Info */
-	vm_info("Loading program ...");
-
-	/* Open binary file */
-	fp = fopen(binary.path, "r");
-	if (!fp) {
-		vm_fail("Cannot open binary file ... [%s]", binary.path);
-	}
-	
-	/* Get binary size */
-	fseek(fp, 0L, SEEK_END);
-	binary.size = ftell(fp);
-	fseek(fp, 0L, SEEK_SET);
-	
-	/* Info */
-	vm_info("Binary path: %s",		binary.path);
-	vm_info("Binary size: %d B", 	binary.size);
-	
-	/* Load binary to memory at offset 0 */
-	ret = fread(&memory.contents[0], sizeof(unsigned char), binary.size, fp);
-	if (ret != binary.size) {
-		vm_fail("Cannot load binary file into memory ...");
-	}
-	
-	/* Set length of binary instructions */
-	binary.length = binary.size / 2;
-	free(fp);
-	return 0;
-}
-
-/**
- * Executes binary file written in memory
- */
- 
-int binary_exec()
-{
-	int pc 		= 0;		/* Program counter */
-	int halt 	= 0;		/* Halt flag */
-	
-	vm_info("Executing program ...");
-
-	/* Execute binary program */
-	while (!halt) {
-		
-		halt = operation_exec(
-			memory.contents[pc],
-			memory.contents[pc+1],
-			memory.contents[pc+2],
-			memory.contents[pc+3],
-			&pc);
-		
-		if (pc < 0 || pc > binary.length) {
-			vm_fail("Program counter out of bounds.");
-		}
-	}
-	
-	/* Execution halted */
-	vm_info("Execution halted ... [pc: %d]", pc);
-	return 0;
-}
-
-/**
- * Executes given operation
- */
-
-int operation_exec(unsigned short opcode, unsigned short a, unsigned short b, unsigned short c, int *pc)
-{	
-	int halt = 0;		/* Halt execution */
-
-	switch (opcode) {
-		/* Halt */
-		case 0 	:
-			halt = 1;
-			*pc += 1;
-			break;
-		/* Set */
-		case 1 	:
-			reg_write(a, reg_read(b));
-			*pc += 3;
-			break;
-		/* Push */
-		case 2 	:
-			stack_push(val_get(a));
-			*pc += 2;		
-			break;
-		/* Pop */
-		case 3 	:
-			reg_write(a, stack_pop());
-			*pc += 2;
-			break;
-		/* Eq */
-		case 4 	:
-			reg_write(a, val_get(b) == val_get(c) ? 1 : 0);
-			*pc += 4;
-			break;
-		/* Gt */
-		case 5 	:
-			reg_write(a, val_get(b) > val_get(c) ? 1 : 0);
-			*pc += 4;
-			break;
-		/* Jmp */
-		case 6 	:
-			*pc = val_get(a);
-			break;
-		/* Jt */
-		case 7 	:
-			*pc = (val_get(a) != 0) ? val_get(b) : *pc + 3;
-			break;
-		/* Jf */
-		case 8 	:
-			*pc = (val_get(a) == 0) ? val_get(b) : *pc + 3;
-			break;
-		/* Add */
-		case 9 	:
-			reg_write(a, (val_get(b) + val_get(c)) % ARCH_MODULO);
-			*pc += 4;
-			break;
-		/* Mult */
-		case 10 :
-			reg_write(a, (val_get(b) * val_get(c)) % ARCH_MODULO);
-			*pc += 4;
-			break;
-		/* Mod */
-		case 11 :
-			reg_write(a, val_get(b) % val_get(c));
-			*pc += 4;
-			break;		  
-		/* And */
-		case 12 :
-			reg_write(a, val_get(b) & val_get(c));
-			*pc += 4;
-			break;	
-		/* Or */
-		case 13 :
-			reg_write(a, val_get(b) | val_get(c));
-			*pc += 4;
-			break;
-		/* Not */
-		case 14 :
-			reg_write(a, (~val_get(b)) & 0x7fff);
-			*pc += 3;
-			break;
-		/* Rmem */
-		case 15 :
-			reg_write(a, mem_read(val_get(b)));
-			*pc += 3;
-			break;
-		/* Wmem */
-		case 16 :
-			mem_write(val_get(a), val_get(b));
-			*pc += 3;
-			break;
-		/* Call */
-		case 17 :
-			stack_push(*pc+2);	/* Push address of next instruction to stack */
-			*pc = val_get(a);	
-			break;
-		/* Ret */
-		case 18 :
-			*pc = stack_pop();  /* Pop address of next instruction from stack */
-			break;
-		/* Out */
-		case 19 :
-			putchar(val_get(a));
-			*pc += 2;
-			break;
-		/* In */
-		case 20 :
-			reg_write(a, getchar());
-			*pc += 2;
-			break;
-		/* No op */
-		case 21 :
-			*pc += 1;
-			break;
-		/* Error */
-		default :
-			vm_fail("Function %s() failed! [opcode:%d] [pc:%d]", __FUNCTION__, opcode, *pc);
-	}
-	
-	return halt;
-}
-
-/**
- * Returns literal value or value stored in register
- */
-
-unsigned short val_get(unsigned short input)
-{
-	if (input <= VALUE_MAX_LITERAL) {
-		return input;
-	}
-	if (input <= VALUE_MAX_REGISTER) {
-		return reg_read(input);
-	}
-	
-	vm_fail("Function %s() failed!", __FUNCTION__);
-	return 0;
-}
-
-/**
- * Initializes registers
- */
- 
-void reg_init()
-{
-	memset(&registers, 0, sizeof(registers_t));
-}
-
-/**
- * Writes value to register
- */
-
-void reg_write(unsigned short address, unsigned short value)
-{
-	if (address < STORAGE_REG_LOW || address > STORAGE_REG_HIGH) {
-		vm_fail("Function %s() failed!", __FUNCTION__);
-	}
-	
-	registers.contents[address-STORAGE_REG_LOW] = value;
-}
-
-/**
- * Reads form register or returns literal value
- */
-
-unsigned short reg_read(unsigned short address)
-{
-	if (address < STORAGE_REG_LOW) {
-		return address;
-	} else {
-		return registers.contents[address-STORAGE_REG_LOW];
-	}
-}
-
-/**
- * Initializes memory
- */
- 
-void mem_init()
-{
-	memset(&memory, 0, sizeof(memory_t));
-}
-
-/**
- * Reads from memory
- */
- 
-unsigned short mem_read(unsigned short address)
-{
-	return memory.contents[address];
-}
-
-/**
- * Writes to memory
- */
-
-void mem_write(unsigned short address, unsigned short value)
-{
-	memory.contents[address] = value;
-}
-
-/**
- * Initializes stack
- */
- 
-void stack_init()
-{
-	stack.position = -1;
-}
-
-/**
- * Pops element from stack
- */
-
-unsigned short stack_pop()
-{
-	if (stack_is_empty()) {
-		vm_fail("Function stack_pop() failed!");
-	}
-	
-	return stack.contents[stack.position--];
-}
- 
-/**
- * Pushes element to stack
- */
- 
-void stack_push(unsigned short element) 
-{
-	if (stack_is_full()) {
-		vm_fail("Function %s() failed!", __FUNCTION__);	
-	}
-
-	stack.contents[++stack.position] = element;
-}
-	
-/**
- * Returns true if stack is full
- */
- 
-int stack_is_full()
-{
-	return stack.position >= (STACK_SIZE - 1);
-}
-/**
- * Returns true if stack is empty
- */
- 
-int stack_is_empty()
-{
-	return stack.position < 0;
-}
-	
-/**
- * Prints info to standard error
- */
- 
-void vm_info(const char *fmt, ...)
-{
-	va_list args;
-	va_start(args, fmt);
-	fprintf	(stderr, FMT_VM_TAG);
-	vfprintf(stderr, fmt, args);
-	fprintf	(stderr, "\n");
-	va_end(args);
-}
-
-/**
- * Prints info to standard error and exits the program
- */
-
-void vm_fail(const char *fmt, ...)
-{
-	va_list args;
-	va_start(args, fmt);
-	fprintf	(stderr, FMT_VM_TAG);
-	vfprintf(stderr, fmt, args);
-   	fprintf	(stderr, FMT_VM_FAIL);
-	va_end(args);
-     
-	/* Exit with error */
-	exit(1);
+/**
+ * Virtual machine for executing binary file from synacor challange
+ *
+ * https://challenge.synacor.com/
+ */
+
+/*************************************************************
+ * Includes
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* System stack_t (sigaltstack) would clash with machine stack type */
+#define stack_t signal_stack_t
+#include <signal.h>
+#undef stack_t
+
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include <arpa/inet.h>
+#include <linux/perf_event.h>
+#include <netinet/in.h>
+
+#ifdef VM_OPENCL
+#define CL_TARGET_OPENCL_VERSION	120
+#include <CL/cl.h>
+#endif
+
+#include "vm.h"
+
+/*************************************************************
+ * Defines
+ */
+ 
+#define FMT_VM_TAG		"[vm] "
+#define FMT_VM_FAIL		"\n[vm] Aborted!\n"
+
+#define ARCH_MODULO		32768
+#define ARCH_OPCODES	22
+
+/**
+ * Execution engines
+ *   - switch engine decodes every instruction through operation_exec()
+ *   - threaded engine uses computed goto with pc and registers in locals
+ *   - decoded engine executes records from the pre-decoded instruction cache
+ *   - jit engine compiles hot basic blocks to native code
+ *   - paranoid engine is switch engine with extra invariant checks
+ *   - trace engine is switch engine recording every instruction, -T only
+ */
+
+#define ENGINE_SWITCH		0
+#define ENGINE_THREADED		1
+#define ENGINE_DECODED		2
+#define ENGINE_JIT			3
+#define ENGINE_PARANOID		4
+#define ENGINE_TRACE		5
+
+#if defined(__GNUC__)
+#define HAVE_COMPUTED_GOTO	1
+#endif
+
+#if defined(__x86_64__)
+#define HAVE_JIT			1
+#endif
+
+/**
+ * Info from arch_spec file for storage constants
+ *   - numbers 0..32767 mean a literal value
+ *   - numbers 32768..32775 instead mean registers 0..7
+ *   - numbers 32776..65535 are invalid
+ */
+ 
+#define REGISTERS_SIZE			8
+#define	STORAGE_SIZE			65535
+#define STORAGE_MEM_LOW			0
+#define STORAGE_MEM_HIGH		32767
+#define STORAGE_REG_LOW			32768
+#define STORAGE_REG_HIGH		32775
+#define STORAGE_INV_LOW			32776
+#define MEMORY_SIZE				32768
+
+/* Memory region keeps zero words past the end for operand fetch */
+#define MEMORY_MAP_SIZE			((MEMORY_SIZE + DECODE_MAX_LENGTH) * sizeof(unsigned short))
+
+/**
+ * State layout
+ *   - pc, registers, memory and stack descriptors share first cache
+ *     line of instance, rest of instance is touched off dispatch path
+ *   - with -H memory regions and stack segments are carved from shared
+ *     2 MB huge pages, transparent ones when none are reserved
+ *   - memory from huge pages is read, binary is not mapped over it
+ */
+
+#define CACHE_LINE				64
+#define HUGE_PAGE_SIZE			(2 << 20)
+
+/* Memory region rounded to cache line within huge page */
+#define MEMORY_SLOT_SIZE		((MEMORY_MAP_SIZE + CACHE_LINE - 1) & ~(CACHE_LINE - 1))
+
+#if defined(__GNUC__)
+#define CACHE_ALIGNED			__attribute__((aligned(CACHE_LINE)))
+#define NORETURN				__attribute__((noreturn))
+#else
+#define CACHE_ALIGNED
+#define NORETURN
+#endif
+
+#define VALUE_MAX_LITERAL		32767
+#define VALUE_MAX_REGISTER		32775
+#define VALUE_MAX_WORD			65535		/* Memory, stack and rmem/pop results */
+
+/**
+ * Decoded instruction handlers beyond opcodes
+ *   - miss means the entry is not decoded (or was invalidated)
+ *   - fault handlers report operands which would fail at runtime
+ *   - tail instruction falls through past end of binary, it runs
+ *     through operation_exec() with all checks
+ *   - break entry may hit breakpoint or watchpoint, runs through
+ *     break_exec()
+ */
+
+#define DECODE_MISS				(ARCH_OPCODES + 0)
+#define DECODE_FAULT_OPCODE		(ARCH_OPCODES + 1)
+#define DECODE_FAULT_REGISTER	(ARCH_OPCODES + 2)
+#define DECODE_FAULT_VALUE		(ARCH_OPCODES + 3)
+#define DECODE_TAIL				(ARCH_OPCODES + 4)
+#define DECODE_BREAK			(ARCH_OPCODES + 5)
+
+/**
+ * Superinstructions
+ *   - fused entry runs its own instruction and the following ones
+ *   - span of fused entry covers all of their words
+ */
+
+#define FUSE_PUSH_PUSH			(ARCH_OPCODES + 6)
+#define FUSE_PUSH_PUSH_PUSH		(ARCH_OPCODES + 7)
+#define FUSE_PUSH_CALL			(ARCH_OPCODES + 8)
+#define FUSE_POP_POP			(ARCH_OPCODES + 9)
+#define FUSE_POP_POP_RET		(ARCH_OPCODES + 10)
+#define FUSE_POP_RET			(ARCH_OPCODES + 11)
+#define FUSE_EQ_JT				(ARCH_OPCODES + 12)
+#define FUSE_EQ_JF				(ARCH_OPCODES + 13)
+#define FUSE_GT_JT				(ARCH_OPCODES + 14)
+#define FUSE_GT_JF				(ARCH_OPCODES + 15)
+#define FUSE_ADD_RMEM			(ARCH_OPCODES + 16)
+#define FUSE_FIRST				FUSE_PUSH_PUSH
+#define DECODE_HANDLERS			(ARCH_OPCODES + 17)
+
+#define DECODE_MAX_LENGTH		4
+#define DECODE_MAX_SPAN			7			/* eq+jt, add+rmem */
+
+/**
+ * JIT compiler limits
+ */
+
+#define JIT_THRESHOLD			64
+#define JIT_CODE_SIZE			(4 * 1024 * 1024)
+#define JIT_MAX_BLOCKS			8192
+#define JIT_MAX_INSNS			64
+#define JIT_BLOCK_BYTES			(JIT_MAX_INSNS * 384 + 256)
+
+#define JIT_HELPER_PUSH			0
+#define JIT_HELPER_POP			1
+#define JIT_HELPER_WMEM			2
+#define JIT_HELPER_CALL			3
+#define JIT_HELPER_RET			4
+#define JIT_HELPER_FAULT		5
+#define JIT_HELPERS				6
+
+/**
+ * Pure subroutine acceleration
+ *   - calls to declared addresses are looked up in memo table
+ *   - effects counter detects wmem/in/out while call is recorded
+ */
+
+#define ACCEL_MAX_FUNCS			64
+#define ACCEL_MAX_DEPTH			32768
+#define ACCEL_TABLE_SIZE		4096
+#define ACCEL_FRAMES			256
+
+/* True if ret may complete recorded call */
+#define ACCEL_RETURNING(vm)		((vm)->accel.depth &&												\
+								 (vm)->stack.position <= (vm)->accel.frame[(vm)->accel.depth - 1].position)
+
+/* Returned by input callback when no input is available */
+#define IO_BLOCKED				VM_BLOCKED
+
+/**
+ * Instruction budget of vm_run() slice
+ *   - switch, paranoid and threaded engines count instructions
+ *   - decoded engine counts control transfers, straight code between
+ *     them is unchecked, JIT counts native blocks, including chained
+ *     blocks and loop iterations inside them
+ *   - engine returns VM_RUNNING once budget is used up
+ */
+
+#define VM_BUDGET(vm)			((vm)->budget ? (vm)->budget : ~0ULL)
+
+/* Library errors and messages */
+#define VM_MESSAGE_SIZE			256
+
+/**
+ * Console I/O backends
+ *   - output is buffered, flushed on input, halt or when buffer is full
+ *   - input is read a line at a time
+ *   - stdio backend goes through unlocked stdio, raw uses read/write
+ */
+
+#define IO_BACKEND_STDIO		0
+#define IO_BACKEND_RAW			1
+
+#define IO_BUFFER_SIZE			65536
+
+/**
+ * Segmented stack
+ *   - stack grows by segments taken from arena shared by all instances
+ *   - one segment above top is kept, pop releases further ones lazily
+ *   - limit only stops runaway recursion
+ */
+
+#define STACK_SEGMENT_SHIFT		12
+#define STACK_SEGMENT_WORDS		(1 << STACK_SEGMENT_SHIFT)
+#define STACK_SEGMENT_MASK		(STACK_SEGMENT_WORDS - 1)
+#define STACK_LIMIT				(1 << 26)
+#define STACK_ARENA_SLAB		16
+#define STACK_DIRECTORY			16
+
+/* Word at position of segmented stack */
+#define STACK_AT(s, p)			((s)->segment[(p) >> STACK_SEGMENT_SHIFT][(p) & STACK_SEGMENT_MASK])
+
+/**
+ * Snapshot pages
+ *   - memory is tracked in 64 pages of 512 words each
+ *   - stack is tracked by segments, last bit covers all segments above
+ *   - bit n of dirty mask is set when page n was written since sync
+ */
+
+#define SNAPSHOT_PAGE_SHIFT		9
+#define SNAPSHOT_PAGE_WORDS		(1 << SNAPSHOT_PAGE_SHIFT)
+#define SNAPSHOT_PAGES			(ARCH_MODULO >> SNAPSHOT_PAGE_SHIFT)
+#define SNAPSHOT_PAGE_BIT(a)	(1ULL << ((a) >> SNAPSHOT_PAGE_SHIFT))
+#define SNAPSHOT_STACK_BIT(p)	(1ULL << ((p) >> STACK_SEGMENT_SHIFT < 63 ? (p) >> STACK_SEGMENT_SHIFT : 63))
+
+/**
+ * Incremental state hashes
+ *   - sum of every word times key of its address or stack position,
+ *     kept by mem_write(), stack_push() and stack_pop()
+ *   - valid after hash_reset(), snapshots carry them
+ */
+
+#define HASH_STEP				0x9e3779b97f4a7c15ULL
+#define HASH_MULT				0xbf58476d1ce4e5b9ULL
+#define HASH_MIX(x)				(((x) ^ ((x) >> 31)) * HASH_MULT)
+#define HASH_KEY(n)				(HASH_MIX(((unsigned long long) (n) + 1) * HASH_STEP) | 1)
+
+/**
+ * Checkpoint file format
+ *   - header, live stack words and whole memory in host byte order
+ *   - version is bumped on every layout change
+ */
+
+#define CHECKPOINT_MAGIC		"SYNACKPT"
+#define CHECKPOINT_VERSION		1
+#define CHECKPOINT_ORDER		0x0102
+#define CHECKPOINT_COMMAND		"!save "
+#define CHECKPOINT_SIGNAL_PATH	"vm-%d.ckpt"
+#define CHECKPOINT_IOV			64
+
+/**
+ * Ahead-of-time image cache
+ *   - CFG, decoded and fused instructions and, with jit engine, code of
+ *     every block leader, stored as DIR/KEY.aot where key hashes image
+ *   - file is mapped privately, compiled code is mapped over start of
+ *     JIT buffer, so sections start at page multiples
+ *   - file written by other build is replaced, breakpoints and
+ *     checkpoints leave cache unused
+ */
+
+#define AOT_MAGIC				"SYNAAOTC"
+#define AOT_VERSION				1
+#define AOT_ORDER				0x0102
+#define AOT_ALIGN				4096
+#define AOT_BUILD				__DATE__ " " __TIME__
+#define AOT_JIT					0x01
+#define AOT_OFFSET(n)			(((n) + AOT_ALIGN - 1) & ~(AOT_ALIGN - 1))
+
+/**
+ * Execution trace
+ *   - interpreter fills chunks of ring buffer, writer thread streams
+ *     full chunks to file and interpreter only waits when all are full
+ *   - record is opcode byte with flags, pc delta when not sequential,
+ *     resolved source operands and written register, numbers as varints
+ *   - chunk header holds absolute pc and index of first instruction,
+ *     reader seeks by skipping whole chunks
+ */
+
+#define TRACE_MAGIC				"SYNATRCE"
+#define TRACE_VERSION			1
+#define TRACE_ORDER				0x0102
+#define TRACE_CHUNK_MAGIC		0x4b4e4843
+#define TRACE_CHUNK_SIZE		65536
+#define TRACE_CHUNKS			8
+#define TRACE_RECORD_MAX		24
+#define TRACE_OPCODE			0x1f
+#define TRACE_JUMP				0x20
+#define TRACE_WRITE				0x40
+
+/**
+ * Reverse debugger, GDB remote protocol stub
+ *   - steps through operation_exec(), snapshot every K instructions
+ *   - going back restores nearest earlier snapshot and replays at most
+ *     K instructions, input comes from log and output is suppressed
+ *   - full snapshot list is thinned by half and K doubled
+ *   - addresses seen by GDB are bytes, word n is at 2n
+ */
+
+#define DEBUG_INTERVAL			10000
+#define DEBUG_SNAPSHOTS			256
+#define DEBUG_PACKET_SIZE		4096
+#define DEBUG_POLL				4096				/* Instructions between interrupt checks */
+#define DEBUG_REGISTERS			(REGISTERS_SIZE + 2)	/* r0-r7, pc, sp */
+
+/**
+ * Session server, -l [HOST:]PORT
+ *   - each connection gets instance forked from loaded program, in
+ *     and out go to its socket
+ *   - one epoll thread accepts, reads, writes and runs instances in
+ *     slices, instance waiting for input stays parked
+ *   - output is coalesced and sent once instance waits, halts or
+ *     buffer fills, full unsent buffer pauses instance
+ */
+
+#define SERVE_SLICE				100000			/* Instructions per turn */
+#define SERVE_EVENTS			256
+#define SERVE_BACKLOG			128
+#define SERVE_INPUT_SIZE		4096
+#define SERVE_OUTPUT_SIZE		16384
+
+/* Session states */
+#define SERVE_WAITING			0				/* Parked on input */
+#define SERVE_RUNNABLE			1				/* In run queue */
+#define SERVE_PAUSED			2				/* Output not drained */
+#define SERVE_CLOSING			3				/* Close once output is sent */
+
+#define DEBUG_BREAK				1
+#define DEBUG_WATCH				2
+
+#define DEBUG_CONTINUE			0
+#define DEBUG_STEP				1
+#define DEBUG_REVERSE_CONTINUE	2
+#define DEBUG_REVERSE_STEP		3
+
+/* Reasons of returning to GDB */
+#define DEBUG_STOP_TRAP			0
+#define DEBUG_STOP_WATCH		1
+#define DEBUG_STOP_BEGIN		2
+#define DEBUG_STOP_HALT			3
+#define DEBUG_STOP_FAULT		4
+#define DEBUG_STOP_INTERRUPT	5
+
+/**
+ * Breakpoints and watchpoints of library instances and -b
+ *   - decoder patches entries which may hit to DECODE_BREAK, other
+ *     entries run unchanged and nothing is checked while none is set
+ *   - threaded and JIT engines run as decoded engine while set,
+ *     paranoid and trace engines ignore them
+ *   - pc break stops before instruction, watches after it
+ */
+
+#define BREAK_PC				1
+#define BREAK_WRITE				2
+#define BREAK_PATTERN_SIZE		64
+#define BREAK_OUTPUT			0
+#define BREAK_INPUT				1
+
+/**
+ * Execution profiler, built with -DVM_PROFILE
+ *   - forces switch engine, counts opcodes, addresses and call targets
+ *   - results written to PREFIX.txt and PREFIX.folded at exit
+ */
+
+#define PROFILE_PATH			"vm-profile"
+#define PROFILE_TOP				32
+#define PROFILE_NODES			4096
+#define PROFILE_DEPTH			32768
+
+/**
+ * Static analysis
+ *   - recursive descent from address 0 marks code, rest is data
+ *   - blocks end at control transfer and before every leader
+ */
+
+#define CFG_CODE				0x01		/* Instruction reached by descent */
+#define CFG_LEADER				0x02		/* First instruction of block */
+#define CFG_FUNC				0x04		/* Call target or entry */
+#define CFG_INDIRECT			0x08		/* Target taken from register */
+
+/**
+ * Function summaries, cover whole call tree
+ *   - calls are resolved by iterating to fixpoint, recursive depth
+ *     still growing after CFG_ROUNDS is unbounded
+ *   - reads are registers possibly read before written, writes are
+ *     registers possibly written
+ *   - pure function touches no memory or I/O and only its own stack
+ *     frame, those with loops or calls are worth memoizing
+ */
+
+#define CFG_FX_HALT				0x01
+#define CFG_FX_RMEM				0x02
+#define CFG_FX_WMEM				0x04
+#define CFG_FX_IO				0x08
+#define CFG_FX_UNKNOWN			0x10		/* Indirect flow or unbalanced stack */
+#define CFG_FX_LOOPS			0x20		/* Back edge or call, not an effect */
+#define CFG_FX_IMPURE			(CFG_FX_HALT | CFG_FX_RMEM | CFG_FX_WMEM | CFG_FX_IO | CFG_FX_UNKNOWN)
+#define CFG_ROUNDS				16
+#define CFG_DEPTH_UNBOUNDED		(-1)
+
+#define CFG_FORMAT_TEXT			0
+#define CFG_FORMAT_DOT			1
+#define CFG_FORMAT_JSON			2
+
+/**
+ * Strings index
+ *   - string is length word followed by that many printable words
+ *   - matches do not overlap, shorter strings than minimum are noise
+ */
+
+#define STRINGS_MIN_LENGTH		3
+#define STRINGS_MAX				(MEMORY_SIZE / (STRINGS_MIN_LENGTH + 1) + 1)
+
+/**
+ * Benchmarks
+ *   - every program runs BENCH_RUNS times per engine, best time is kept
+ *   - instructions are counted once by the switch engine
+ */
+
+#define BENCH_RUNS				3
+#define BENCH_ENGINES			4
+
+/**
+ * Hardware counters, -c
+ *   - user space cycles, instructions, branch misses and L1d read
+ *     misses are counted as one group around execution
+ *   - reported per engine by binary_exec() and benchmarks, profiler
+ *     adds them per call target, outermost activations only
+ *   - counters which kernel or hypervisor does not expose are left out
+ *   - -M appends compiled JIT blocks to /tmp/perf-PID.map for perf
+ */
+
+#define PERF_COUNTERS			4
+#define PERF_CYCLES				0
+#define PERF_INSTRUCTIONS		1
+#define PERF_BRANCH_MISSES		2
+#define PERF_L1D_MISSES			3
+#define PERF_MAP_PATH			"/tmp/perf-%d.map"
+
+/**
+ * Differential run, -D ENGINE[:N]
+ *   - image and input run on -e engine and ENGINE, states are compared
+ *     after every N dispatches of leading engine
+ *   - engine counting instructions exactly trails, it runs to known
+ *     lower bound and then steps until both states match
+ *   - state is pc, registers, stack position, input and output plus
+ *     incremental memory and stack hashes
+ *   - round without match is replayed from snapshots dispatch by
+ *     dispatch, first diverging one is reported with both states
+ *   - leading state found later on trailing path matches, skipped
+ *     work which rejoins that path is not reported
+ */
+
+#define DIFF_INTERVAL			1000000		/* Dispatches per round */
+#define DIFF_SPAN				64			/* Instructions per dispatch before replay */
+#define DIFF_DUMP				16			/* Differing memory words shown */
+#define DIFF_EXACT(engine)		((engine) == ENGINE_SWITCH || (engine) == ENGINE_THREADED || (engine) == ENGINE_PARANOID)
+
+/**
+ * Parallel search limits
+ */
+
+#define SEARCH_MAX_THREADS		256
+#define SEARCH_OUTPUT_SIZE		65536
+
+/**
+ * Lockstep lanes, -L N with search
+ *   - N search instances share one dispatch, registers are kept as
+ *     structure of arrays in vectors of LANES_MAX lanes
+ *   - lanes at lowest pc run together, the rest waits until they meet
+ *   - arithmetic runs on vectors, stack, memory and I/O lane by lane
+ *   - instruction words written by some lane are compared across
+ *     lanes, differing code runs through operation_exec() per lane
+ *   - vectors map to AVX-512, AVX2 or SSE2, chosen at load time on
+ *     x86-64, and to NEON on AArch64
+ */
+
+#define LANES_MAX				32
+
+/**
+ * Subroutine sweep, -G ADDR with register search
+ *   - every candidate calls subroutine from snapshot, predicate is
+ *     checked once it returns to snapshot pc
+ *   - built with -DVM_OPENCL candidates run as OpenCL work items on
+ *     shared read only image, each with its own stack
+ *   - work item reaching halt, wmem, out, in, stack limit or end of
+ *     binary is finished by host from its state
+ *   - without device subroutine is called on search threads
+ */
+
+#define GPU_BATCH				8192		/* Work items per launch */
+#define GPU_STACK_SIZE			4096		/* Stack words of work item */
+#define GPU_STEPS				(1 << 20)	/* Instructions per launch */
+
+/* Work item status */
+#define GPU_RUNNING				0
+#define GPU_RETURNED			1
+#define GPU_HOST				2
+
+#if defined(__GNUC__)
+#define HAVE_LANES				1
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__) && defined(__linux__)
+#define LANES_TARGETS			__attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define LANES_TARGETS
+#endif
+
+/*************************************************************
+ * Data types
+ */
+ 
+typedef struct {
+	int 			size;
+	int				length;
+	int				engine;
+	char			*path;
+} binary_t;
+
+typedef struct {
+	int 			position;
+	int				capacity;					/* Words in allocated segments */
+	int				segments;
+	int				slots;						/* Size of segment directory */
+	unsigned short	**segment;
+} stack_t;
+
+/* Free blocks of one size shared by all instances */
+typedef struct {
+	pthread_mutex_t	lock;
+	void			*free;
+	int				allocated;
+} arena_t;
+
+typedef struct {
+	unsigned short 	*contents;					/* MEMORY_MAP_SIZE region */
+	int				pooled;						/* Taken from memory arena */
+} memory_t;
+
+typedef struct {
+	unsigned short 	contents	[REGISTERS_SIZE];
+} registers_t;
+
+typedef struct {
+	const char		*name;
+	unsigned char	length;		/* Instruction length including opcode */
+	unsigned char	dest;		/* First operand is destination register */
+} opcode_t;
+
+/**
+ * Decoded instruction record
+ *   - operand holds literal value or register index
+ *   - bit n of regs is set when operand n is register
+ *   - span is length, or words of all fused instructions
+ */
+
+typedef struct {
+	unsigned char	handler;
+	unsigned char	length;
+	unsigned char	regs;
+	unsigned char	span;
+	unsigned short	operand		[DECODE_MAX_LENGTH - 1];
+} decode_t;
+
+typedef struct {
+	int				active;
+	decode_t		entries		[ARCH_MODULO];
+} decode_cache_t;
+
+/* Basic block, successors within function and call target */
+typedef struct {
+	int				start;
+	int				end;						/* Exclusive */
+	int				func;						/* Entry of first function reaching block */
+	int				succs;
+	int				succ		[2];
+	int				call;						/* Call target or -1 */
+} cfg_block_t;
+
+/* Side effects of function and its callees */
+typedef struct {
+	int				entry;
+	int				depth;						/* Stack words below return address */
+	unsigned char	effects;
+	unsigned char	reads;						/* Register masks */
+	unsigned char	writes;
+} cfg_func_t;
+
+/* Inclusive value range of register */
+typedef struct {
+	unsigned short	lo;
+	unsigned short	hi;
+} cfg_range_t;
+
+/* Length prefixed string */
+typedef struct {
+	int				address;					/* Address of length word */
+	int				length;
+} string_t;
+
+typedef struct {
+	int				count;
+	int				index		[MEMORY_SIZE];	/* String covering address or -1 */
+	string_t		entry		[STRINGS_MAX];
+} strings_t;
+
+typedef struct {
+	unsigned char	flags		[MEMORY_SIZE];
+	int				index		[MEMORY_SIZE];	/* Block starting at address or -1 */
+	int				funcs;
+	int				blocks;
+	int				words;						/* Words covered by code */
+	cfg_block_t		block		[MEMORY_SIZE];
+	cfg_func_t		func		[MEMORY_SIZE];	/* Summaries by entry address */
+} cfg_t;
+
+
+/* Context passed to compiled blocks, layout is used by generated code */
+typedef struct {
+	unsigned short	*registers;
+	unsigned short	*memory;
+	void			*helpers	[JIT_HELPERS];
+	vm_t			*vm;
+	unsigned long long	loops;					/* Back edges and chained blocks left */
+	void			**entries;					/* Compiled block by address */
+	unsigned char	*accel;						/* Declared subroutine map */
+} jit_ctx_t;
+
+typedef int (*jit_block_fn)(jit_ctx_t *ctx);
+
+typedef struct {
+	unsigned short	start;
+	unsigned short	end;
+	int				entry;						/* Code offset */
+} jit_block_t;
+
+/* Native replacement - computes outputs in place, returns 0 if not handled */
+typedef int (*accel_native_fn)(unsigned short *registers);
+
+typedef struct {
+	const char		*name;
+	accel_native_fn	fn;
+} accel_native_t;
+
+typedef struct {
+	unsigned short	address;
+	unsigned char	inputs;						/* Register masks */
+	unsigned char	outputs;
+	accel_native_fn	native;
+} accel_func_t;
+
+typedef struct {
+	unsigned char	used;
+	unsigned char	func;
+	unsigned short	inputs		[REGISTERS_SIZE];
+	unsigned short	outputs		[REGISTERS_SIZE];
+} accel_entry_t;
+
+/* Call being recorded, completes when ret returns to position */
+typedef struct {
+	int				position;
+	unsigned short	next;
+	unsigned char	func;
+	unsigned int	effects;
+	unsigned short	inputs		[REGISTERS_SIZE];
+} accel_frame_t;
+
+/* Declared subroutines, shared by all instances */
+typedef struct {
+	int				funcs;
+	accel_func_t	func		[ACCEL_MAX_FUNCS];
+	unsigned char	map			[ARCH_MODULO];	/* Function index + 1 by address */
+} accel_t;
+
+/* Memo table and recorded calls of one instance */
+typedef struct {
+	int				depth;
+	int				frames;						/* Frame stack capacity */
+	unsigned int	effects;
+	unsigned int	size;						/* Memo table capacity */
+	unsigned int	count;
+	unsigned long	hits;
+	unsigned long	misses;
+	accel_entry_t	*table;
+	accel_frame_t	*frame;
+} accel_state_t;
+
+typedef struct {
+	int				active;
+	unsigned char	*code;						/* Executable code buffer */
+	int				used;
+	int				blocks;
+	jit_ctx_t		ctx;
+	jit_block_t		block		[JIT_MAX_BLOCKS];
+	jit_block_fn	entries		[ARCH_MODULO];	/* Compiled block by address */
+	unsigned int	counters	[ARCH_MODULO];	/* Execution counters */
+	unsigned char	covered		[ARCH_MODULO];	/* Blocks covering address */
+} jit_t;
+
+/* In memory input or output buffer */
+typedef struct {
+	char			*data;
+	size_t			length;
+	size_t			position;
+} buffer_t;
+
+/* Console shared by instances using io_stdin/io_stdout */
+typedef struct {
+	int				backend;
+	buffer_t		in;							/* Current input line */
+	buffer_t		out;						/* Pending output */
+} console_t;
+
+/**
+ * Snapshot of machine state
+ *   - generation changes on every take, stale instances resync fully
+ */
+
+typedef struct {
+	binary_t		binary;
+	int				pc;
+	unsigned int	generation;
+	registers_t		registers;
+	stack_t			stack;
+	memory_t		memory;
+	unsigned long long	hash_memory;
+	unsigned long long	hash_stack;
+} snapshot_t;
+
+/* Checkpoint file header */
+typedef struct {
+	char				magic		[8];
+	unsigned int		version;
+	unsigned short		order;						/* CHECKPOINT_ORDER as written */
+	unsigned short		registers	[REGISTERS_SIZE];
+	unsigned int		pc;
+	int					stack_position;
+	unsigned int		memory_size;
+	int					binary_size;
+	unsigned long long	input_position;				/* Cursor of input or script file */
+} checkpoint_header_t;
+
+/* Checkpoint requests */
+typedef struct {
+	const char				*resume;				/* Loaded after binary */
+	volatile sig_atomic_t	requested;				/* Set by SIGUSR1 */
+} checkpoint_t;
+
+/* Image cache file header */
+typedef struct {
+	char				magic		[8];
+	unsigned int		version;
+	unsigned short		order;						/* AOT_ORDER as written */
+	unsigned short		flags;
+	char				build		[24];			/* AOT_BUILD of writer */
+	unsigned long long	key;
+	int					binary_size;
+	unsigned int		cfg_offset;
+	unsigned int		cfg_size;
+	unsigned int		decoded_offset;
+	unsigned int		decoded_size;
+	unsigned int		jit_offset;					/* Block table */
+	unsigned int		code_offset;
+	int					jit_blocks;
+	int					jit_used;
+} aot_header_t;
+
+/* Trace file header */
+typedef struct {
+	char				magic		[8];
+	unsigned int		version;
+	unsigned int		order;
+} trace_header_t;
+
+/* Chunk header, followed by size bytes of records */
+typedef struct {
+	unsigned int		magic;
+	unsigned int		size;
+	unsigned long long	first;						/* Index of first instruction */
+	unsigned int		count;
+	unsigned int		pc;							/* Address of first instruction */
+} trace_chunk_t;
+
+typedef struct {
+	trace_chunk_t		header;
+	unsigned char		data		[TRACE_CHUNK_SIZE];
+} trace_buffer_t;
+
+/* Trace being recorded, chunks [head, head + full) wait for writer */
+typedef struct {
+	int					fd;
+	const char			*path;
+	pthread_t			thread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	int					head;
+	int					full;
+	int					tail;						/* Chunk being filled */
+	int					done;
+	int					failed;
+	unsigned long long	index;						/* Next instruction */
+	int					expected;					/* Fall-through of last record */
+	trace_buffer_t		buffer		[TRACE_CHUNKS];
+} trace_t;
+
+/* Snapshot of debugged instance at instruction index */
+typedef struct {
+	unsigned long long	index;
+	size_t				input;						/* Input log position */
+	snapshot_t			*snapshot;
+} debug_point_t;
+
+typedef struct {
+	int					fd;
+	int					ack;						/* Packets are acknowledged */
+	int					detach;
+	unsigned long long	interval;
+	unsigned long long	now;						/* Executed instructions */
+	unsigned long long	frontier;					/* Furthest executed, output shown up to it */
+	debug_point_t		point		[DEBUG_SNAPSHOTS];
+	int					points;
+	buffer_t			log;						/* Input read so far */
+	size_t				log_size;
+	vm_in_fn			in;
+	vm_out_fn			out;
+	unsigned char		flags		[MEMORY_SIZE];	/* Breakpoints and watched words */
+	int					watch_regs;					/* Mask of watched registers */
+	int					hit;						/* Watched address written or -1 */
+	char				packet		[DEBUG_PACKET_SIZE];
+	unsigned char		rx			[DEBUG_PACKET_SIZE];
+	size_t				rx_length;
+	size_t				rx_position;
+} debug_t;
+
+/* Connection served by its own instance */
+typedef struct serve_session {
+	int				fd;
+	int				id;
+	int				state;
+	int				eof;						/* Peer closed or failed */
+	unsigned int	events;						/* Watched epoll events */
+	vm_t			*vm;
+	buffer_t		out;						/* Unsent output, position is sent part */
+	struct serve_session	*next;				/* Run queue */
+} serve_session_t;
+
+typedef struct {
+	int				epoll;
+	int				listener;
+	int				sessions;
+	int				next_id;
+	snapshot_t		*base;						/* Program as loaded */
+	serve_session_t	*head;
+	serve_session_t	*tail;
+} serve_t;
+
+typedef struct {
+	int				points;						/* Breaks, watches and patterns set */
+	int				words;						/* Watched memory words */
+	int				regs;						/* Mask of watched registers */
+	int				resume;						/* Break passed once on next run, -1 none */
+	int				reason;						/* VM_BREAK_* of last stop */
+	int				address;
+	unsigned char	flags		[MEMORY_SIZE];
+	char			pattern		[2][BREAK_PATTERN_SIZE];	/* Output and input */
+	char			seen		[2][BREAK_PATTERN_SIZE];	/* Recent characters */
+} break_t;
+
+/* Counter group, fd of counter not exposed is -1 */
+typedef struct {
+	int					leader;						/* First opened fd or -1 */
+	int					fd			[PERF_COUNTERS];
+	unsigned long long	value		[PERF_COUNTERS];	/* Counted by last perf_stop() */
+} perf_t;
+
+/* Progress of differential run side, restored with round snapshot */
+typedef struct {
+	unsigned long long	executed;				/* Instructions, trailing side only */
+	unsigned long long	output;					/* Hash of written words */
+	size_t				written;
+	size_t				input;
+} diff_count_t;
+
+typedef struct {
+	vm_t				*vm;
+	int					status;					/* Of last vm_run() */
+	diff_count_t		now;
+	diff_count_t		saved;
+	snapshot_t			*snapshot;				/* State at start of round */
+} diff_side_t;
+
+#ifdef VM_PROFILE
+
+/* Call tree node, children are found by hash of parent and address */
+typedef struct {
+	unsigned int		parent;
+	unsigned short		address;
+	unsigned long long	self;						/* Instructions executed in node */
+} profile_node_t;
+
+/* Active call */
+typedef struct {
+	unsigned int		node;
+	int					position;					/* Stack position of return address */
+	unsigned short		address;
+	unsigned long long	start;						/* Total count when entered */
+	unsigned long long	counters	[PERF_COUNTERS];	/* Hardware counters when entered */
+} profile_frame_t;
+
+typedef struct {
+	unsigned long long	total;
+	unsigned long long	opcodes		[ARCH_OPCODES];
+	unsigned long long	pcs			[MEMORY_SIZE];
+	unsigned long long	calls		[MEMORY_SIZE];
+	unsigned long long	inclusive	[MEMORY_SIZE];	/* Outermost activations only */
+	unsigned int		active		[MEMORY_SIZE];	/* Activations on call stack */
+	unsigned long long	counters	[MEMORY_SIZE][PERF_COUNTERS];	/* Inclusive, as above */
+
+	int					depth;
+	profile_frame_t		frame		[PROFILE_DEPTH];
+
+	unsigned int		nodes;
+	unsigned int		size;						/* Node and table capacity */
+	profile_node_t		*node;
+	unsigned int		*table;						/* Node index + 1, 0 is empty */
+} profile_t;
+
+#endif
+
+/**
+ * Virtual machine instance
+ *   - machine state is copied by vm_clone()
+ *   - caches are private to instance and allocated on first use
+ *   - hot state fills first cache line, stack words stay in their
+ *     segment so STACK_AT() users never see stale copy of top
+ */
+
+struct vm {
+	/* Hot state, first cache line */
+	int				pc;
+	int				stop;						/* Stop after current instruction */
+	registers_t		registers;
+	memory_t		memory;
+	stack_t			stack;
+
+	binary_t		binary;
+	unsigned long long	insns;					/* Executed by switch engine */
+	unsigned long long	budget;					/* Dispatches left in vm_run() slice, 0 unlimited */
+
+	/* I/O */
+	vm_in_fn		in;
+	vm_out_fn		out;
+	buffer_t		input;
+	buffer_t		output;
+	int				forward;					/* Output suppressed while replaying */
+	const char		*marker;					/* Script line ending fast-forward */
+
+	/* Library embedding */
+	vm_log_fn		log;
+	void			*user;
+	jmp_buf			*trap;						/* Set while in vm_run() */
+	int				sched_state;
+	int				failed;
+	char			error		[VM_MESSAGE_SIZE];
+
+	/* Snapshot tracking */
+	const snapshot_t	*snapshot;				/* Snapshot last synced with */
+	unsigned int		generation;
+	unsigned long long	dirty_memory;			/* Pages written since sync */
+	unsigned long long	dirty_stack;
+	unsigned long long	hash_memory;			/* Incremental state hashes */
+	unsigned long long	hash_stack;
+
+	/* Caches */
+	cfg_t			*cfg;						/* Static CFG of loaded image */
+	decode_cache_t	*decoded;
+	jit_t			*jit;
+	accel_state_t	accel;
+	void			*aot;						/* Mapped image cache */
+	size_t			aot_size;
+	int				aot_stale;					/* Cache written before run */
+
+	trace_t			*trace;
+	debug_t			*debug;
+	break_t			*breaks;
+
+#ifdef VM_PROFILE
+	profile_t		*profile;
+#endif
+} CACHE_ALIGNED;
+
+/* Search variation and stop predicate */
+typedef struct {
+	int				threads;
+	int				reg;						/* Varied register or -1 */
+	int				from;
+	int				to;
+	buffer_t		lines;						/* Varied input lines */
+	buffer_t		input;						/* Input fed after variation */
+	const char		*until_output;				/* Predicate - output contains */
+	int				until_reg;					/* Predicate - register equals */
+	int				until_value;
+	int				lanes;						/* Instances per lockstep group, 0 off */
+	int				gpu;						/* Swept subroutine or -1 */
+	int				count;						/* Number of candidates */
+	char			**line;
+
+	/* Shared progress */
+	pthread_mutex_t	lock;
+	int				next;
+	int				found;
+	snapshot_t		*snapshot;
+} search_t;
+
+#if HAVE_LANES
+
+typedef unsigned short lanes_vec_t __attribute__((vector_size(LANES_MAX * sizeof(unsigned short))));
+
+/* Instances run in lockstep, lane i of vectors belongs to vm[i] */
+typedef struct {
+	int				count;
+	unsigned int	active;						/* Lanes still running */
+	vm_t			*vm			[LANES_MAX];
+	int				pc			[LANES_MAX];
+	int				status		[LANES_MAX];
+	lanes_vec_t		r			[REGISTERS_SIZE];
+	decode_cache_t	*decoded;					/* Filled from any lane, dropped on write */
+	unsigned char	written		[MEMORY_SIZE];	/* Word written by some lane */
+} lanes_t;
+
+#endif
+
+#ifdef VM_OPENCL
+
+/* OpenCL device and buffers of one batch, host copies mirror them */
+typedef struct {
+	cl_context			context;
+	cl_command_queue	queue;
+	cl_program			program;
+	cl_kernel			kernel;
+	cl_mem				memory;
+	cl_mem				regs;
+	cl_mem				pcs;
+	cl_mem				sps;
+	cl_mem				status;
+	cl_mem				stacks;
+	unsigned short		*host_regs;
+	unsigned int		*host_pcs;
+	unsigned int		*host_sps;
+	unsigned char		*host_status;
+	unsigned short		*host_stacks;
+	buffer_t			input;					/* Input of candidate finished on host */
+} gpu_t;
+
+#endif
+
+/**
+ * Scheduler states of instance
+ *   - woken means sched_wake() came while slice was running
+ */
+
+#define SCHED_QUEUED			0
+#define SCHED_RUNNING			1
+#define SCHED_PARKED			2
+#define SCHED_WOKEN				3
+
+#define SCHED_QUEUE_SIZE		64
+
+/* Runnable instances of one worker, others steal from head */
+typedef struct {
+	pthread_mutex_t	lock;
+	vm_t			**items;
+	int				head;
+	int				count;
+	int				size;
+} sched_queue_t;
+
+typedef struct {
+	sched_t			*sched;
+	int				index;
+	pthread_t		thread;
+	sched_queue_t	queue;
+} sched_worker_t;
+
+struct sched {
+	int				threads;
+	unsigned long long	slice;
+	vm_done_fn		done;
+	sched_worker_t	*worker;
+	unsigned int	next;						/* Queue for next submit or wake */
+	int				runnable;					/* Queued in all queues */
+	int				idle;						/* Workers waiting for work */
+
+	/* Settling, protected by lock */
+	pthread_mutex_t	lock;
+	pthread_cond_t	ready;
+	pthread_cond_t	settled;
+	int				live;						/* Submitted and not finished */
+	int				parked;
+	int				stop;
+};
+
+/*************************************************************
+ * Declarations
+ */
+
+/* Registers functions */
+void			reg_init		(vm_t *vm);
+unsigned short 	reg_read		(vm_t *vm, unsigned short address);
+void 			reg_write		(vm_t *vm, unsigned short address, unsigned short value);
+
+/* Memory functions */
+void			mem_init		(vm_t *vm);
+unsigned short 	mem_read		(vm_t *vm, unsigned short address);
+void 			mem_write		(vm_t *vm, unsigned short address, unsigned short value);
+
+/* Arenas */
+void			*huge_alloc		(size_t size);
+void			*arena_get		(arena_t *arena, size_t size);
+void			arena_put		(arena_t *arena, void *block);
+
+/* Stack functions */
+void			stack_init		(vm_t *vm);
+int				stack_is_empty	(vm_t *vm);
+int				stack_is_full	(vm_t *vm);
+unsigned short 	stack_pop		(vm_t *vm);
+void		 	stack_push		(vm_t *vm, unsigned short val);
+void			stack_reserve	(stack_t *stack, int words);
+void			stack_trim		(stack_t *stack);
+void			stack_release	(stack_t *stack);
+void			stack_copy		(stack_t *dst, const stack_t *src, int start, int count);
+
+/* State hashes */
+void			hash_reset		(vm_t *vm);
+
+/* Binary file functions */
+int binary_init					(vm_t *vm, int argc, char *argv[]);
+int binary_load					(vm_t *vm);
+int binary_exec					(vm_t *vm);
+
+/* Image cache */
+unsigned long long	aot_key		(const vm_t *vm);
+int				aot_load		(vm_t *vm);
+int				aot_save		(vm_t *vm);
+void			aot_release		(vm_t *vm);
+
+/* Virtual machine instances, library interface is declared in vm.h */
+void			vm_clone		(vm_t *dst, const vm_t *src);
+int				vm_exec			(vm_t *vm);
+
+/* Snapshots */
+snapshot_t		*snapshot_create	(void);
+void			snapshot_destroy	(snapshot_t *snapshot);
+void			snapshot_take		(vm_t *vm, snapshot_t *snapshot);
+void			snapshot_restore	(vm_t *vm, const snapshot_t *snapshot);
+vm_t			*vm_fork			(const snapshot_t *snapshot);
+
+/* Checkpoints */
+int				checkpoint_save		(vm_t *vm, const char *path);
+int				checkpoint_load		(vm_t *vm, const char *path);
+void			checkpoint_signal	(int signal);
+int				checkpoint_command	(vm_t *vm, buffer_t *buffer);
+void			checkpoint_poll		(vm_t *vm);
+
+/* Execution engines */
+int exec_switch					(vm_t *vm);
+int exec_threaded				(vm_t *vm);
+int exec_decoded				(vm_t *vm);
+int exec_jit					(vm_t *vm);
+int exec_paranoid				(vm_t *vm);
+int exec_trace					(vm_t *vm);
+
+/* JIT compiler */
+int				jit_init		(vm_t *vm);
+void			jit_flush		(vm_t *vm);
+int				jit_compile		(vm_t *vm, unsigned short start);
+void			jit_invalidate	(vm_t *vm, int start, int end);
+
+/* Instruction decoder */
+void			decode_init		(vm_t *vm);
+void			decode_insn		(vm_t *vm, unsigned short address);
+void			decode_fill		(vm_t *vm, decode_t *d, unsigned short address);
+void			decode_fuse		(vm_t *vm, unsigned short address);
+void			decode_invalidate	(vm_t *vm, int start, int end);
+
+/* Static analysis */
+int				cfg_insn		(const vm_t *vm, int address);
+void			cfg_build		(vm_t *vm);
+void			cfg_dump		(vm_t *vm, FILE *fp, int format);
+void			cfg_effects		(vm_t *vm);
+cfg_func_t		*cfg_func		(cfg_t *cfg, int address);
+void			cfg_range		(cfg_range_t *range, const decode_t *d);
+int				cfg_range_wraps	(const cfg_range_t *range, const decode_t *d);
+
+/* Execution trace */
+int				trace_open		(vm_t *vm, const char *path);
+void			trace_close		(vm_t *vm);
+void			trace_publish	(trace_t *trace);
+void			*trace_writer	(void *arg);
+void			trace_record	(vm_t *vm, int pc, unsigned short opcode, const unsigned short *values, int count, int reg);
+int				trace_dump		(const char *spec, FILE *fp);
+
+/* Reverse debugger */
+int				debug_run		(vm_t *vm, int port);
+int				debug_serve		(vm_t *vm);
+int				debug_resume	(vm_t *vm, int mode);
+void			debug_seek		(vm_t *vm, unsigned long long target);
+void			debug_snapshot	(vm_t *vm);
+void			debug_truncate	(vm_t *vm);
+int				debug_in		(vm_t *vm);
+void			debug_out		(vm_t *vm, unsigned short value);
+
+/* Session server */
+int				serve_run		(vm_t *vm, const char *spec);
+void			serve_accept	(serve_t *serve);
+void			serve_read		(serve_t *serve, serve_session_t *s);
+void			serve_exec		(serve_t *serve, serve_session_t *s);
+int				serve_flush		(serve_session_t *s);
+void			serve_queue		(serve_t *serve, serve_session_t *s);
+void			serve_watch		(serve_t *serve, serve_session_t *s);
+void			serve_close		(serve_t *serve, serve_session_t *s);
+void			serve_out		(vm_t *vm, unsigned short value);
+
+/* Breakpoints and watchpoints, public functions are declared in vm.h */
+break_t			*break_get		(vm_t *vm);
+void			break_update	(vm_t *vm, int address);
+int				break_exec		(vm_t *vm, int *pc);
+int				break_option	(vm_t *vm, const char *spec);
+
+/* Strings index */
+void			strings_index	(strings_t *strings, const unsigned short *memory, int length);
+const string_t	*strings_lookup	(const strings_t *strings, int address);
+int				strings_run		(vm_t *vm, const char *query);
+
+/* Pure subroutine acceleration */
+int				accel_declare	(const char *spec, int native);
+int				accel_add		(unsigned short address, int inputs, int outputs, accel_native_fn native);
+int				accel_auto		(vm_t *vm);
+int				accel_call		(vm_t *vm, unsigned short target, unsigned short next);
+void			accel_ret		(vm_t *vm, unsigned short address);
+accel_entry_t	*accel_lookup	(vm_t *vm, int func, const unsigned short *inputs, int insert);
+int				accel_ackermann	(unsigned short *registers);
+
+/* Console and buffer I/O */
+void			io_flush		();
+int				io_stdin		(vm_t *vm);
+void			io_stdout		(vm_t *vm, unsigned short value);
+int				io_buffer_in	(vm_t *vm);
+void			io_buffer_out	(vm_t *vm, unsigned short value);
+int				io_script_in	(vm_t *vm);
+void			io_discard_out	(vm_t *vm, unsigned short value);
+void			io_forward_end	(vm_t *vm);
+int				buffer_read		(buffer_t *buffer, const char *path);
+int				buffer_map		(buffer_t *buffer, const char *path);
+
+/* Parallel search */
+int				search_option	(int opt, const char *arg);
+int				search_run		(vm_t *vm);
+void			*search_worker	(void *arg);
+int				search_apply	(vm_t *vm, int candidate, buffer_t *input);
+int				search_match	(vm_t *vm);
+void			search_report	(vm_t *vm, int candidate, int status);
+int				search_call		(vm_t *vm);
+void			search_out		(vm_t *vm, unsigned short value);
+
+/* Lockstep lanes */
+#if HAVE_LANES
+void			*search_lanes	(void *arg);
+int				lanes_exec		(lanes_t *lanes);
+#endif
+#ifdef VM_OPENCL
+int				gpu_sweep		(vm_t *vm);
+int				gpu_open		(gpu_t *gpu, vm_t *vm);
+void			gpu_close		(gpu_t *gpu);
+int				gpu_batch		(gpu_t *gpu, vm_t *vm, int first, int count);
+void			gpu_finish		(gpu_t *gpu, vm_t *vm, int item, int candidate);
+#endif
+
+/* Scheduler, public functions are declared in vm.h */
+void			*sched_worker	(void *arg);
+void			sched_push		(sched_t *sched, int index, vm_t *vm);
+vm_t			*sched_take		(sched_t *sched, int index);
+
+/* Benchmarks */
+int				bench_run		(vm_t *vm);
+int				bench_program	(const char *name, const vm_t *image, int index);
+
+/* Hardware counters */
+int				perf_open		(perf_t *perf);
+void			perf_close		(perf_t *perf);
+void			perf_start		(perf_t *perf);
+void			perf_stop		(perf_t *perf);
+int				perf_read		(const perf_t *perf, unsigned long long *values);
+void			perf_report		(const perf_t *perf, int engine);
+void			perf_map		(const void *code, size_t size, int start, int end);
+
+/* Differential run */
+int				diff_run		(vm_t *vm, const char *spec);
+void			diff_out		(vm_t *vm, unsigned short value);
+
+/* Execution profiler */
+#ifdef VM_PROFILE
+void			profile_init	(vm_t *vm);
+void			profile_step	(vm_t *vm, int pc, unsigned short opcode);
+void			profile_track	(vm_t *vm, int pc, unsigned short opcode, int next);
+void			profile_report	(vm_t *vm, const char *prefix);
+#endif
+
+/* CPU operation */
+int operation_exec				(vm_t *vm, unsigned short opcode, unsigned short a, unsigned short b, unsigned short c, int *jmp); 
+
+/* Helper functions */
+unsigned short 	val_get			(vm_t *vm, unsigned short input);
+
+void vm_info					(const char *fmt, ...);
+void vm_fail					(const char *fmt, ...) NORETURN;
+
+/*************************************************************
+ * Global variables
+ */
+ 
+/* Accelerated subroutines */
+accel_t			accel;
+
+/* Row tables of accel_ackermann(), one pair per thread */
+pthread_key_t	accel_rows_key;
+pthread_once_t	accel_rows_once = PTHREAD_ONCE_INIT;
+
+/* Declare pure subroutines found by cfg_effects() */
+int				accel_pure;
+
+/* Parallel search */
+search_t		search;
+
+/* Stack segment and memory region pools */
+arena_t			stack_arena = { PTHREAD_MUTEX_INITIALIZER, NULL, 0 };
+arena_t			memory_arena = { PTHREAD_MUTEX_INITIALIZER, NULL, 0 };
+
+/* Back arenas by huge pages */
+int				huge_pages;
+
+/* Instance in vm_run() on this thread, receives vm_fail() */
+__thread vm_t	*vm_active;
+
+/* Console I/O */
+console_t		console;
+
+/* Checkpoint requests */
+checkpoint_t	checkpoint;
+
+/* Benchmark mode */
+int				bench;
+
+/* Disassembly output format, -1 when not requested */
+int				objdump = -1;
+
+/* Strings query, all or address */
+const char		*strings_query;
+
+/* Profiler output prefix */
+const char		*profile_path = PROFILE_PATH;
+
+/* Hardware counters of -c, and JIT map of -M when written */
+int				perf_counters;
+perf_t			perf = { -1, { -1, -1, -1, -1 }, { 0 } };
+FILE			*perf_map_file;
+
+const char		*perf_names[PERF_COUNTERS] = { "cycles", "instructions", "branch-misses", "l1d-misses" };
+
+/* Second engine of differential run - ENGINE[:N] */
+const char		*diff_spec;
+
+/* Image cache directory of -A */
+const char		*aot_dir;
+
+/* Engine and status names by number */
+const char		*engine_names[] = { "switch", "threaded", "decoded", "jit", "paranoid", "trace" };
+const char		*status_names[] = { "halted", "stopped", "error", "running" };
+
+/* Trace recorded by -T and trace read by -R */
+const char		*trace_path;
+const char		*trace_read;
+
+/* Session server address, NULL when not serving */
+const char		*serve_address;
+
+/* GDB stub port, 0 when not debugging, and snapshot interval */
+int				debug_port;
+unsigned long long	debug_interval = DEBUG_INTERVAL;
+
+/* Native replacements by name */
+const accel_native_t accel_natives[] = {
+	{ "ackermann",	accel_ackermann },
+	{ NULL,			NULL }
+};
+
+#ifdef VM_OPENCL
+
+/**
+ * Sweep kernel, one work item per candidate
+ *
+ * State is kept in buffers between launches. Item leaves running
+ * once it returns below its own stack or meets anything host owns.
+ */
+
+const char		*gpu_source =
+	"__constant uchar lengths[22] = { 1,3,2,2,4,4,2,3,3,4,4,4,4,4,3,3,3,2,1,2,2,1 };\n"
+	"__constant uchar dests[22]   = { 0,1,0,1,1,1,0,0,0,1,1,1,1,1,1,1,0,0,0,0,1,0 };\n"
+	"__kernel void sweep(__global const ushort *m, uint length, uint steps, uint depth,\n"
+	"	__global ushort *regs, __global uint *pcs, __global uint *sps,\n"
+	"	__global uchar *status, __global ushort *stacks)\n"
+	"{\n"
+	"	size_t id = get_global_id(0);\n"
+	"	__global ushort *s = stacks + id * depth;\n"
+	"	ushort r[8], v[3];\n"
+	"	uint pc, sp, op, n, i, w, d = 0;\n"
+	"	uchar done = 0;\n"
+	"	if (status[id]) return;\n"
+	"	for (i = 0; i < 8; i++) r[i] = regs[id * 8 + i];\n"
+	"	pc = pcs[id];\n"
+	"	sp = sps[id];\n"
+	"	for (n = 0; n < steps && !done; n++) {\n"
+	"		op = pc < length ? m[pc] : 22;\n"
+	"		if (op > 21) { done = 2; break; }\n"
+	"		for (i = 1; i < lengths[op]; i++) {\n"
+	"			w = m[pc + i];\n"
+	"			if (w > 32775) { done = 2; break; }\n"
+	"			v[i - 1] = w < 32768 ? w : r[w - 32768];\n"
+	"			if (i == 1 && dests[op]) { if (w < 32768) done = 2; d = w & 7; }\n"
+	"		}\n"
+	"		if (done) break;\n"
+	"		switch (op) {\n"
+	"			case 1 : r[d] = v[1]; break;\n"
+	"			case 2 : if (sp == depth) { done = 2; continue; } s[sp++] = v[0]; break;\n"
+	"			case 3 : if (!sp) { done = 2; continue; } r[d] = s[--sp]; break;\n"
+	"			case 4 : r[d] = v[1] == v[2]; break;\n"
+	"			case 5 : r[d] = v[1] > v[2]; break;\n"
+	"			case 6 : pc = v[0]; continue;\n"
+	"			case 7 : if (v[0]) { pc = v[1]; continue; } break;\n"
+	"			case 8 : if (!v[0]) { pc = v[1]; continue; } break;\n"
+	"			case 9 : r[d] = (v[1] + v[2]) & 32767; break;\n"
+	"			case 10 : r[d] = ((uint) v[1] * v[2]) & 32767; break;\n"
+	"			case 11 : if (!v[2]) { done = 2; continue; } r[d] = v[1] % v[2]; break;\n"
+	"			case 12 : r[d] = v[1] & v[2]; break;\n"
+	"			case 13 : r[d] = v[1] | v[2]; break;\n"
+	"			case 14 : r[d] = ~v[1] & 32767; break;\n"
+	"			case 15 : r[d] = m[v[1]]; break;\n"
+	"			case 17 : if (sp == depth) { done = 2; continue; } s[sp++] = pc + 2; pc = v[0]; continue;\n"
+	"			case 18 : if (!sp) { done = 1; continue; } pc = s[--sp]; continue;\n"
+	"			case 21 : break;\n"
+	"			default : done = 2; continue;\n"
+	"		}\n"
+	"		pc += lengths[op];\n"
+	"	}\n"
+	"	for (i = 0; i < 8; i++) regs[id * 8 + i] = r[i];\n"
+	"	pcs[id] = pc;\n"
+	"	sps[id] = sp;\n"
+	"	status[id] = done;\n"
+	"}\n";
+
+#endif
+
+/* Opcode table */
+const opcode_t	opcodes		[ARCH_OPCODES] = {
+	{ "halt",	1, 0 },	{ "set",	3, 1 },	{ "push",	2, 0 },	{ "pop",	2, 1 },
+	{ "eq",		4, 1 },	{ "gt",		4, 1 },	{ "jmp",	2, 0 },	{ "jt",		3, 0 },
+	{ "jf",		3, 0 },	{ "add",	4, 1 },	{ "mult",	4, 1 },	{ "mod",	4, 1 },
+	{ "and",	4, 1 },	{ "or",		4, 1 },	{ "not",	3, 1 },	{ "rmem",	3, 1 },
+	{ "wmem",	3, 0 },	{ "call",	2, 0 },	{ "ret",	1, 0 },	{ "out",	2, 0 },
+	{ "in",		2, 1 },	{ "noop",	1, 0 }
+};
+
+/*************************************************************
+ * Functions
+ */
+
+/* Command line program, left out of library build */
+#ifndef VM_LIBRARY
+
+/**
+ * Main program function
+ */
+
+int main(int argc, char *argv[])
+{
+	struct sigaction action;
+	vm_t *vm;
+	int ret;
+
+	vm = vm_create();
+	if (!vm) {
+		vm_fail("Cannot create virtual machine ...");
+	}
+	
+	/* Set binary file path */
+	ret = binary_init(vm, argc, argv);
+	if (ret < 0) {
+		vm_fail("Please provide path to binary file ...");
+	}
+	
+	/* Print recorded trace instead of executing */
+	if (trace_read) {
+		ret = trace_dump(trace_read, stdout);
+		vm_destroy(vm);
+		return ret < 0 ? 1 : 0;
+	}
+
+	/* Benchmark synthetic programs and binary if given */
+	if (bench) {
+		ret = bench_run(vm);
+		vm_destroy(vm);
+		return ret < 0 ? 1 : 0;
+	}
+
+	/* Load program file */	
+	ret = binary_load(vm);
+	if (ret < 0) {
+		vm_fail("Loading failed ...\n");
+	}
+
+	/* Static analysis only */
+	if (objdump >= 0) {
+		cfg_build(vm);
+		cfg_dump(vm, stdout, objdump);
+		vm_destroy(vm);
+		return 0;
+	}
+
+	if (strings_query) {
+		ret = strings_run(vm, strings_query);
+		vm_destroy(vm);
+		return ret < 0 ? 1 : 0;
+	}
+
+	/* Continue from checkpoint */
+	if (checkpoint.resume && checkpoint_load(vm, checkpoint.resume) < 0) {
+		vm_fail("Cannot load checkpoint ... [%s]", checkpoint.resume);
+	}
+
+	/* Search across instances forked from this one */
+	if (search.threads) {
+		ret = search_run(vm);
+		vm_destroy(vm);
+		return ret < 0 ? 1 : 0;
+	}
+
+	/* Lockstep run on two engines */
+	if (diff_spec) {
+		ret = diff_run(vm, diff_spec);
+		vm_destroy(vm);
+		return ret < 0 ? 1 : 0;
+	}
+	
+	/* Checkpoint on SIGUSR1 at next input, interrupts blocked read */
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = checkpoint_signal;
+	sigaction(SIGUSR1, &action, NULL);
+
+	/* Execute program */
+	ret = binary_exec(vm);
+	if (ret < 0) {
+		vm_fail("Execution failed ...\n");
+	}
+
+	if (accel.funcs) {
+		vm_info("Accelerated calls: %lu hits, %lu misses", vm->accel.hits, vm->accel.misses);
+	}
+
+	vm_destroy(vm);
+	return 0;
+}
+
+#endif
+
+/**
+ * Initializes binary file
+ */
+
+int binary_init(vm_t *vm, int argc, char *argv[])
+{
+	static const struct option options[] = {
+		{ "engine",			required_argument,	NULL, 'e' },
+		{ "pure",			required_argument,	NULL, 'p' },
+		{ "native",			required_argument,	NULL, 'n' },
+		{ "auto-pure",		no_argument,		NULL, 'a' },
+		{ "input",			required_argument,	NULL, 'i' },
+		{ "threads",		required_argument,	NULL, 'j' },
+		{ "vary",			required_argument,	NULL, 'V' },
+		{ "until",			required_argument,	NULL, 'u' },
+		{ "then",			required_argument,	NULL, 't' },
+		{ "lanes",			required_argument,	NULL, 'L' },
+		{ "gpu",			required_argument,	NULL, 'G' },
+		{ "io",				required_argument,	NULL, 'o' },
+		{ "script",			required_argument,	NULL, 's' },
+		{ "forward",		no_argument,		NULL, 'f' },
+		{ "marker",			required_argument,	NULL, 'm' },
+		{ "resume",			required_argument,	NULL, 'r' },
+		{ "profile",		required_argument,	NULL, 'P' },
+		{ "bench",			no_argument,		NULL, 'B' },
+		{ "objdump",		required_argument,	NULL, 'd' },
+		{ "strings",		required_argument,	NULL, 'S' },
+		{ "trace",			required_argument,	NULL, 'T' },
+		{ "trace-read",		required_argument,	NULL, 'R' },
+		{ "gdb",			required_argument,	NULL, 'g' },
+		{ "interval",		required_argument,	NULL, 'K' },
+		{ "break",			required_argument,	NULL, 'b' },
+		{ "huge-pages",		no_argument,		NULL, 'H' },
+		{ "listen",			required_argument,	NULL, 'l' },
+		{ "counters",		no_argument,		NULL, 'c' },
+		{ "perf-map",		no_argument,		NULL, 'M' },
+		{ "diff",			required_argument,	NULL, 'D' },
+		{ "aot",			required_argument,	NULL, 'A' },
+		{ NULL,				0,					NULL, 0 }
+	};
+	char path[64];
+	int opt;
+
+	vm->binary.engine = ENGINE_SWITCH;
+	search.reg = search.until_reg = search.gpu = -1;
+
+	/* Parse options */
+	while ((opt = getopt_long(argc, argv, "e:p:n:ai:j:V:u:t:L:G:o:s:fm:r:P:Bd:S:T:R:g:K:b:Hl:cMD:A:", options, NULL)) != -1) {
+		switch (opt) {
+			/* Execution engine */
+			case 'e' :
+				if (vm_set_engine(vm, optarg) < 0) {
+					vm_fail("Unknown engine ... [%s]", optarg);
+				}
+				break;
+			/* Pure subroutine - ADDR:INPUTS:OUTPUTS */
+			case 'p' :
+				if (accel_declare(optarg, 0) < 0) {
+					vm_fail("Invalid pure subroutine ... [%s]", optarg);
+				}
+				break;
+			/* Native replacement - ADDR:NAME */
+			case 'n' :
+				if (accel_declare(optarg, 1) < 0) {
+					vm_fail("Invalid native replacement ... [%s]", optarg);
+				}
+				break;
+			/* Pure subroutines found by static analysis */
+			case 'a' :
+				accel_pure = 1;
+				break;
+			/* Instances created later take memory and stack from huge pages */
+			case 'H' :
+				vm_huge_pages(1);
+				break;
+			/* Input file fed to opcode 20 */
+			case 'i' :
+				if (buffer_read(&vm->input, optarg) < 0) {
+					vm_fail("Cannot read input file ... [%s]", optarg);
+				}
+				vm->in = io_script_in;
+				break;
+			/* Memory mapped script file fed to opcode 20 */
+			case 's' :
+				if (buffer_map(&vm->input, optarg) < 0) {
+					vm_fail("Cannot map script file ... [%s]", optarg);
+				}
+				vm->in = io_script_in;
+				break;
+			/* Disassemble and dump CFG instead of executing */
+			case 'd' :
+				if (!strcmp(optarg, "text")) {
+					objdump = CFG_FORMAT_TEXT;
+				} else if (!strcmp(optarg, "dot")) {
+					objdump = CFG_FORMAT_DOT;
+				} else if (!strcmp(optarg, "json")) {
+					objdump = CFG_FORMAT_JSON;
+				} else {
+					vm_fail("Unknown objdump format ... [%s]", optarg);
+				}
+				break;
+			/* Index strings instead of executing - all or ADDR */
+			case 'S' :
+				strings_query = optarg;
+				break;
+			/* Serve GDB remote protocol on local port */
+			case 'g' :
+				debug_port = atoi(optarg);
+				if (debug_port <= 0 || debug_port > 65535) {
+					vm_fail("Invalid debugger port ... [%s]", optarg);
+				}
+				break;
+			/* Serve sessions over TCP - [HOST:]PORT */
+			case 'l' :
+				serve_address = optarg;
+				break;
+			/* Compare with second engine - ENGINE[:N] */
+			case 'D' :
+				diff_spec = optarg;
+				break;
+			/* Count hardware events around execution */
+			case 'c' :
+				perf_counters = 1;
+				break;
+			/* Write JIT blocks for perf, before any block is compiled */
+			case 'M' :
+				snprintf(path, sizeof(path), PERF_MAP_PATH, (int) getpid());
+				perf_map_file = fopen(path, "a");
+				if (!perf_map_file) {
+					vm_fail("Cannot write perf map ... [%s]", path);
+				}
+				break;
+			/* Debugger snapshot interval */
+			case 'K' :
+				debug_interval = strtoull(optarg, NULL, 10);
+				if (!debug_interval) {
+					vm_fail("Invalid snapshot interval ... [%s]", optarg);
+				}
+				break;
+			/* Breakpoint - ADDR, w:ADDR, r:N, o:TEXT or i:TEXT */
+			case 'b' :
+				if (break_option(vm, optarg) < 0) {
+					vm_fail("Invalid breakpoint ... [%s]", optarg);
+				}
+				break;
+			/* Record execution trace */
+			case 'T' :
+				trace_path = optarg;
+				break;
+			/* Print trace instead of executing - FILE[:START[:COUNT]] */
+			case 'R' :
+				trace_read = optarg;
+				break;
+			/* Benchmark engines, binary is optional */
+			case 'B' :
+				bench = 1;
+				break;
+			/* Profiler output prefix */
+			case 'P' :
+#ifndef VM_PROFILE
+				vm_fail("Profiler is not built in, compile with -DVM_PROFILE ...");
+#endif
+				profile_path = optarg;
+				break;
+			/* Image cache directory */
+			case 'A' :
+				aot_dir = optarg;
+				break;
+			/* Checkpoint loaded after binary */
+			case 'r' :
+				checkpoint.resume = optarg;
+				break;
+			/* Suppress output until script ends or marker line */
+			case 'm' :
+				vm->marker = optarg;
+				/* fall through */
+			case 'f' :
+				vm->forward = 1;
+				break;
+			/* Console backend */
+			case 'o' :
+				if (!strcmp(optarg, "stdio")) {
+					console.backend = IO_BACKEND_STDIO;
+				} else if (!strcmp(optarg, "raw")) {
+					console.backend = IO_BACKEND_RAW;
+				} else {
+					vm_fail("Unknown I/O backend ... [%s]", optarg);
+				}
+				break;
+			/* Search options */
+			case 'j' :
+			case 'V' :
+			case 'u' :
+			case 't' :
+			case 'L' :
+			case 'G' :
+				if (search_option(opt, optarg) < 0) {
+					vm_fail("Invalid search option ... [%s]", optarg);
+				}
+				break;
+			default :
+				return -1;
+		}
+	}
+
+	if (vm->forward) {
+		if (vm->in != io_script_in) {
+			vm_fail("Fast-forward needs input or script file ...");
+		}
+		vm->out = io_discard_out;
+	}
+
+	/* Set path to binary file - first non option argument */
+	vm->binary.path = argv[optind];
+	
+	return (optind >= argc && !bench && !trace_read) ? -1 : 0;
+}
+
+/**
+ * Loads binary file into memory
+ */
+ 
+int binary_load(vm_t *vm) 
+{
+	struct stat st;
+	void *image;
+	ssize_t ret;
+	int fd, size;
+	char probe;
+
+	/* Info */
+	vm_info("Loading program ...");
+
+	/* Open binary file */
+	fd = open(vm->binary.path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		vm_fail("Cannot open binary file ... [%s]", vm->binary.path);
+	}
+
+	/* Binary must fit into 15-bit address space */
+	if (S_ISREG(st.st_mode)) {
+		if (st.st_size > MEMORY_SIZE * 2) {
+			vm_fail("Binary file too large ... [%lld B]", (long long)st.st_size);
+		}
+		vm->binary.size = st.st_size;
+	}
+
+	/*
+	 * Map regular file privately over start of memory region, pages are
+	 * shared with page cache until written. Other files are read.
+	 */
+	image = MAP_FAILED;
+	if (S_ISREG(st.st_mode) && vm->binary.size > 0 && !vm->memory.pooled) {
+		image = mmap(vm->memory.contents, vm->binary.size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_FIXED, fd, 0);
+	}
+	if (image == MAP_FAILED) {
+		size = 0;
+		while (size < MEMORY_SIZE * 2) {
+			ret = read(fd, (char *)vm->memory.contents + size, MEMORY_SIZE * 2 - size);
+			if (ret < 0) {
+				vm_fail("Cannot load binary file into memory ...");
+			}
+			if (ret == 0) {
+				break;
+			}
+			size += ret;
+		}
+		if (size == MEMORY_SIZE * 2 && read(fd, &probe, 1) > 0) {
+			vm_fail("Binary file too large ... [%s]", vm->binary.path);
+		}
+		vm->binary.size = size;
+	}
+	close(fd);
+
+	/* Info */
+	vm_info("Binary path: %s",		vm->binary.path);
+	vm_info("Binary size: %d B", 	vm->binary.size);
+
+	if (vm->binary.size % 2) {
+		vm_fail("Binary size is not multiple of word size ... [%d B]", vm->binary.size);
+	}
+
+	/* Set length of binary instructions */
+	vm->binary.length = vm->binary.size / 2;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	/* Words are stored little-endian */
+	for (size = 0; size < vm->binary.length; size++) {
+		vm->memory.contents[size] = __builtin_bswap16(vm->memory.contents[size]);
+	}
+#endif
+
+	/* Analysis of same image left by earlier launch */
+	if (aot_dir) {
+		if (vm->breaks && vm->breaks->points) {
+			vm_info("Image cache skipped with breakpoints ...");
+		} else if (aot_load(vm) < 0) {
+			vm->aot_stale = 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Executes binary file written in memory with selected engine
+ */
+ 
+int binary_exec(vm_t *vm)
+{
+	static const char *reasons[] = { "none", "pc", "memory", "register", "output", "input" };
+	int ret;
+
+	vm_info("Executing program ...");
+
+	/* Profiler reads counters too, open them first */
+	if (perf_counters && perf_open(&perf) < 0) {
+		vm_info("Hardware counters unavailable ... [%s]", strerror(errno));
+	}
+
+#ifdef VM_PROFILE
+	if (vm->binary.engine != ENGINE_SWITCH) {
+		vm_info("Profiling uses switch engine ...");
+		vm->binary.engine = ENGINE_SWITCH;
+	}
+	profile_init(vm);
+#endif
+
+	/* Image cache missed, analyze whole image before run changes it */
+	if (vm->aot_stale && aot_save(vm) < 0) {
+		vm_info("Cannot write image cache ... [%s]", aot_dir);
+	}
+
+	/* Block boundaries for decoder and JIT */
+	if (!vm->cfg && (vm->binary.engine == ENGINE_DECODED || vm->binary.engine == ENGINE_JIT || accel_pure)) {
+		cfg_build(vm);
+	}
+	if (accel_pure) {
+		vm_info("Pure subroutines found ... [declared: %d]", accel_auto(vm));
+	}
+
+	/* Tracing runs through its own loop */
+	if (trace_path) {
+		if (trace_open(vm, trace_path) < 0) {
+			vm_fail("Cannot create trace file ... [%s]", trace_path);
+		}
+		vm->binary.engine = ENGINE_TRACE;
+	}
+
+	perf_start(&perf);
+	if (serve_address) {
+		ret = serve_run(vm, serve_address);
+	} else {
+		ret = debug_port ? debug_run(vm, debug_port) : vm_exec(vm);
+	}
+	perf_stop(&perf);
+	io_flush();
+
+	if (vm->trace) {
+		trace_close(vm);
+	}
+
+#ifdef VM_PROFILE
+	profile_report(vm, profile_path);
+#endif
+	if (perf.leader >= 0) {
+		perf_report(&perf, vm->binary.engine);
+		perf_close(&perf);
+	}
+
+	if (ret == VM_STOPPED && vm->breaks && vm->breaks->reason != VM_BREAK_NONE) {
+		vm_info("Breakpoint hit ... [%s: %d]", reasons[vm->breaks->reason], vm->breaks->address);
+	}
+	if (ret == VM_STOPPED) {
+		vm_info("Execution stopped ... [pc: %d]", vm->pc);
+		return 0;
+	}
+
+	/* Execution halted */
+	vm_info("Execution halted ... [pc: %d]", vm->pc);
+	return 0;
+}
+
+/**
+ * Allocates virtual machine instance with console I/O
+ */
+
+vm_t *vm_create()
+{
+	vm_t *vm;
+
+	if (posix_memalign((void **) &vm, CACHE_LINE, sizeof(vm_t))) {
+		return NULL;
+	}
+	memset(vm, 0, sizeof(vm_t));
+
+	/* Anonymous pages read as zero, binary is mapped over them */
+	if (huge_pages) {
+		vm->memory.contents	= arena_get(&memory_arena, MEMORY_SLOT_SIZE);
+		vm->memory.pooled	= 1;
+	} else {
+		vm->memory.contents = mmap(NULL, MEMORY_MAP_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+	if (!vm->memory.contents || vm->memory.contents == MAP_FAILED) {
+		free(vm);
+		return NULL;
+	}
+
+	vm->in	= io_stdin;
+	vm->out	= io_stdout;
+
+	reg_init(vm);
+	mem_init(vm);
+	stack_init(vm);
+	return vm;
+}
+
+/**
+ * Takes memory and stack of instances created later from huge pages
+ */
+
+void vm_huge_pages(int enable)
+{
+	huge_pages = enable;
+}
+
+/**
+ * Releases virtual machine instance and its caches
+ */
+
+void vm_destroy(vm_t *vm)
+{
+	if (vm->jit) {
+		if (vm->jit->code) {
+			munmap(vm->jit->code, JIT_CODE_SIZE);
+		}
+		free(vm->jit);
+	}
+
+	if (vm->memory.pooled) {
+		arena_put(&memory_arena, vm->memory.contents);
+	} else {
+		munmap(vm->memory.contents, MEMORY_MAP_SIZE);
+	}
+	stack_release(&vm->stack);
+	aot_release(vm);
+	free(vm->cfg);
+	free(vm->decoded);
+	free(vm->breaks);
+	free(vm->accel.table);
+	free(vm->accel.frame);
+	free(vm->output.data);
+	free(vm);
+}
+
+/**
+ * Loads binary image from memory, resets machine state
+ *
+ * Image is in file format (little-endian words) and is copied.
+ */
+
+int vm_load_image(vm_t *vm, const void *image, size_t size)
+{
+	int i;
+
+	if (size > MEMORY_SIZE * sizeof(unsigned short) || size % 2) {
+		snprintf(vm->error, sizeof(vm->error), "Binary image has invalid size ... [%zu B]", size);
+		return -1;
+	}
+
+	mem_init(vm);
+	memcpy(vm->memory.contents, image, size);
+	vm->binary.path		= NULL;
+	vm->binary.size		= size;
+	vm->binary.length	= size / 2;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	for (i = 0; i < vm->binary.length; i++) {
+		vm->memory.contents[i] = __builtin_bswap16(vm->memory.contents[i]);
+	}
+#else
+	(void) i;
+#endif
+
+	reg_init(vm);
+	stack_init(vm);
+	stack_trim(&vm->stack);
+	vm->pc			= 0;
+	vm->stop		= 0;
+	vm->failed		= 0;
+	vm->error[0]	= '\0';
+	vm->accel.depth	= 0;
+	vm->snapshot	= NULL;
+
+	/* Caches describe previous image */
+	aot_release(vm);
+	free(vm->cfg);
+	vm->cfg = NULL;
+	if (vm->decoded) {
+		vm->decoded->active = 0;
+	}
+	if (vm->jit && vm->jit->active) {
+		jit_flush(vm);
+	}
+
+	return 0;
+}
+
+/**
+ * Selects execution engine by name, returns -1 for unknown name
+ */
+
+int vm_set_engine(vm_t *vm, const char *name)
+{
+	if (!strcmp(name, "switch")) {
+		vm->binary.engine = ENGINE_SWITCH;
+	} else if (!strcmp(name, "threaded")) {
+		vm->binary.engine = ENGINE_THREADED;
+	} else if (!strcmp(name, "decoded")) {
+		vm->binary.engine = ENGINE_DECODED;
+	} else if (!strcmp(name, "jit")) {
+		vm->binary.engine = ENGINE_JIT;
+	} else if (!strcmp(name, "paranoid")) {
+		vm->binary.engine = ENGINE_PARANOID;
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Runs instance until halt, stop, error or end of instruction budget
+ *
+ * Errors raised by vm_fail() jump back here, instance is marked failed
+ * until next image is loaded. Calls may nest for different instances.
+ */
+
+int vm_run(vm_t *vm, unsigned long long max_instructions)
+{
+	vm_t *outer = vm_active;
+	jmp_buf trap;
+	int ret;
+
+	if (vm->failed) {
+		return VM_ERROR;
+	}
+
+	vm->stop	= 0;
+	vm->budget	= max_instructions;
+	vm->trap	= &trap;
+	vm_active	= vm;
+
+	if (setjmp(trap)) {
+		vm->failed	= 1;
+		ret			= VM_ERROR;
+	} else {
+		ret = vm_exec(vm);
+	}
+
+	vm->budget	= 0;
+	vm->trap	= NULL;
+	vm_active	= outer;
+	return ret;
+}
+
+/**
+ * Executes single instruction
+ *
+ * Goes through switch engine, others may run fused instructions
+ * or whole block on one dispatch.
+ */
+
+int vm_step(vm_t *vm)
+{
+	int engine = vm->binary.engine;
+	int ret;
+
+	vm->binary.engine = ENGINE_SWITCH;
+	ret = vm_run(vm, 1);
+	vm->binary.engine = engine;
+
+	return ret;
+}
+
+/**
+ * Sets input and output callbacks, NULL keeps current one
+ */
+
+void vm_set_io(vm_t *vm, vm_in_fn in, vm_out_fn out)
+{
+	if (in) {
+		vm->in = in;
+	}
+	if (out) {
+		vm->out = out;
+	}
+}
+
+/**
+ * Sets callback receiving messages of instance
+ */
+
+void vm_set_log(vm_t *vm, vm_log_fn log)
+{
+	vm->log = log;
+}
+
+/**
+ * Sets and returns pointer passed through to callbacks
+ */
+
+void vm_set_user(vm_t *vm, void *user)
+{
+	vm->user = user;
+}
+
+void *vm_user(const vm_t *vm)
+{
+	return vm->user;
+}
+
+/**
+ * Returns last error of instance, empty when there was none
+ */
+
+const char *vm_error(const vm_t *vm)
+{
+	return vm->error;
+}
+
+/**
+ * Returns program counter and register values
+ */
+
+int vm_pc(const vm_t *vm)
+{
+	return vm->pc;
+}
+
+unsigned short vm_register(const vm_t *vm, int index)
+{
+	return (index >= 0 && index < REGISTERS_SIZE) ? vm->registers.contents[index] : 0;
+}
+
+/**
+ * Sets or clears breakpoint and write watchpoints, -1 for invalid one
+ */
+
+int vm_break(vm_t *vm, int pc, int enable)
+{
+	break_t *b;
+
+	if (pc < 0 || pc >= MEMORY_SIZE) {
+		return -1;
+	}
+
+	b = break_get(vm);
+	if (!(b->flags[pc] & BREAK_PC) == !enable) {
+		return 0;
+	}
+	b->flags[pc]	^= BREAK_PC;
+	b->points		+= enable ? 1 : -1;
+	break_update(vm, pc);
+
+	return 0;
+}
+
+int vm_watch_memory(vm_t *vm, int address, int enable)
+{
+	break_t *b;
+
+	if (address < 0 || address >= MEMORY_SIZE) {
+		return -1;
+	}
+
+	b = break_get(vm);
+	if (!(b->flags[address] & BREAK_WRITE) == !enable) {
+		return 0;
+	}
+	b->flags[address]	^= BREAK_WRITE;
+	b->words			+= enable ? 1 : -1;
+	b->points			+= enable ? 1 : -1;
+
+	/* First and last watched word change every wmem entry */
+	if (b->words == !!enable) {
+		break_update(vm, -1);
+	}
+
+	return 0;
+}
+
+int vm_watch_register(vm_t *vm, int index, int enable)
+{
+	break_t *b;
+
+	if (index < 0 || index >= REGISTERS_SIZE) {
+		return -1;
+	}
+
+	b = break_get(vm);
+	if (!(b->regs & (1 << index)) == !enable) {
+		return 0;
+	}
+	b->regs		^= 1 << index;
+	b->points	+= enable ? 1 : -1;
+	break_update(vm, -1);
+
+	return 0;
+}
+
+/**
+ * Sets break once output or input ends with pattern, NULL clears it
+ */
+
+static int vm_break_pattern(vm_t *vm, int which, const char *pattern)
+{
+	break_t *b;
+
+	if (pattern && strlen(pattern) >= BREAK_PATTERN_SIZE) {
+		return -1;
+	}
+
+	b = break_get(vm);
+	b->points -= b->pattern[which][0] != '\0';
+	snprintf(b->pattern[which], BREAK_PATTERN_SIZE, "%s", pattern ? pattern : "");
+	b->points += b->pattern[which][0] != '\0';
+	b->seen[which][0] = '\0';
+	break_update(vm, -1);
+
+	return 0;
+}
+
+int vm_break_output(vm_t *vm, const char *pattern)
+{
+	return vm_break_pattern(vm, BREAK_OUTPUT, pattern);
+}
+
+int vm_break_input(vm_t *vm, const char *pattern)
+{
+	return vm_break_pattern(vm, BREAK_INPUT, pattern);
+}
+
+/**
+ * Returns reason of last stop, VM_BREAK_NONE if no break was hit
+ *
+ * Address is pc, watched word, register index or pc of matched output
+ * or input.
+ */
+
+int vm_break_reason(const vm_t *vm, int *address)
+{
+	if (!vm->breaks) {
+		return VM_BREAK_NONE;
+	}
+
+	if (address) {
+		*address = vm->breaks->address;
+	}
+	return vm->breaks->reason;
+}
+
+/**
+ * Copies machine state of one instance into another
+ *
+ * Only binary info, pc, registers, memory and stack are copied, caches
+ * of destination are invalidated and its I/O setup is kept.
+ */
+
+void vm_clone(vm_t *dst, const vm_t *src)
+{
+	dst->binary		= src->binary;
+	dst->pc			= src->pc;
+	dst->stop		= 0;
+	dst->registers	= src->registers;
+	memcpy(dst->memory.contents, src->memory.contents, MEMORY_SIZE * sizeof(unsigned short));
+
+	stack_copy(&dst->stack, &src->stack, 0, src->stack.position + 1);
+	dst->stack.position = src->stack.position;
+	stack_trim(&dst->stack);
+
+	if (dst->decoded) {
+		dst->decoded->active = 0;
+	}
+	if (dst->jit && dst->jit->active) {
+		jit_flush(dst);
+	}
+
+	/* Memo table stays valid, recorded calls do not */
+	dst->accel.depth	= 0;
+	dst->snapshot		= NULL;
+}
+
+/**
+ * Allocates empty snapshot
+ */
+
+snapshot_t *snapshot_create()
+{
+	snapshot_t *snapshot;
+
+	snapshot = calloc(1, sizeof(snapshot_t));
+	if (snapshot) {
+		snapshot->memory.contents = calloc(MEMORY_SIZE, sizeof(unsigned short));
+	}
+	if (!snapshot || !snapshot->memory.contents) {
+		vm_fail("Function %s() failed!", __FUNCTION__);
+	}
+
+	snapshot->stack.position = -1;
+	return snapshot;
+}
+
+/**
+ * Releases snapshot
+ */
+
+void snapshot_destroy(snapshot_t *snapshot)
+{
+	stack_release(&snapshot->stack);
+	free(snapshot->memory.contents);
+	free(snapshot);
+}
+
+/**
+ * Returns number of memory words in page
+ */
+
+static int snapshot_page_words(int page, int size)
+{
+	int start = page << SNAPSHOT_PAGE_SHIFT;
+
+	return (start + SNAPSHOT_PAGE_WORDS > size) ? size - start : SNAPSHOT_PAGE_WORDS;
+}
+
+/**
+ * Copies stack segments whose dirty bit is set
+ */
+
+static void snapshot_stack_copy(stack_t *dst, const stack_t *src, unsigned long long dirty)
+{
+	int start, words;
+
+	for (start = 0; start <= src->position; start += STACK_SEGMENT_WORDS) {
+		if (dirty & SNAPSHOT_STACK_BIT(start)) {
+			words = src->position + 1 - start;
+			stack_copy(dst, src, start, words < STACK_SEGMENT_WORDS ? words : STACK_SEGMENT_WORDS);
+		}
+	}
+	dst->position = src->position;
+}
+
+/**
+ * Captures machine state into snapshot
+ *
+ * When instance was last synced with this snapshot, only pages written
+ * since then are copied. Instances synced with older generation of the
+ * snapshot do full copy on their next restore.
+ */
+
+void snapshot_take(vm_t *vm, snapshot_t *snapshot)
+{
+	unsigned long long all = ~0ULL;
+	int full, page, start;
+
+	full = vm->snapshot != snapshot || vm->generation != snapshot->generation;
+
+	for (page = 0; page < SNAPSHOT_PAGES; page++) {
+		start = page << SNAPSHOT_PAGE_SHIFT;
+
+		if ((full ? all : vm->dirty_memory) & (1ULL << page)) {
+			memcpy(&snapshot->memory.contents[start], &vm->memory.contents[start],
+				snapshot_page_words(page, MEMORY_SIZE) * sizeof(unsigned short));
+		}
+	}
+	snapshot_stack_copy(&snapshot->stack, &vm->stack, full ? all : vm->dirty_stack);
+
+	snapshot->binary			= vm->binary;
+	snapshot->pc				= vm->pc;
+	snapshot->registers			= vm->registers;
+	snapshot->hash_memory		= vm->hash_memory;
+	snapshot->hash_stack		= vm->hash_stack;
+	snapshot->generation++;
+
+	vm->snapshot		= snapshot;
+	vm->generation		= snapshot->generation;
+	vm->dirty_memory	= 0;
+	vm->dirty_stack		= 0;
+}
+
+/**
+ * Restores machine state from snapshot
+ *
+ * Instance synced with the same generation of the snapshot copies back
+ * only pages written since, caches covering those pages are invalidated.
+ */
+
+void snapshot_restore(vm_t *vm, const snapshot_t *snapshot)
+{
+	unsigned long long memory, stack;
+	int page, start, words;
+
+	if (vm->snapshot == snapshot && vm->generation == snapshot->generation) {
+		memory	= vm->dirty_memory;
+		stack	= vm->dirty_stack;
+	} else {
+		memory	= ~0ULL;
+		stack	= ~0ULL;
+
+		/* Everything changes, drop caches at once */
+		if (vm->decoded) {
+			vm->decoded->active = 0;
+		}
+		if (vm->jit && vm->jit->active) {
+			jit_flush(vm);
+		}
+	}
+
+	for (page = 0; page < SNAPSHOT_PAGES; page++) {
+		start = page << SNAPSHOT_PAGE_SHIFT;
+
+		if (memory & (1ULL << page)) {
+			words = snapshot_page_words(page, MEMORY_SIZE);
+			memcpy(&vm->memory.contents[start], &snapshot->memory.contents[start],
+				words * sizeof(unsigned short));
+
+			if (vm->decoded && vm->decoded->active) {
+				decode_invalidate(vm, start, start + words);
+			}
+			if (vm->jit && vm->jit->active) {
+				jit_invalidate(vm, start, start + words);
+			}
+		}
+	}
+	snapshot_stack_copy(&vm->stack, &snapshot->stack, stack);
+
+	vm->binary			= snapshot->binary;
+	vm->pc				= snapshot->pc;
+	vm->stop			= 0;
+	vm->registers		= snapshot->registers;
+	vm->hash_memory		= snapshot->hash_memory;
+	vm->hash_stack		= snapshot->hash_stack;
+	vm->accel.depth		= 0;
+
+	vm->snapshot		= snapshot;
+	vm->generation		= snapshot->generation;
+	vm->dirty_memory	= 0;
+	vm->dirty_stack		= 0;
+}
+
+/**
+ * Creates new instance with state of snapshot
+ */
+
+vm_t *vm_fork(const snapshot_t *snapshot)
+{
+	vm_t *vm;
+
+	vm = vm_create();
+	if (!vm) {
+		return NULL;
+	}
+
+	snapshot_restore(vm, snapshot);
+	return vm;
+}
+
+/**
+ * Writes machine state into checkpoint file
+ *
+ * Called at input so pc is at the reading instruction, which is executed
+ * again after load. File is replaced atomically.
+ */
+
+int checkpoint_save(vm_t *vm, const char *path)
+{
+	checkpoint_header_t header;
+	struct iovec iov[CHECKPOINT_IOV];
+	char temp[4096];
+	ssize_t size = 0;
+	int fd, n = 0, start, words, failed = 0;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+	memcpy(header.registers, vm->registers.contents, sizeof(header.registers));
+	header.version			= CHECKPOINT_VERSION;
+	header.order			= CHECKPOINT_ORDER;
+	header.pc				= vm->pc;
+	header.stack_position	= vm->stack.position;
+	header.memory_size		= MEMORY_SIZE;
+	header.binary_size		= vm->binary.size;
+	header.input_position	= vm->input.position;
+
+	snprintf(temp, sizeof(temp), "%s.tmp", path);
+	fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return -1;
+	}
+
+	/* Header, live part of each stack segment and memory, in batches */
+	iov[n].iov_base	= &header;
+	iov[n].iov_len	= sizeof(header);
+	size += iov[n++].iov_len;
+	for (start = 0; start <= vm->stack.position; start += STACK_SEGMENT_WORDS) {
+		words = vm->stack.position + 1 - start;
+		iov[n].iov_base	= vm->stack.segment[start >> STACK_SEGMENT_SHIFT];
+		iov[n].iov_len	= (words < STACK_SEGMENT_WORDS ? words : STACK_SEGMENT_WORDS) * sizeof(unsigned short);
+		size += iov[n++].iov_len;
+
+		if (n == CHECKPOINT_IOV - 1) {
+			failed |= writev(fd, iov, n) != size;
+			size = n = 0;
+		}
+	}
+	iov[n].iov_base	= vm->memory.contents;
+	iov[n].iov_len	= MEMORY_SIZE * sizeof(unsigned short);
+	size += iov[n++].iov_len;
+	failed |= writev(fd, iov, n) != size;
+
+	if (close(fd) < 0 || failed || rename(temp, path) < 0) {
+		unlink(temp);
+		return -1;
+	}
+
+	vm_info("Checkpoint saved ... [%s] [pc: %d]", path, vm->pc);
+	return 0;
+}
+
+/**
+ * Loads machine state from checkpoint file
+ */
+
+int checkpoint_load(vm_t *vm, const char *path)
+{
+	const checkpoint_header_t *header;
+	const unsigned short *stack;
+	struct stat st;
+	size_t size;
+	void *data;
+	int fd, start, words;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(checkpoint_header_t)) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return -1;
+	}
+
+	/* Header must match this build and file size */
+	header	= data;
+	stack	= (const unsigned short *) (header + 1);
+	size	= sizeof(*header) + (header->stack_position + 1 + MEMORY_SIZE) * sizeof(unsigned short);
+	if (memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) ||
+		header->version != CHECKPOINT_VERSION || header->order != CHECKPOINT_ORDER ||
+		header->memory_size != MEMORY_SIZE || header->pc >= MEMORY_SIZE ||
+		header->stack_position < -1 || header->stack_position >= STACK_LIMIT ||
+		size != (size_t) st.st_size) {
+		munmap(data, st.st_size);
+		return -1;
+	}
+
+	if (header->binary_size != vm->binary.size) {
+		vm_info("Checkpoint was taken with different binary ... [%d B]", header->binary_size);
+	}
+
+	memcpy(vm->registers.contents, header->registers, sizeof(vm->registers.contents));
+	memcpy(vm->memory.contents, stack + header->stack_position + 1, MEMORY_SIZE * sizeof(unsigned short));
+	vm->pc				= header->pc;
+	vm->stop			= 0;
+	vm->accel.depth		= 0;
+
+	/* Stack is stored flat, split it into segments */
+	stack_reserve(&vm->stack, header->stack_position + 1);
+	for (start = 0; start <= header->stack_position; start += STACK_SEGMENT_WORDS) {
+		words = header->stack_position + 1 - start;
+		memcpy(vm->stack.segment[start >> STACK_SEGMENT_SHIFT], stack + start,
+			(words < STACK_SEGMENT_WORDS ? words : STACK_SEGMENT_WORDS) * sizeof(unsigned short));
+	}
+	vm->stack.position	= header->stack_position;
+	stack_trim(&vm->stack);
+
+	/* Same input file continues where checkpoint was taken */
+	if (header->input_position <= vm->input.length) {
+		vm->input.position = header->input_position;
+	}
+
+	/* Everything changed */
+	aot_release(vm);
+	if (vm->decoded) {
+		vm->decoded->active = 0;
+	}
+	if (vm->jit && vm->jit->active) {
+		jit_flush(vm);
+	}
+	vm->snapshot = NULL;
+
+	vm_info("Checkpoint loaded ... [%s] [pc: %d]", path, vm->pc);
+	munmap(data, st.st_size);
+	return 0;
+}
+
+/**
+ * Requests checkpoint at next input
+ */
+
+void checkpoint_signal(int signal)
+{
+	checkpoint.requested = 1;
+}
+
+/**
+ * Handles checkpoint command line at current buffer position
+ *
+ * Line is consumed and not fed to program. Returns 1 when line was
+ * a command.
+ */
+
+int checkpoint_command(vm_t *vm, buffer_t *buffer)
+{
+	size_t length = sizeof(CHECKPOINT_COMMAND) - 1, end;
+	char path[4096];
+
+	if (buffer->length - buffer->position <= length ||
+		memcmp(buffer->data + buffer->position, CHECKPOINT_COMMAND, length)) {
+		return 0;
+	}
+
+	for (end = buffer->position; end < buffer->length && buffer->data[end] != '\n'; end++);
+
+	snprintf(path, sizeof(path), "%.*s",
+		(int) (end - buffer->position - length), buffer->data + buffer->position + length);
+	buffer->position = end + (end < buffer->length);
+
+	if (checkpoint_save(vm, path) < 0) {
+		vm_info("Cannot save checkpoint ... [%s]", path);
+	}
+	return 1;
+}
+
+/**
+ * Saves checkpoint requested by signal
+ */
+
+void checkpoint_poll(vm_t *vm)
+{
+	char path[64];
+
+	if (!checkpoint.requested) {
+		return;
+	}
+
+	checkpoint.requested = 0;
+	snprintf(path, sizeof(path), CHECKPOINT_SIGNAL_PATH, (int) getpid());
+	if (checkpoint_save(vm, path) < 0) {
+		vm_info("Cannot save checkpoint ... [%s]", path);
+	}
+}
+
+/**
+ * Hashes loaded image, names its cache file
+ */
+
+unsigned long long aot_key(const vm_t *vm)
+{
+	unsigned long long key = 14695981039346656037ULL ^ vm->binary.size;
+	int i;
+
+	for (i = 0; i < vm->binary.length; i++) {
+		key = (key ^ vm->memory.contents[i]) * 1099511628211ULL;
+	}
+	return key;
+}
+
+/* Cache file of loaded image */
+static void aot_path(const vm_t *vm, char *path, size_t size)
+{
+	snprintf(path, size, "%s/%016llx.aot", aot_dir, aot_key(vm));
+}
+
+/* Cache owns pointer when it lies in mapped file */
+static int aot_owns(const vm_t *vm, const void *pointer)
+{
+	const char *data = vm->aot;
+
+	return data && (const char *) pointer >= data && (const char *) pointer < data + vm->aot_size;
+}
+
+#if HAVE_JIT
+/* Maps compiled blocks over start of JIT buffer, copies them if that fails */
+static int aot_jit(vm_t *vm, int fd, const aot_header_t *header)
+{
+	const jit_block_t *table = (const jit_block_t *) ((const char *) header + header->jit_offset);
+	const jit_block_t *block;
+	jit_t *jit;
+	int i, a, size;
+
+	if (jit_init(vm) < 0) {
+		return 0;
+	}
+	jit = vm->jit;
+
+	if (header->jit_used > 0 && mmap(jit->code, header->jit_used, PROT_READ | PROT_WRITE | PROT_EXEC,
+			MAP_PRIVATE | MAP_FIXED, fd, header->code_offset) == MAP_FAILED) {
+		memcpy(jit->code, (const char *) header + header->code_offset, header->jit_used);
+	}
+	jit->used = header->jit_used;
+
+	for (i = 0; i < header->jit_blocks; i++) {
+		block = &table[i];
+		if (block->start >= block->end || block->end > vm->binary.length ||
+			block->entry < 0 || block->entry >= header->jit_used) {
+			continue;
+		}
+
+		jit->block[jit->blocks++] = *block;
+		for (a = block->start; a < block->end; a++) {
+			jit->covered[a]++;
+		}
+		jit->entries[block->start] = (jit_block_fn) (jit->code + block->entry);
+
+		/* Blocks were compiled in table order */
+		if (perf_map_file) {
+			size = (i + 1 < header->jit_blocks ? table[i + 1].entry : header->jit_used) - block->entry;
+			perf_map(jit->code + block->entry, size, block->start, block->end);
+		}
+	}
+	return jit->blocks;
+}
+#endif
+
+/**
+ * Maps image cache written by earlier launch
+ *
+ * CFG and decoded instructions point into private mapping, so writes
+ * during run stay local. Returns -1 when file is missing or stale.
+ */
+
+int aot_load(vm_t *vm)
+{
+	const aot_header_t *header;
+	struct stat st;
+	char path[4096];
+	size_t size;
+	void *data;
+	int fd, native = 0;
+
+	aot_path(vm, path, sizeof(path));
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(aot_header_t)) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+
+	/* Header must match this build, image and file size */
+	header	= data;
+	size	= st.st_size;
+	if (memcmp(header->magic, AOT_MAGIC, sizeof(header->magic)) ||
+		header->version != AOT_VERSION || header->order != AOT_ORDER ||
+		strncmp(header->build, AOT_BUILD, sizeof(header->build)) ||
+		header->key != aot_key(vm) || header->binary_size != vm->binary.size ||
+		header->cfg_size != sizeof(cfg_t) || header->decoded_size != sizeof(decode_cache_t) ||
+		(header->cfg_offset | header->decoded_offset | header->jit_offset | header->code_offset) % AOT_ALIGN ||
+		header->jit_blocks < 0 || header->jit_blocks > JIT_MAX_BLOCKS ||
+		header->jit_used < 0 || header->jit_used > JIT_CODE_SIZE ||
+		(size_t) header->cfg_offset + header->cfg_size > size ||
+		(size_t) header->decoded_offset + header->decoded_size > size ||
+		(size_t) header->jit_offset + header->jit_blocks * sizeof(jit_block_t) > size ||
+		(size_t) header->code_offset + header->jit_used > size) {
+		vm_info("Image cache is stale ... [%s]", path);
+		munmap(data, st.st_size);
+		close(fd);
+		return -1;
+	}
+
+	aot_release(vm);
+	free(vm->cfg);
+	free(vm->decoded);
+	vm->aot			= data;
+	vm->aot_size	= size;
+	vm->cfg			= (cfg_t *) ((char *) data + header->cfg_offset);
+	vm->decoded		= (decode_cache_t *) ((char *) data + header->decoded_offset);
+
+#if HAVE_JIT
+	if ((header->flags & AOT_JIT) && vm->binary.engine == ENGINE_JIT) {
+		native = aot_jit(vm, fd, header);
+	}
+#endif
+	close(fd);
+
+	/* Written by other engine, add compiled code */
+	if (!(header->flags & AOT_JIT) && vm->binary.engine == ENGINE_JIT) {
+		vm->aot_stale = 1;
+	}
+
+	vm_info("Image cache loaded ... [%s] [blocks: %d] [native: %d]", path, vm->cfg->blocks, native);
+	return 0;
+}
+
+/**
+ * Analyzes whole image and writes it into cache directory
+ *
+ * With jit engine every block leader is compiled while buffer has room
+ * for longest block. File is replaced atomically.
+ */
+
+int aot_save(vm_t *vm)
+{
+	aot_header_t header;
+	char path[4096], temp[4096 + 32];
+	int fd, i, start, failed = 0;
+
+	vm->aot_stale = 0;
+	if (!vm->cfg) {
+		cfg_build(vm);
+	}
+	if (!vm->decoded || !vm->decoded->active) {
+		decode_init(vm);
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, AOT_MAGIC, sizeof(header.magic));
+	snprintf(header.build, sizeof(header.build), "%s", AOT_BUILD);
+	header.version			= AOT_VERSION;
+	header.order			= AOT_ORDER;
+	header.key				= aot_key(vm);
+	header.binary_size		= vm->binary.size;
+	header.cfg_offset		= AOT_ALIGN;
+	header.cfg_size			= sizeof(cfg_t);
+	header.decoded_offset	= AOT_OFFSET(header.cfg_offset + header.cfg_size);
+	header.decoded_size		= sizeof(decode_cache_t);
+	header.jit_offset		= AOT_OFFSET(header.decoded_offset + header.decoded_size);
+	header.code_offset		= header.jit_offset;
+
+	if (vm->binary.engine == ENGINE_JIT && jit_init(vm) == 0) {
+		for (i = 0; i < vm->cfg->blocks; i++) {
+			if (vm->jit->used + JIT_BLOCK_BYTES > JIT_CODE_SIZE || vm->jit->blocks == JIT_MAX_BLOCKS) {
+				break;
+			}
+			start = vm->cfg->block[i].start;
+			if (!vm->jit->entries[start]) {
+				jit_compile(vm, start);
+			}
+		}
+		header.flags		|= AOT_JIT;
+		header.jit_blocks	= vm->jit->blocks;
+		header.jit_used		= vm->jit->used;
+		header.code_offset	= AOT_OFFSET(header.jit_offset + header.jit_blocks * sizeof(jit_block_t));
+	}
+
+	aot_path(vm, path, sizeof(path));
+	snprintf(temp, sizeof(temp), "%s.%d.tmp", path, (int) getpid());
+	fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return -1;
+	}
+
+	/* Sections at page multiples, gaps read as zero */
+	failed |= pwrite(fd, &header, sizeof(header), 0) != sizeof(header);
+	failed |= pwrite(fd, vm->cfg, header.cfg_size, header.cfg_offset) != header.cfg_size;
+	failed |= pwrite(fd, vm->decoded, header.decoded_size, header.decoded_offset) != header.decoded_size;
+	if (header.flags & AOT_JIT) {
+		failed |= pwrite(fd, vm->jit->block, header.jit_blocks * sizeof(jit_block_t), header.jit_offset) !=
+			header.jit_blocks * sizeof(jit_block_t);
+		failed |= pwrite(fd, vm->jit->code, header.jit_used, header.code_offset) != header.jit_used;
+	}
+	failed |= ftruncate(fd, (off_t) header.code_offset + header.jit_used) < 0;
+
+	if (close(fd) < 0 || failed || rename(temp, path) < 0) {
+		unlink(temp);
+		return -1;
+	}
+
+	vm_info("Image cache written ... [%s] [blocks: %d] [native: %d]", path, vm->cfg->blocks, header.jit_blocks);
+	return 0;
+}
+
+/**
+ * Unmaps image cache, caches pointing into it are dropped
+ */
+
+void aot_release(vm_t *vm)
+{
+	vm->aot_stale = 0;
+	if (!vm->aot) {
+		return;
+	}
+
+	if (aot_owns(vm, vm->cfg)) {
+		vm->cfg = NULL;
+	}
+	if (aot_owns(vm, vm->decoded)) {
+		vm->decoded = NULL;
+	}
+	munmap(vm->aot, vm->aot_size);
+	vm->aot			= NULL;
+	vm->aot_size	= 0;
+}
+
+/**
+ * Executes program from vm->pc with selected engine
+ */
+
+int vm_exec(vm_t *vm)
+{
+	if (vm->breaks) {
+		vm->breaks->reason = VM_BREAK_NONE;
+		if (vm->breaks->points && (vm->binary.engine == ENGINE_THREADED || vm->binary.engine == ENGINE_JIT)) {
+			return exec_decoded(vm);
+		}
+	}
+
+	switch (vm->binary.engine) {
+		case ENGINE_THREADED :
+			return exec_threaded(vm);
+		case ENGINE_DECODED :
+			return exec_decoded(vm);
+		case ENGINE_JIT :
+			return exec_jit(vm);
+		case ENGINE_PARANOID :
+			return exec_paranoid(vm);
+		case ENGINE_TRACE :
+			return exec_trace(vm);
+		default :
+			return exec_switch(vm);
+	}
+}
+
+/**
+ * Switch engine - executes every instruction through operation_exec()
+ */
+
+int exec_switch(vm_t *vm)
+{
+	int pc 		= vm->pc;	/* Program counter */
+	int status 	= 0;		/* Halt or stop */
+	unsigned long long limit = vm->insns + VM_BUDGET(vm);
+	int breaks	= vm->breaks && vm->breaks->points;
+
+	/* Execute binary program */
+	while (!status) {
+#ifdef VM_PROFILE
+		int last = pc;
+#endif
+
+		if (vm->insns++ == limit) {
+			vm->insns--;
+			vm->pc = pc;
+			return VM_RUNNING;
+		}
+
+#ifdef VM_PROFILE
+		if (vm->profile) {
+			profile_step(vm, pc, vm->memory.contents[pc]);
+		}
+#endif
+		if (breaks) {
+			status = break_exec(vm, &pc);
+		} else {
+			status = operation_exec(vm, 
+				vm->memory.contents[pc],
+				vm->memory.contents[pc+1],
+				vm->memory.contents[pc+2],
+				vm->memory.contents[pc+3],
+				&pc);
+		}
+		
+		if (pc < 0 || pc > vm->binary.length) {
+			vm_fail("Program counter out of bounds.");
+		}
+
+#ifdef VM_PROFILE
+		if (vm->profile) {
+			profile_track(vm, last, vm->memory.contents[last], pc);
+		}
+#endif
+	}
+	
+	vm->pc = pc;
+	return status == 1 ? VM_HALTED : VM_STOPPED;
+}
+
+/**
+ * Paranoid engine - switch engine which verifies machine state
+ *
+ * Fails on every condition other engines rely on the decoder for,
+ * memory addresses are not masked and stale decoded entries are
+ * reported. Meant for debugging, not for speed.
+ */
+
+int exec_paranoid(vm_t *vm)
+{
+	unsigned short *m = vm->memory.contents;
+	decode_t fresh, *d;
+	int pc 		= vm->pc;	/* Program counter */
+	int status 	= 0;		/* Halt or stop */
+	int i, opcode, address;
+	unsigned long long left = VM_BUDGET(vm);
+
+	while (!status) {
+		if (!left--) {
+			vm->pc = pc;
+			return VM_RUNNING;
+		}
+		if (pc < 0 || pc > vm->binary.length || pc >= MEMORY_SIZE) {
+			vm_fail("Program counter out of bounds. [pc:%d]", pc);
+		}
+		opcode = m[pc];
+		if (opcode >= ARCH_OPCODES) {
+			vm_fail("Invalid opcode. [opcode:%d] [pc:%d]", opcode, pc);
+		}
+		if (pc + opcodes[opcode].length > MEMORY_SIZE) {
+			vm_fail("Instruction crosses end of memory. [pc:%d]", pc);
+		}
+		if (vm->stack.position < -1 || vm->stack.position >= vm->stack.capacity) {
+			vm_fail("Stack position corrupted. [position:%d]", vm->stack.position);
+		}
+		for (i = 0; i < REGISTERS_SIZE; i++) {
+			if (vm->registers.contents[i] > VALUE_MAX_LITERAL) {
+				vm_fail("Register %d holds invalid value. [value:%d]", i, vm->registers.contents[i]);
+			}
+		}
+
+		/* Memory operands must be addresses, never masked */
+		if (opcode == 15 || opcode == 16) {
+			address = val_get(vm, m[pc + (opcode == 15 ? 2 : 1)]);
+			if (address > STORAGE_MEM_HIGH) {
+				vm_fail("Memory address out of bounds. [address:%d] [pc:%d]", address, pc);
+			}
+		}
+
+		/* Divisor of mod must not be zero */
+		if (opcode == 11 && !val_get(vm, m[pc + 3])) {
+			vm_fail("Division by zero. [pc:%d]", pc);
+		}
+
+		/* Cached entry must match memory it was decoded from */
+		if (vm->decoded && vm->decoded->active) {
+			d = &vm->decoded->entries[pc];
+			if (d->handler != DECODE_MISS) {
+				decode_fill(vm, &fresh, pc);
+				if (d->length != fresh.length || d->regs != fresh.regs
+				 || memcmp(d->operand, fresh.operand, sizeof(fresh.operand))
+				 || (d->handler < FUSE_FIRST && d->handler != fresh.handler)) {
+					vm_fail("Stale decoded entry. [pc:%d]", pc);
+				}
+			}
+		}
+
+		vm->insns++;
+		status = operation_exec(vm,
+			m[pc],
+			m[pc+1],
+			m[pc+2],
+			m[pc+3],
+			&pc);
+	}
+
+	vm->pc = pc;
+	return status == 1 ? VM_HALTED : VM_STOPPED;
+}
+
+/**
+ * Trace engine - switch engine which records every executed instruction
+ *
+ * Source operands are resolved before execution, written register is
+ * read after. Input which blocked is not recorded, it runs again.
+ */
+
+int exec_trace(vm_t *vm)
+{
+	unsigned short *m = vm->memory.contents;
+	unsigned short values[DECODE_MAX_LENGTH - 1];
+	int pc 		= vm->pc;	/* Program counter */
+	int status 	= 0;		/* Halt or stop */
+	int last, opcode, count, reg, i;
+	unsigned long long left = VM_BUDGET(vm);
+
+	while (!status) {
+		if (!left--) {
+			vm->pc = pc;
+			return VM_RUNNING;
+		}
+
+		last	= pc;
+		opcode	= m[pc];
+		count	= 0;
+		reg		= -1;
+		if (opcode < ARCH_OPCODES) {
+			if (opcodes[opcode].dest) {
+				reg = m[pc+1] - STORAGE_REG_LOW;
+			}
+			for (i = opcodes[opcode].dest; i < opcodes[opcode].length - 1; i++) {
+				values[count++] = val_get(vm, m[pc + 1 + i]);
+			}
+		}
+
+		vm->insns++;
+		status = operation_exec(vm,
+			m[pc],
+			m[pc+1],
+			m[pc+2],
+			m[pc+3],
+			&pc);
+
+		if (opcode != 20 || status != 2) {
+			trace_record(vm, last, opcode, values, count, reg);
+		}
+
+		if (pc < 0 || pc > vm->binary.length) {
+			vm_fail("Program counter out of bounds.");
+		}
+	}
+
+	vm->pc = pc;
+	return status == 1 ? VM_HALTED : VM_STOPPED;
+}
+
+/**
+ * Threaded engine - direct threaded dispatch with computed goto
+ *
+ * Program counter and registers are kept in locals, every handler
+ * jumps straight to the handler of the next instruction. Semantics
+ * of each handler follow operation_exec().
+ */
+
+#if HAVE_COMPUTED_GOTO
+
+/* Value of operand - literal or register */
+#define T_VAL(x)	((x) <= VALUE_MAX_LITERAL ? (x) :										\
+					 (x) <= VALUE_MAX_REGISTER ? r[(x) - STORAGE_REG_LOW] :				\
+					 (vm_fail("Function %s() failed!", __FUNCTION__), 0))
+
+/* Register referenced by operand */
+#define T_REG(x)	(*((unsigned short)((x) - STORAGE_REG_LOW) < REGISTERS_SIZE ?			\
+					 &r[(x) - STORAGE_REG_LOW] :										\
+					 (vm_fail("Function %s() failed!", __FUNCTION__), &r[0])))
+
+/* Operands of current instruction */
+#define T_A			(m[pc+1])
+#define T_B			(m[pc+2])
+#define T_C			(m[pc+3])
+
+/* Advance program counter and dispatch next instruction */
+#define T_NEXT(n)	do { pc += (n); goto dispatch; } while (0)
+#define T_JUMP(x)	do { pc  = (x); goto dispatch; } while (0)
+
+int exec_threaded(vm_t *vm)
+{
+	static void *handlers[ARCH_OPCODES] = {
+		&&op_halt,	&&op_set,	&&op_push,	&&op_pop,	&&op_eq,	&&op_gt,
+		&&op_jmp,	&&op_jt,	&&op_jf,	&&op_add,	&&op_mult,	&&op_mod,
+		&&op_and,	&&op_or,	&&op_not,	&&op_rmem,	&&op_wmem,	&&op_call,
+		&&op_ret,	&&op_out,	&&op_in,	&&op_noop
+	};
+
+	unsigned short r[REGISTERS_SIZE];				/* Registers */
+	unsigned short *m 	= vm->memory.contents;		/* Memory */
+	int pc 				= vm->pc;					/* Program counter */
+	unsigned long long left = VM_BUDGET(vm);		/* Dispatches left */
+	unsigned short op, target;
+	int value;
+
+	memcpy(r, vm->registers.contents, sizeof(r));
+
+	/* First instruction is not bounds checked, same as in exec_switch() */
+	goto fetch;
+
+dispatch:
+	if (pc < 0 || pc > vm->binary.length) {
+		vm_fail("Program counter out of bounds.");
+	}
+fetch:
+	if (!left--) {
+		goto slice;
+	}
+	op = m[pc];
+	if (op >= ARCH_OPCODES) {
+		vm_fail("Function %s() failed! [opcode:%d] [pc:%d]", __FUNCTION__, op, pc);
+	}
+	goto *handlers[op];
+
+op_halt:
+	pc += 1;
+	goto halt;
+op_set:
+	T_REG(T_A) = T_VAL(T_B);
+	T_NEXT(3);
+op_push:
+	stack_push(vm, T_VAL(T_A));
+	T_NEXT(2);
+op_pop:
+	T_REG(T_A) = stack_pop(vm);
+	T_NEXT(2);
+op_eq:
+	T_REG(T_A) = T_VAL(T_B) == T_VAL(T_C) ? 1 : 0;
+	T_NEXT(4);
+op_gt:
+	T_REG(T_A) = T_VAL(T_B) > T_VAL(T_C) ? 1 : 0;
+	T_NEXT(4);
+op_jmp:
+	T_JUMP(T_VAL(T_A));
+op_jt:
+	if (T_VAL(T_A) != 0) {
+		T_JUMP(T_VAL(T_B));
+	}
+	T_NEXT(3);
+op_jf:
+	if (T_VAL(T_A) == 0) {
+		T_JUMP(T_VAL(T_B));
+	}
+	T_NEXT(3);
+op_add:
+	T_REG(T_A) = (T_VAL(T_B) + T_VAL(T_C)) % ARCH_MODULO;
+	T_NEXT(4);
+op_mult:
+	T_REG(T_A) = (T_VAL(T_B) * T_VAL(T_C)) % ARCH_MODULO;
+	T_NEXT(4);
+op_mod:
+	if (!T_VAL(T_C)) {
+		vm_fail("Division by zero ... [pc: %d]", pc);
+	}
+	T_REG(T_A) = T_VAL(T_B) % T_VAL(T_C);
+	T_NEXT(4);
+op_and:
+	T_REG(T_A) = T_VAL(T_B) & T_VAL(T_C);
+	T_NEXT(4);
+op_or:
+	T_REG(T_A) = T_VAL(T_B) | T_VAL(T_C);
+	T_NEXT(4);
+op_not:
+	T_REG(T_A) = (~T_VAL(T_B)) & 0x7fff;
+	T_NEXT(3);
+op_rmem:
+	T_REG(T_A) = mem_read(vm, T_VAL(T_B));
+	T_NEXT(3);
+op_wmem:
+	mem_write(vm, T_VAL(T_A), T_VAL(T_B));
+	T_NEXT(3);
+op_call:
+	target = T_VAL(T_A);
+	if (accel.map[target]) {
+		memcpy(vm->registers.contents, r, sizeof(r));
+		if (accel_call(vm, target, pc+2)) {
+			memcpy(r, vm->registers.contents, sizeof(r));
+			T_NEXT(2);
+		}
+	}
+	stack_push(vm, pc+2);	/* Push address of next instruction to stack */
+	T_JUMP(target);
+op_ret:
+	target = stack_pop(vm);	/* Pop address of next instruction from stack */
+	if (ACCEL_RETURNING(vm)) {
+		memcpy(vm->registers.contents, r, sizeof(r));
+		accel_ret(vm, target);
+	}
+	T_JUMP(target);
+op_out:
+	vm->accel.effects++;
+	vm->out(vm, T_VAL(T_A));
+	if (vm->stop) {
+		pc += 2;
+		goto stop;
+	}
+	T_NEXT(2);
+op_in:
+	vm->accel.effects++;
+	memcpy(vm->registers.contents, r, sizeof(r));
+	vm->pc = pc;
+	value = vm->in(vm);
+	if (value == IO_BLOCKED) {
+		goto stop;		/* Resume at this instruction */
+	}
+	T_REG(T_A) = value;
+	T_NEXT(2);
+op_noop:
+	T_NEXT(1);
+
+halt:
+	memcpy(vm->registers.contents, r, sizeof(r));
+	vm->pc = pc;
+	return VM_HALTED;
+
+stop:
+	memcpy(vm->registers.contents, r, sizeof(r));
+	vm->pc = pc;
+	return VM_STOPPED;
+
+slice:
+	memcpy(vm->registers.contents, r, sizeof(r));
+	vm->pc = pc;
+	return VM_RUNNING;
+}
+
+#undef T_VAL
+#undef T_REG
+#undef T_A
+#undef T_B
+#undef T_C
+#undef T_NEXT
+#undef T_JUMP
+
+#else
+
+int exec_threaded(vm_t *vm)
+{
+	/* Computed goto is not available - fall back to switch engine */
+	return exec_switch(vm);
+}
+
+#endif
+
+/**
+ * Decoded engine - executes records from pre-decoded instruction cache
+ *
+ * Operands are classified once by decode_insn(), handlers only test
+ * single register bit of each operand. Entries invalidated
+ * by mem_write() are decoded again on next execution.
+ *
+ * Decoder also proves that fall through of every entry stays within
+ * binary, so program counter is only checked after jumps.
+ */
+
+#if HAVE_COMPUTED_GOTO
+
+/* Value of operand n - literal or register selected by decoded bit */
+#define D_VAL(n)	((d->regs & (1 << (n))) ? r[d->operand[n]] : d->operand[n])
+
+/* Destination register, validated by decoder */
+#define D_REG		(r[d->operand[0]])
+
+/* Advance program counter and dispatch next instruction */
+#define D_NEXT(n)	do { pc += (n); goto fetch; } while (0)
+#define D_JUMP(x)	do { pc  = (x); goto dispatch; } while (0)
+
+/* Advance to next instruction of fused entry without dispatch */
+#define D_STEP(n)	do { pc += (n); d += (n); } while (0)
+
+int exec_decoded(vm_t *vm)
+{
+	static void *handlers[DECODE_HANDLERS] = {
+		&&op_halt,	&&op_set,	&&op_push,	&&op_pop,	&&op_eq,	&&op_gt,
+		&&op_jmp,	&&op_jt,	&&op_jf,	&&op_add,	&&op_mult,	&&op_mod,
+		&&op_and,	&&op_or,	&&op_not,	&&op_rmem,	&&op_wmem,	&&op_call,
+		&&op_ret,	&&op_out,	&&op_in,	&&op_noop,
+		&&decode_miss, &&fault_opcode, &&fault_register, &&fault_value, &&decode_tail,
+		&&decode_break,
+		&&fuse_push_push, &&fuse_push_push_push, &&fuse_push_call,
+		&&fuse_pop_pop, &&fuse_pop_pop_ret, &&fuse_pop_ret,
+		&&fuse_eq_jt, &&fuse_eq_jf, &&fuse_gt_jt, &&fuse_gt_jf, &&fuse_add_rmem
+	};
+
+	unsigned short r[REGISTERS_SIZE];				/* Registers */
+	const decode_t *d;								/* Current instruction */
+	const decode_t *entries;
+	int pc 				= vm->pc;					/* Program counter */
+	unsigned long long left = VM_BUDGET(vm);		/* Control transfers left */
+	int length;
+	unsigned short target;
+	int value;
+
+	memcpy(r, vm->registers.contents, sizeof(r));
+	if (!vm->decoded || !vm->decoded->active) {
+		decode_init(vm);
+	}
+	entries	= vm->decoded->entries;
+	length	= vm->binary.length;
+
+	/* First instruction is not bounds checked, same as in exec_switch() */
+	goto fetch;
+
+dispatch:
+	if ((unsigned) pc > (unsigned) length) {
+		vm_fail("Program counter out of bounds.");
+	}
+	if (!left--) {
+		goto slice;
+	}
+fetch:
+	d = &entries[pc];
+	goto *handlers[d->handler];
+
+decode_miss:
+	decode_insn(vm, pc);
+	decode_fuse(vm, pc);
+	goto fetch;
+fault_opcode:
+	vm_fail("Function %s() failed! [opcode:%d] [pc:%d]", __FUNCTION__, mem_read(vm, pc), pc);
+fault_register:
+	vm_fail("Function reg_write(vm) failed!");
+fault_value:
+	vm_fail("Function val_get(vm) failed!");
+decode_tail:
+	memcpy(vm->registers.contents, r, sizeof(r));
+	value = operation_exec(vm,
+		vm->memory.contents[pc],
+		vm->memory.contents[pc+1],
+		vm->memory.contents[pc+2],
+		vm->memory.contents[pc+3],
+		&pc);
+	memcpy(r, vm->registers.contents, sizeof(r));
+	if (value == 1) {
+		goto halt;
+	}
+	if (value == 2) {
+		goto stop;
+	}
+	goto dispatch;
+decode_break:
+	memcpy(vm->registers.contents, r, sizeof(r));
+	value = break_exec(vm, &pc);
+	memcpy(r, vm->registers.contents, sizeof(r));
+	if (value == 1) {
+		goto halt;
+	}
+	if (value == 2) {
+		goto stop;
+	}
+	goto dispatch;
+
+op_halt:
+	pc += 1;
+	goto halt;
+op_set:
+	D_REG = D_VAL(1);
+	D_NEXT(3);
+op_push:
+	stack_push(vm, D_VAL(0));
+	D_NEXT(2);
+op_pop:
+	D_REG = stack_pop(vm);
+	D_NEXT(2);
+op_eq:
+	D_REG = D_VAL(1) == D_VAL(2) ? 1 : 0;
+	D_NEXT(4);
+op_gt:
+	D_REG = D_VAL(1) > D_VAL(2) ? 1 : 0;
+	D_NEXT(4);
+op_jmp:
+	D_JUMP(D_VAL(0));
+op_jt:
+	if (D_VAL(0) != 0) {
+		D_JUMP(D_VAL(1));
+	}
+	D_NEXT(3);
+op_jf:
+	if (D_VAL(0) == 0) {
+		D_JUMP(D_VAL(1));
+	}
+	D_NEXT(3);
+op_add:
+	D_REG = (D_VAL(1) + D_VAL(2)) % ARCH_MODULO;
+	D_NEXT(4);
+op_mult:
+	D_REG = (D_VAL(1) * D_VAL(2)) % ARCH_MODULO;
+	D_NEXT(4);
+op_mod:
+	if (!D_VAL(2)) {
+		vm_fail("Division by zero ... [pc: %d]", pc);
+	}
+	D_REG = D_VAL(1) % D_VAL(2);
+	D_NEXT(4);
+op_and:
+	D_REG = D_VAL(1) & D_VAL(2);
+	D_NEXT(4);
+op_or:
+	D_REG = D_VAL(1) | D_VAL(2);
+	D_NEXT(4);
+op_not:
+	D_REG = (~D_VAL(1)) & 0x7fff;
+	D_NEXT(3);
+op_rmem:
+	D_REG = mem_read(vm, D_VAL(1));
+	D_NEXT(3);
+op_wmem:
+	/* May invalidate current entry - do not touch d afterwards */
+	mem_write(vm, D_VAL(0), D_VAL(1));
+	D_NEXT(3);
+op_call:
+	target = D_VAL(0);
+	if (accel.map[target]) {
+		memcpy(vm->registers.contents, r, sizeof(r));
+		if (accel_call(vm, target, pc+2)) {
+			memcpy(r, vm->registers.contents, sizeof(r));
+			D_NEXT(2);
+		}
+	}
+	stack_push(vm, pc+2);	/* Push address of next instruction to stack */
+	D_JUMP(target);
+op_ret:
+	target = stack_pop(vm);	/* Pop address of next instruction from stack */
+	if (ACCEL_RETURNING(vm)) {
+		memcpy(vm->registers.contents, r, sizeof(r));
+		accel_ret(vm, target);
+	}
+	D_JUMP(target);
+op_out:
+	vm->accel.effects++;
+	vm->out(vm, D_VAL(0));
+	if (vm->stop) {
+		pc += 2;
+		goto stop;
+	}
+	D_NEXT(2);
+op_in:
+	vm->accel.effects++;
+	memcpy(vm->registers.contents, r, sizeof(r));
+	vm->pc = pc;
+	value = vm->in(vm);
+	if (value == IO_BLOCKED) {
+		goto stop;		/* Resume at this instruction */
+	}
+	D_REG = value;
+	D_NEXT(2);
+op_noop:
+	D_NEXT(1);
+
+/* Superinstructions - intermediate pc was checked by decode_fuse() */
+fuse_push_push_push:
+	stack_push(vm, D_VAL(0));
+	D_STEP(2);
+fuse_push_push:
+	stack_push(vm, D_VAL(0));
+	D_STEP(2);
+	goto op_push;
+fuse_push_call:
+	stack_push(vm, D_VAL(0));
+	D_STEP(2);
+	goto op_call;
+fuse_pop_pop_ret:
+	D_REG = stack_pop(vm);
+	D_STEP(2);
+fuse_pop_ret:
+	D_REG = stack_pop(vm);
+	D_STEP(2);
+	goto op_ret;
+fuse_pop_pop:
+	D_REG = stack_pop(vm);
+	D_STEP(2);
+	goto op_pop;
+fuse_eq_jt:
+	D_REG = D_VAL(1) == D_VAL(2) ? 1 : 0;
+	D_STEP(4);
+	goto op_jt;
+fuse_eq_jf:
+	D_REG = D_VAL(1) == D_VAL(2) ? 1 : 0;
+	D_STEP(4);
+	goto op_jf;
+fuse_gt_jt:
+	D_REG = D_VAL(1) > D_VAL(2) ? 1 : 0;
+	D_STEP(4);
+	goto op_jt;
+fuse_gt_jf:
+	D_REG = D_VAL(1) > D_VAL(2) ? 1 : 0;
+	D_STEP(4);
+	goto op_jf;
+fuse_add_rmem:
+	D_REG = (D_VAL(1) + D_VAL(2)) % ARCH_MODULO;
+	D_STEP(4);
+	goto op_rmem;
+
+halt:
+	memcpy(vm->registers.contents, r, sizeof(r));
+	vm->pc = pc;
+	return VM_HALTED;
+
+stop:
+	memcpy(vm->registers.contents, r, sizeof(r));
+	vm->pc = pc;
+	return VM_STOPPED;
+
+slice:
+	memcpy(vm->registers.contents, r, sizeof(r));
+	vm->pc = pc;
+	return VM_RUNNING;
+}
+
+#undef D_VAL
+#undef D_REG
+#undef D_NEXT
+#undef D_JUMP
+#undef D_STEP
+
+#else
+
+int exec_decoded(vm_t *vm)
+{
+	/* Computed goto is not available - fall back to switch engine */
+	return exec_switch(vm);
+}
+
+#endif
+
+/**
+ * Pre-decodes instruction at every address of loaded binary
+ */
+
+void decode_init(vm_t *vm)
+{
+	int address;
+
+	if (!vm->decoded) {
+		vm->decoded = malloc(sizeof(decode_cache_t));
+		if (!vm->decoded) {
+			vm_fail("Function %s() failed!", __FUNCTION__);
+		}
+	}
+
+	for (address = 0; address < ARCH_MODULO; address++) {
+		vm->decoded->entries[address].handler = DECODE_MISS;
+		vm->decoded->entries[address].length  = 0;
+		vm->decoded->entries[address].span    = 0;
+	}
+	/* Known instruction starts only, anything else decodes on miss */
+	for (address = 0; address < vm->binary.length; address++) {
+		if (!vm->cfg || (vm->cfg->flags[address] & CFG_CODE)) {
+			decode_insn(vm, address);
+		}
+	}
+	for (address = 0; address < vm->binary.length; address++) {
+		if (!vm->cfg || (vm->cfg->flags[address] & CFG_CODE)) {
+			decode_fuse(vm, address);
+		}
+	}
+
+	vm->decoded->active = 1;
+}
+
+/**
+ * Decodes instruction at given address into instruction cache
+ */
+
+void decode_insn(vm_t *vm, unsigned short address)
+{
+	decode_fill(vm, &vm->decoded->entries[address], address);
+}
+
+/* Patches entry which may hit breakpoint or watchpoint */
+static void decode_patch(vm_t *vm, decode_t *d, unsigned short address, unsigned short opcode)
+{
+	const break_t *b = vm->breaks;
+	int hit;
+
+	hit = (b->flags[address] & BREAK_PC) ||
+		(opcode == 16 && b->words) ||
+		(opcode == 17 && b->regs) ||				/* Accelerated call writes outputs */
+		(opcode == 19 && b->pattern[BREAK_OUTPUT][0]) ||
+		(opcode == 20 && b->pattern[BREAK_INPUT][0]) ||
+		(opcodes[opcode].dest && (d->regs & 1) && (b->regs & (1 << d->operand[0])));
+
+	/* Faulting entries keep failing, unless stopped before */
+	if (hit && (d->handler < ARCH_OPCODES || d->handler == DECODE_TAIL || (b->flags[address] & BREAK_PC))) {
+		d->handler = DECODE_BREAK;
+	}
+}
+
+/**
+ * Decodes instruction at given address into given record
+ */
+
+void decode_fill(vm_t *vm, decode_t *d, unsigned short address)
+{
+	unsigned short opcode, value;
+	int i;
+
+	memset(d, 0, sizeof(decode_t));
+
+	opcode = mem_read(vm, address);
+	if (opcode >= ARCH_OPCODES) {
+		d->handler = DECODE_FAULT_OPCODE;
+		d->length  = 1;
+		d->span    = 1;
+		return;
+	}
+
+	d->handler = opcode;
+	d->length  = opcodes[opcode].length;
+	d->span    = d->length;
+
+	/* Fall through would leave binary, keep full checks */
+	if (address + d->length > vm->binary.length) {
+		d->handler = DECODE_TAIL;
+	}
+
+	/* Classify operands */
+	for (i = 0; i < d->length - 1; i++) {
+		value = (address + i + 1 < MEMORY_SIZE) ? mem_read(vm, address + i + 1) : 0;
+
+		if (value <= VALUE_MAX_LITERAL) {
+			if (i == 0 && opcodes[opcode].dest) {
+				d->handler = DECODE_FAULT_REGISTER;
+			}
+			d->operand[i] = value;
+		} else if (value <= VALUE_MAX_REGISTER) {
+			d->operand[i] = value - STORAGE_REG_LOW;
+			d->regs |= 1 << i;
+		} else if (i == 0 && opcodes[opcode].dest) {
+			d->handler = DECODE_FAULT_REGISTER;
+		} else {
+			d->handler = DECODE_FAULT_VALUE;
+		}
+	}
+
+	if (vm->breaks && vm->breaks->points) {
+		decode_patch(vm, d, address, opcode);
+	}
+}
+
+/* Returns opcode of decoded entry at address, -1 if it would fault */
+static int decode_opcode(vm_t *vm, int address)
+{
+	decode_t *d = &vm->decoded->entries[address];
+
+	if (d->handler == DECODE_MISS) {
+		decode_insn(vm, address);
+	}
+	if (d->handler >= ARCH_OPCODES && d->handler < FUSE_FIRST) {
+		return -1;
+	}
+
+	return vm->memory.contents[address];
+}
+
+/**
+ * Fuses decoded instruction at address with following ones
+ *
+ * Only fused when every instruction lies within binary, so skipped
+ * dispatch does not skip any program counter check.
+ */
+
+void decode_fuse(vm_t *vm, unsigned short address)
+{
+	decode_t *e = vm->decoded->entries;
+	int a = address, b, c = -1, first, second, third = -1, fused = -1, span;
+
+	if (e[a].handler >= ARCH_OPCODES) {
+		return;
+	}
+	first = e[a].handler;
+
+	b = a + e[a].length;
+	if (b >= vm->binary.length || (second = decode_opcode(vm, b)) < 0) {
+		return;
+	}
+	c = b + e[b].length;
+	if (c < vm->binary.length) {
+		third = decode_opcode(vm, c);
+	}
+
+	switch (first) {
+		case 2 :
+			fused = second == 2 ? (third == 2 ? FUSE_PUSH_PUSH_PUSH : FUSE_PUSH_PUSH) :
+					second == 17 ? FUSE_PUSH_CALL : -1;
+			break;
+		case 3 :
+			fused = second == 3 ? (third == 18 ? FUSE_POP_POP_RET : FUSE_POP_POP) :
+					second == 18 ? FUSE_POP_RET : -1;
+			break;
+		case 4 :
+			fused = second == 7 ? FUSE_EQ_JT : second == 8 ? FUSE_EQ_JF : -1;
+			break;
+		case 5 :
+			fused = second == 7 ? FUSE_GT_JT : second == 8 ? FUSE_GT_JF : -1;
+			break;
+		case 9 :
+			fused = second == 15 ? FUSE_ADD_RMEM : -1;
+			break;
+	}
+	if (fused < 0) {
+		return;
+	}
+
+	span = (fused == FUSE_PUSH_PUSH_PUSH || fused == FUSE_POP_POP_RET) ? c + e[c].length - a : c - a;
+	if (a + span > vm->binary.length) {
+		return;
+	}
+
+	e[a].handler	= fused;
+	e[a].span		= span;
+}
+
+/**
+ * Invalidates decoded instructions covering any address in [start, end)
+ *
+ * Fused entry is dropped when any of its words is written.
+ */
+
+void decode_invalidate(vm_t *vm, int start, int end)
+{
+	int i;
+
+	for (i = start - (DECODE_MAX_SPAN - 1); i < end; i++) {
+		if (i >= 0 && i + vm->decoded->entries[i].span > start) {
+			vm->decoded->entries[i].handler = DECODE_MISS;
+			vm->decoded->entries[i].length  = 0;
+			vm->decoded->entries[i].span    = 0;
+		}
+	}
+}
+
+/**
+ * Returns length of valid instruction at address, 0 otherwise
+ */
+
+int cfg_insn(const vm_t *vm, int address)
+{
+	unsigned short opcode = vm->memory.contents[address];
+	int i, length;
+
+	if (opcode >= ARCH_OPCODES || address + opcodes[opcode].length > MEMORY_SIZE) {
+		return 0;
+	}
+
+	length = opcodes[opcode].length;
+	for (i = 1; i < length; i++) {
+		if (vm->memory.contents[address + i] >= STORAGE_INV_LOW) {
+			return 0;
+		}
+	}
+	if (opcodes[opcode].dest && vm->memory.contents[address + 1] < STORAGE_REG_LOW) {
+		return 0;
+	}
+
+	return length;
+}
+
+/* Marks literal target as leader and queues it */
+static void cfg_target(cfg_t *cfg, unsigned short *queue, int *tail, unsigned short target, int flags)
+{
+	if (target >= STORAGE_REG_LOW) {
+		return;
+	}
+	if (!(cfg->flags[target] & (CFG_LEADER | CFG_CODE))) {
+		queue[(*tail)++] = target;
+	}
+	cfg->flags[target] |= CFG_LEADER | flags;
+}
+
+/**
+ * Builds control-flow graph of loaded image
+ *
+ * Recursive descent from address 0 follows fall through, literal jump
+ * and call targets. Targets held in registers are not followed, such
+ * instructions are flagged indirect. Every call target starts function,
+ * blocks are assigned to first function reaching them without calls.
+ */
+
+void cfg_build(vm_t *vm)
+{
+	static unsigned short queue[MEMORY_SIZE * 2];
+	unsigned short *m = vm->memory.contents;
+	int head = 0, tail = 0, address, length, i, n, top;
+	cfg_block_t *block;
+	cfg_t *cfg;
+
+	if (!vm->cfg) {
+		vm->cfg = malloc(sizeof(cfg_t));
+		if (!vm->cfg) {
+			vm_fail("Function %s() failed!", __FUNCTION__);
+		}
+	}
+	cfg = vm->cfg;
+	memset(cfg->flags, 0, sizeof(cfg->flags));
+	cfg->funcs = cfg->blocks = cfg->words = 0;
+
+	cfg_target(cfg, queue, &tail, 0, CFG_FUNC);
+
+	/* Recursive descent, queue holds addresses of unvisited paths */
+	while (head < tail) {
+		for (address = queue[head++]; address < MEMORY_SIZE && !(cfg->flags[address] & CFG_CODE); ) {
+			length = cfg_insn(vm, address);
+			if (!length) {
+				break;
+			}
+
+			cfg->flags[address] |= CFG_CODE;
+			cfg->words += length;
+
+			switch (m[address]) {
+				/* Jmp */
+				case 6 :
+					cfg->flags[address] |= m[address + 1] >= STORAGE_REG_LOW ? CFG_INDIRECT : 0;
+					cfg_target(cfg, queue, &tail, m[address + 1], 0);
+					length = 0;
+					break;
+				/* Jt, jf */
+				case 7 : case 8 :
+					cfg->flags[address] |= m[address + 2] >= STORAGE_REG_LOW ? CFG_INDIRECT : 0;
+					cfg_target(cfg, queue, &tail, m[address + 2], 0);
+					cfg_target(cfg, queue, &tail, address + 3, 0);
+					break;
+				/* Call */
+				case 17 :
+					cfg->flags[address] |= m[address + 1] >= STORAGE_REG_LOW ? CFG_INDIRECT : 0;
+					cfg_target(cfg, queue, &tail, m[address + 1], CFG_FUNC);
+					cfg_target(cfg, queue, &tail, address + 2, 0);
+					break;
+				/* Halt, ret */
+				case 0 : case 18 :
+					length = 0;
+					break;
+			}
+			if (!length) {
+				break;
+			}
+			address += length;
+		}
+	}
+
+	/* Blocks run from leader to control transfer or next leader */
+	for (address = 0; address < MEMORY_SIZE; address++) {
+		cfg->index[address] = -1;
+	}
+	for (address = 0; address < MEMORY_SIZE; address++) {
+		if (!(cfg->flags[address] & CFG_CODE) ||
+			(cfg->blocks && cfg->block[cfg->blocks - 1].end > address)) {
+			continue;
+		}
+
+		cfg->flags[address] |= CFG_LEADER;
+		cfg->index[address] = cfg->blocks;
+		block = &cfg->block[cfg->blocks++];
+		block->start	= address;
+		block->func		= -1;
+		block->succs	= 0;
+		block->call		= -1;
+		cfg->funcs		+= !!(cfg->flags[address] & CFG_FUNC);
+
+		for (i = address; ; i += length) {
+			length = opcodes[m[i]].length;
+			n = m[i];
+
+			if (n == 17 && m[i + 1] < STORAGE_REG_LOW) {
+				block->call = m[i + 1];
+			}
+			if (n == 6 || n == 7 || n == 8) {
+				if (m[i + length - 1] < STORAGE_REG_LOW) {
+					block->succ[block->succs++] = m[i + length - 1];
+				}
+			}
+			if (n == 6 || n == 0 || n == 18) {
+				break;
+			}
+			if (n == 7 || n == 8 || n == 17 || i + length >= MEMORY_SIZE ||
+				!(cfg->flags[i + length] & CFG_CODE) || (cfg->flags[i + length] & CFG_LEADER)) {
+				if (i + length < MEMORY_SIZE && (cfg->flags[i + length] & CFG_CODE)) {
+					block->succ[block->succs++] = i + length;
+				}
+				break;
+			}
+		}
+		block->end = i + length;
+	}
+
+	/* Assign blocks to functions in address order of entries */
+	for (address = 0; address < MEMORY_SIZE; address++) {
+		if (!(cfg->flags[address] & CFG_FUNC) || cfg->index[address] < 0 ||
+			cfg->block[cfg->index[address]].func >= 0) {
+			continue;
+		}
+
+		top = 0;
+		queue[top++] = cfg->index[address];
+		cfg->block[cfg->index[address]].func = address;
+		while (top) {
+			block = &cfg->block[queue[--top]];
+			for (i = 0; i < block->succs; i++) {
+				n = cfg->index[block->succ[i]];
+				if (n >= 0 && cfg->block[n].func < 0) {
+					cfg->block[n].func = address;
+					queue[top++] = n;
+				}
+			}
+		}
+	}
+
+	cfg_effects(vm);
+
+	vm_info("CFG built ... [functions: %d] [blocks: %d] [code: %d of %d words]",
+		cfg->funcs, cfg->blocks, cfg->words, vm->binary.length);
+}
+
+/**
+ * Returns summary of function starting at address, NULL if none
+ */
+
+cfg_func_t *cfg_func(cfg_t *cfg, int address)
+{
+	int low = 0, high = cfg->funcs - 1, middle;
+
+	while (low <= high) {
+		middle = (low + high) / 2;
+		if (cfg->func[middle].entry == address) {
+			return &cfg->func[middle];
+		}
+		if (cfg->func[middle].entry < address) {
+			low = middle + 1;
+		} else {
+			high = middle - 1;
+		}
+	}
+
+	return NULL;
+}
+
+/* Register mask of operand, 0 for literal */
+#define CFG_REG(value)	((value) >= STORAGE_REG_LOW ? 1 << ((value) - STORAGE_REG_LOW) : 0)
+
+/**
+ * Summarizes blocks reachable from function entry without calls
+ *
+ * Stack depth at every block must be the same on all paths. Returns
+ * true when summary changed.
+ */
+
+static int cfg_summarize(vm_t *vm, cfg_func_t *f, int round)
+{
+	static int level[MEMORY_SIZE], stack[MEMORY_SIZE];
+	static unsigned int mark[MEMORY_SIZE], stamp;
+	unsigned short *m = vm->memory.contents;
+	cfg_t *cfg = vm->cfg;
+	const cfg_block_t *block;
+	const cfg_func_t *callee;
+	int effects = 0, reads = 0, writes = 0, defined, maximum = 0;
+	int top = 0, depth, address, opcode = 0, length = 0, next, i, k;
+
+	/* Blocks marked with stamp of this call are queued */
+	if (!++stamp) {
+		memset(mark, 0, sizeof(mark));
+		stamp = 1;
+	}
+	level[cfg->index[f->entry]]	= 0;
+	mark[cfg->index[f->entry]]	= stamp;
+	stack[top++]				= cfg->index[f->entry];
+
+	while (top) {
+		block	= &cfg->block[stack[--top]];
+		depth	= level[block - cfg->block];
+		defined	= 0;
+
+		for (address = block->start; address < block->end; address += length) {
+			opcode	= m[address];
+			length	= opcodes[opcode].length;
+
+			/* Operands read before written in block */
+			for (k = 1 + opcodes[opcode].dest; k < length; k++) {
+				reads |= CFG_REG(m[address + k]) & ~defined;
+			}
+
+			switch (opcode) {
+				case 0 :
+					effects |= CFG_FX_HALT;
+					break;
+				case 2 :
+					depth++;
+					break;
+				case 3 :
+					effects |= --depth < 0 ? CFG_FX_UNKNOWN : 0;
+					break;
+				case 6 : case 7 : case 8 :
+					if (cfg->flags[address] & CFG_INDIRECT) {
+						effects |= CFG_FX_UNKNOWN;
+					} else if (m[address + length - 1] <= block->start) {
+						effects |= CFG_FX_LOOPS;
+					}
+					break;
+				case 15 :
+					effects |= CFG_FX_RMEM;
+					break;
+				case 16 :
+					effects |= CFG_FX_WMEM;
+					break;
+				case 17 :
+					callee = (cfg->flags[address] & CFG_INDIRECT) ? NULL : cfg_func(cfg, m[address + 1]);
+					if (!callee) {
+						effects |= CFG_FX_UNKNOWN;
+						break;
+					}
+					effects	|= callee->effects | CFG_FX_LOOPS;
+					reads	|= callee->reads & ~defined;
+					writes	|= callee->writes;
+					if (callee->depth == CFG_DEPTH_UNBOUNDED) {
+						maximum = CFG_DEPTH_UNBOUNDED;
+					} else if (maximum != CFG_DEPTH_UNBOUNDED && depth + 1 + callee->depth > maximum) {
+						maximum = depth + 1 + callee->depth;
+					}
+					break;
+				case 18 :
+					effects |= depth ? CFG_FX_UNKNOWN : 0;
+					break;
+				case 19 : case 20 :
+					effects |= CFG_FX_IO;
+					break;
+			}
+
+			if (opcodes[opcode].dest) {
+				defined	|= CFG_REG(m[address + 1]);
+				writes	|= CFG_REG(m[address + 1]);
+			}
+			if (maximum != CFG_DEPTH_UNBOUNDED && depth > maximum) {
+				maximum = depth;
+			}
+		}
+
+		/* Fall through into data */
+		address -= length;
+		if (opcode != 0 && opcode != 6 && opcode != 18 &&
+			(address + length >= MEMORY_SIZE || cfg->index[address + length] < 0)) {
+			effects |= CFG_FX_UNKNOWN;
+		}
+
+		for (i = 0; i < block->succs; i++) {
+			next = cfg->index[block->succ[i]];
+			if (next < 0) {
+				effects |= CFG_FX_UNKNOWN;
+				continue;
+			}
+			if (mark[next] != stamp) {
+				level[next]		= depth;
+				mark[next]		= stamp;
+				stack[top++]	= next;
+			} else if (level[next] != depth) {
+				effects |= CFG_FX_UNKNOWN;
+			}
+		}
+	}
+
+	/* Recursion keeps growing depth */
+	if (round >= CFG_ROUNDS && maximum > f->depth && f->depth != CFG_DEPTH_UNBOUNDED) {
+		maximum = CFG_DEPTH_UNBOUNDED;
+	}
+	if (f->depth == CFG_DEPTH_UNBOUNDED) {
+		maximum = CFG_DEPTH_UNBOUNDED;
+	}
+
+	if (effects == f->effects && reads == f->reads && writes == f->writes && maximum == f->depth) {
+		return 0;
+	}
+	f->effects	= effects;
+	f->reads	= reads;
+	f->writes	= writes;
+	f->depth	= maximum;
+	return 1;
+}
+
+/**
+ * Summarizes side effects of every function
+ *
+ * Summaries start empty and grow until no function changes, so
+ * recursive functions without other effects stay pure.
+ */
+
+void cfg_effects(vm_t *vm)
+{
+	cfg_t *cfg = vm->cfg;
+	int address, changed, round, i;
+
+	for (address = 0, i = 0; address < MEMORY_SIZE; address++) {
+		if ((cfg->flags[address] & CFG_FUNC) && cfg->index[address] >= 0) {
+			memset(&cfg->func[i], 0, sizeof(cfg_func_t));
+			cfg->func[i++].entry = address;
+		}
+	}
+
+	for (round = 0, changed = 1; changed; round++) {
+		for (i = 0, changed = 0; i < cfg->funcs; i++) {
+			changed |= cfg_summarize(vm, &cfg->func[i], round);
+		}
+	}
+}
+
+/* Range of decoded operand n */
+static cfg_range_t cfg_operand_range(const cfg_range_t *range, const decode_t *d, int n)
+{
+	cfg_range_t value = { d->operand[n], d->operand[n] };
+
+	return (d->regs & (1 << n)) ? range[d->operand[n]] : value;
+}
+
+/**
+ * Returns true if add or mult may exceed 15 bits and must be masked
+ */
+
+int cfg_range_wraps(const cfg_range_t *range, const decode_t *d)
+{
+	cfg_range_t b = cfg_operand_range(range, d, 1), c = cfg_operand_range(range, d, 2);
+
+	switch (d->handler) {
+		case 9 :
+			return b.hi + c.hi > VALUE_MAX_LITERAL;
+		case 10 :
+			return (unsigned long) b.hi * c.hi > VALUE_MAX_LITERAL;
+		default :
+			return 1;
+	}
+}
+
+/**
+ * Applies decoded instruction to register ranges
+ *
+ * Abstract interpretation over opcodes 9-14, destination of anything
+ * else except set, eq and gt becomes unknown. Registers may hold any
+ * 16-bit word, add and mult results are below 32768 only once masked.
+ */
+
+void cfg_range(cfg_range_t *range, const decode_t *d)
+{
+	cfg_range_t b, c, *a = &range[d->operand[0]];
+	unsigned int hi;
+	int i;
+
+	if (d->handler >= ARCH_OPCODES) {
+		return;
+	}
+	/* Callee or accelerated call may write anything */
+	if (d->handler == 17) {
+		for (i = 0; i < REGISTERS_SIZE; i++) {
+			range[i].lo = 0;
+			range[i].hi = VALUE_MAX_WORD;
+		}
+		return;
+	}
+	if (!opcodes[d->handler].dest) {
+		return;
+	}
+
+	b = cfg_operand_range(range, d, 1);
+	c = cfg_operand_range(range, d, 2);
+
+	switch (d->handler) {
+		case 1 :
+			*a = b;
+			break;
+		case 4 : case 5 :
+			a->lo = 0;
+			a->hi = 1;
+			break;
+		case 9 :
+			if (b.hi + c.hi <= VALUE_MAX_LITERAL) {
+				a->lo = b.lo + c.lo;
+				a->hi = b.hi + c.hi;
+			} else if (b.lo + c.lo > VALUE_MAX_LITERAL && b.hi + c.hi < 2 * ARCH_MODULO) {
+				a->lo = b.lo + c.lo - ARCH_MODULO;
+				a->hi = b.hi + c.hi - ARCH_MODULO;
+			} else {
+				a->lo = 0;
+				a->hi = VALUE_MAX_LITERAL;
+			}
+			break;
+		case 10 :
+			if ((unsigned long) b.hi * c.hi <= VALUE_MAX_LITERAL) {
+				a->lo = b.lo * c.lo;
+				a->hi = b.hi * c.hi;
+			} else {
+				a->lo = 0;
+				a->hi = VALUE_MAX_LITERAL;
+			}
+			break;
+		case 11 :
+			a->lo = (c.lo && b.hi < c.lo) ? b.lo : 0;
+			a->hi = (c.hi && c.hi - 1 < b.hi) ? c.hi - 1 : b.hi;
+			break;
+		case 12 :
+			a->lo = 0;
+			a->hi = b.hi < c.hi ? b.hi : c.hi;
+			break;
+		case 13 :
+			for (hi = b.hi | c.hi; hi & (hi + 1); hi |= hi >> 1);
+			a->lo = b.lo > c.lo ? b.lo : c.lo;
+			a->hi = hi;
+			break;
+		case 14 :
+			if (b.hi <= VALUE_MAX_LITERAL) {
+				a->lo = VALUE_MAX_LITERAL - b.hi;
+				a->hi = VALUE_MAX_LITERAL - b.lo;
+			} else {
+				a->lo = 0;
+				a->hi = VALUE_MAX_LITERAL;
+			}
+			break;
+		/* Words read from memory, stack or input may use all 16 bits */
+		default :
+			a->lo = 0;
+			a->hi = VALUE_MAX_WORD;
+	}
+}
+
+/* Writes operand, registers as rN and printable out literals as chars */
+static void cfg_operand(FILE *fp, unsigned short opcode, unsigned short value)
+{
+	if (value >= STORAGE_REG_LOW && value <= STORAGE_REG_HIGH) {
+		fprintf(fp, " r%d", value - STORAGE_REG_LOW);
+	} else if (opcode == 19 && value >= 32 && value < 127) {
+		fprintf(fp, (value == '\'' || value == '\\') ? " '\\%c'" : " '%c'", value);
+	} else if (opcode == 19 && value == '\n') {
+		fprintf(fp, " '\\n'");
+	} else {
+		fprintf(fp, " %d", value);
+	}
+}
+
+/* Writes instruction mnemonic and operands */
+static void cfg_write_insn(FILE *fp, const vm_t *vm, int address)
+{
+	unsigned short opcode = vm->memory.contents[address];
+	int i;
+
+	fprintf(fp, "%-5s", opcodes[opcode].name);
+	for (i = 1; i < opcodes[opcode].length; i++) {
+		cfg_operand(fp, opcode, vm->memory.contents[address + i]);
+	}
+}
+
+/* Writes instructions of block as DOT label, lines left aligned */
+static void cfg_write_label(FILE *fp, const vm_t *vm, const cfg_block_t *block)
+{
+	char line[128];
+	FILE *mem;
+	int i, c;
+
+	fprintf(fp, "\"");
+	for (i = block->start; i < block->end; i += opcodes[vm->memory.contents[i]].length) {
+		mem = fmemopen(line, sizeof(line), "w");
+		fprintf(mem, "%5d: ", i);
+		cfg_write_insn(mem, vm, i);
+		fclose(mem);
+
+		for (c = 0; line[c]; c++) {
+			if (line[c] == '"' || line[c] == '\\') {
+				fputc('\\', fp);
+			}
+			fputc(line[c], fp);
+		}
+		fprintf(fp, "\\l");
+	}
+	fprintf(fp, "\"");
+}
+
+/* Writes function summary as comment */
+static void cfg_write_summary(FILE *fp, const cfg_func_t *f)
+{
+	static const char *names[] = { "halt", "rmem", "wmem", "io", "unknown" };
+	int i, first = 1;
+
+	if (f) {
+		fprintf(fp, "\t; %s", (f->effects & CFG_FX_IMPURE) ? "effects:" : "pure");
+		for (i = 0; i < 5; i++) {
+			if (f->effects & (1 << i)) {
+				fprintf(fp, "%s%s", first ? " " : ",", names[i]);
+				first = 0;
+			}
+		}
+		fprintf(fp, ", reads:");
+		for (i = 0; i < REGISTERS_SIZE; i++) {
+			fprintf(fp, (f->reads & (1 << i)) ? " r%d" : "", i);
+		}
+		fprintf(fp, ", writes:");
+		for (i = 0; i < REGISTERS_SIZE; i++) {
+			fprintf(fp, (f->writes & (1 << i)) ? " r%d" : "", i);
+		}
+		fprintf(fp, f->depth == CFG_DEPTH_UNBOUNDED ? ", stack: unbounded" : ", stack: %d", f->depth);
+	}
+	fprintf(fp, "\n");
+}
+
+/**
+ * Dumps disassembly and CFG
+ *   - text: linear sweep listing, code reached by descent is labeled
+ *     with functions and blocks, other valid instructions are marked ?
+ *     and remaining words are printed as data
+ *   - dot: graphviz digraph, dashed edges are calls
+ *   - json: functions and blocks with successors
+ */
+
+void cfg_dump(vm_t *vm, FILE *fp, int format)
+{
+	const cfg_t *cfg = vm->cfg;
+	const cfg_block_t *block;
+	unsigned short word;
+	int address, length, i, n;
+
+	switch (format) {
+		case CFG_FORMAT_TEXT :
+			fprintf(fp, "; functions: %d, blocks: %d, code: %d of %d words\n",
+				cfg->funcs, cfg->blocks, cfg->words, vm->binary.length);
+
+			for (address = 0; address < vm->binary.length; address += length) {
+				if (cfg->flags[address] & CFG_FUNC) {
+					fprintf(fp, "\nsub_%d:", address);
+					cfg_write_summary(fp, cfg_func(vm->cfg, address));
+				} else if (cfg->flags[address] & CFG_LEADER) {
+					fprintf(fp, "loc_%d:\n", address);
+				}
+
+				/* Unreached instruction must not overlap reached code */
+				length = cfg_insn(vm, address);
+				for (i = 1; i < length && !(cfg->flags[address] & CFG_CODE); i++) {
+					if (cfg->flags[address + i] & CFG_CODE) {
+						length = 0;
+					}
+				}
+				if (length) {
+					fprintf(fp, "%6d: %c ", address, (cfg->flags[address] & CFG_CODE) ? ' ' : '?');
+					cfg_write_insn(fp, vm, address);
+					fprintf(fp, "%s\n", (cfg->flags[address] & CFG_INDIRECT) ? "\t; indirect" : "");
+					continue;
+				}
+
+				word = vm->memory.contents[address];
+				fprintf(fp, "%6d:   .word %d", address, word);
+				fprintf(fp, (word >= 32 && word < 127) ? "\t; '%c'\n" : "\n", word);
+				length = 1;
+			}
+			break;
+
+		case CFG_FORMAT_DOT :
+			fprintf(fp, "digraph cfg {\n\tnode [shape=box fontname=monospace];\n");
+			for (n = 0; n < cfg->blocks; n++) {
+				block = &cfg->block[n];
+				fprintf(fp, "\tb%d [label=", block->start);
+				cfg_write_label(fp, vm, block);
+				fprintf(fp, "%s];\n", (cfg->flags[block->start] & CFG_FUNC) ? " style=bold" : "");
+
+				for (i = 0; i < block->succs; i++) {
+					fprintf(fp, "\tb%d -> b%d;\n", block->start, block->succ[i]);
+				}
+				if (block->call >= 0) {
+					fprintf(fp, "\tb%d -> b%d [style=dashed];\n", block->start, block->call);
+				}
+			}
+			fprintf(fp, "}\n");
+			break;
+
+		case CFG_FORMAT_JSON :
+			fprintf(fp, "{\n  \"length\": %d,\n  \"code\": %d,\n  \"functions\": [",
+				vm->binary.length, cfg->words);
+			for (address = 0, i = 0; address < MEMORY_SIZE; address++) {
+				if ((cfg->flags[address] & CFG_FUNC) && (cfg->flags[address] & CFG_CODE)) {
+					fprintf(fp, "%s%d", i++ ? ", " : "", address);
+				}
+			}
+			fprintf(fp, "],\n  \"blocks\": [\n");
+			for (n = 0; n < cfg->blocks; n++) {
+				block = &cfg->block[n];
+				fprintf(fp, "    { \"start\": %d, \"end\": %d, \"function\": %d, \"successors\": [",
+					block->start, block->end, block->func);
+				for (i = 0; i < block->succs; i++) {
+					fprintf(fp, "%s%d", i ? ", " : "", block->succ[i]);
+				}
+				fprintf(fp, "], \"call\": %d }%s\n", block->call, n < cfg->blocks - 1 ? "," : "");
+			}
+			fprintf(fp, "  ]\n}\n");
+			break;
+	}
+}
+
+/**
+ * Creates trace file and starts writer thread
+ */
+
+int trace_open(vm_t *vm, const char *path)
+{
+	trace_header_t header;
+	trace_t *trace;
+
+	trace = calloc(1, sizeof(trace_t));
+	if (!trace) {
+		return -1;
+	}
+
+	trace->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (trace->fd < 0) {
+		free(trace);
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version	= TRACE_VERSION;
+	header.order	= TRACE_ORDER;
+	if (write(trace->fd, &header, sizeof(header)) != sizeof(header)) {
+		close(trace->fd);
+		free(trace);
+		return -1;
+	}
+
+	trace->path = path;
+	pthread_mutex_init(&trace->lock, NULL);
+	pthread_cond_init(&trace->cond, NULL);
+	if (pthread_create(&trace->thread, NULL, trace_writer, trace)) {
+		vm_fail("Function %s() failed!", __FUNCTION__);
+	}
+
+	vm->trace = trace;
+	return 0;
+}
+
+/**
+ * Writes remaining records and closes trace
+ */
+
+void trace_close(vm_t *vm)
+{
+	trace_t *trace = vm->trace;
+
+	if (trace->buffer[trace->tail].header.count) {
+		trace_publish(trace);
+	}
+
+	pthread_mutex_lock(&trace->lock);
+	trace->done = 1;
+	pthread_cond_broadcast(&trace->cond);
+	pthread_mutex_unlock(&trace->lock);
+	pthread_join(trace->thread, NULL);
+
+	if (close(trace->fd) < 0 || trace->failed) {
+		vm_info("Trace is incomplete ... [%s]", trace->path);
+	} else {
+		vm_info("Trace written ... [%s] [instructions: %llu]", trace->path, trace->index);
+	}
+
+	pthread_cond_destroy(&trace->cond);
+	pthread_mutex_destroy(&trace->lock);
+	free(trace);
+	vm->trace = NULL;
+}
+
+/**
+ * Hands chunk being filled to writer, waits for free chunk
+ */
+
+void trace_publish(trace_t *trace)
+{
+	pthread_mutex_lock(&trace->lock);
+	trace->full++;
+	pthread_cond_broadcast(&trace->cond);
+	while (trace->full == TRACE_CHUNKS) {
+		pthread_cond_wait(&trace->cond, &trace->lock);
+	}
+	pthread_mutex_unlock(&trace->lock);
+
+	trace->tail = (trace->tail + 1) % TRACE_CHUNKS;
+	trace->buffer[trace->tail].header.size	= 0;
+	trace->buffer[trace->tail].header.count	= 0;
+}
+
+/**
+ * Writer thread, streams full chunks to file in order
+ */
+
+void *trace_writer(void *arg)
+{
+	trace_t *trace = arg;
+	trace_buffer_t *buffer;
+	size_t size;
+
+	pthread_mutex_lock(&trace->lock);
+	while (1) {
+		while (!trace->full && !trace->done) {
+			pthread_cond_wait(&trace->cond, &trace->lock);
+		}
+		if (!trace->full) {
+			break;
+		}
+		buffer = &trace->buffer[trace->head];
+		pthread_mutex_unlock(&trace->lock);
+
+		/* Chunk is not touched by interpreter until released */
+		size = sizeof(trace_chunk_t) + buffer->header.size;
+		if (!trace->failed && write(trace->fd, buffer, size) != (ssize_t) size) {
+			trace->failed = 1;
+		}
+
+		pthread_mutex_lock(&trace->lock);
+		trace->head = (trace->head + 1) % TRACE_CHUNKS;
+		trace->full--;
+		pthread_cond_broadcast(&trace->cond);
+	}
+	pthread_mutex_unlock(&trace->lock);
+
+	return NULL;
+}
+
+/* Appends unsigned LEB128 number */
+static unsigned char *trace_varint(unsigned char *p, unsigned int value)
+{
+	while (value >= 0x80) {
+		*p++ = value | 0x80;
+		value >>= 7;
+	}
+	*p++ = value;
+	return p;
+}
+
+/* Reads unsigned LEB128 number, NULL past end */
+static const unsigned char *trace_unvarint(const unsigned char *p, const unsigned char *end, unsigned int *value)
+{
+	int shift = 0;
+
+	*value = 0;
+	while (p < end && shift < 32) {
+		*value |= (*p & 0x7f) << shift;
+		if (!(*p++ & 0x80)) {
+			return p;
+		}
+		shift += 7;
+	}
+	return NULL;
+}
+
+/**
+ * Appends record of executed instruction
+ *   - values are resolved source operands, reg is written register or -1
+ */
+
+void trace_record(vm_t *vm, int pc, unsigned short opcode, const unsigned short *values, int count, int reg)
+{
+	trace_t *trace = vm->trace;
+	trace_buffer_t *buffer = &trace->buffer[trace->tail];
+	unsigned char *p;
+	int delta, i;
+
+	if (buffer->header.size + TRACE_RECORD_MAX > TRACE_CHUNK_SIZE) {
+		trace_publish(trace);
+		buffer = &trace->buffer[trace->tail];
+	}
+	if (!buffer->header.count) {
+		buffer->header.magic	= TRACE_CHUNK_MAGIC;
+		buffer->header.first	= trace->index;
+		buffer->header.pc		= pc;
+		trace->expected			= pc;
+	}
+
+	p		= buffer->data + buffer->header.size;
+	delta	= pc - trace->expected;
+
+	*p++ = opcode | (delta ? TRACE_JUMP : 0) | (reg >= 0 ? TRACE_WRITE : 0);
+	if (delta) {
+		p = trace_varint(p, (delta << 1) ^ (delta >> 31));
+	}
+	for (i = 0; i < count; i++) {
+		p = trace_varint(p, values[i]);
+	}
+	if (reg >= 0) {
+		*p++ = reg;
+		p = trace_varint(p, vm->registers.contents[reg]);
+	}
+
+	buffer->header.size = p - buffer->data;
+	buffer->header.count++;
+	trace->index++;
+	trace->expected = pc + opcodes[opcode].length;
+}
+
+/**
+ * Prints trace records, spec is FILE[:START[:COUNT]]
+ *
+ * Chunks before START are skipped by their headers only. Trace of
+ * aborted run ends at last complete chunk.
+ */
+
+int trace_dump(const char *spec, FILE *fp)
+{
+	const unsigned char *p, *end;
+	unsigned long long start = 0, count = ~0ULL, index, numbers[2];
+	unsigned char data[TRACE_CHUNK_SIZE];
+	unsigned int values[DECODE_MAX_LENGTH - 1], value = 0, reg = 0, pc;
+	trace_header_t header;
+	trace_chunk_t chunk;
+	char path[4096], *colon, *tail;
+	int fd, n = 0, i, flags, opcode;
+
+	/* Up to two trailing numbers, path may contain colons */
+	snprintf(path, sizeof(path), "%s", spec);
+	while (n < 2 && (colon = strrchr(path, ':')) && colon[1]) {
+		numbers[n] = strtoull(colon + 1, &tail, 10);
+		if (*tail) {
+			break;
+		}
+		*colon = '\0';
+		n++;
+	}
+	if (n == 2) {
+		start = numbers[1];
+		count = numbers[0];
+	} else if (n == 1) {
+		start = numbers[0];
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || read(fd, &header, sizeof(header)) != sizeof(header) ||
+		memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) ||
+		header.version != TRACE_VERSION || header.order != TRACE_ORDER) {
+		vm_info("Not a trace file ... [%s]", path);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+
+	while (count && read(fd, &chunk, sizeof(chunk)) == sizeof(chunk)) {
+		if (chunk.magic != TRACE_CHUNK_MAGIC || chunk.size > TRACE_CHUNK_SIZE) {
+			vm_info("Trace is corrupted ... [%s]", path);
+			break;
+		}
+		if (chunk.first + chunk.count <= start) {
+			lseek(fd, chunk.size, SEEK_CUR);
+			continue;
+		}
+		if (read(fd, data, chunk.size) != (ssize_t) chunk.size) {
+			break;
+		}
+
+		p	= data;
+		end	= data + chunk.size;
+		pc	= chunk.pc;
+		for (index = chunk.first; count && p && p < end; index++) {
+			flags	= *p++;
+			opcode	= flags & TRACE_OPCODE;
+			if (opcode >= ARCH_OPCODES) {
+				break;
+			}
+			if (flags & TRACE_JUMP) {
+				p = trace_unvarint(p, end, &value);
+				pc += (int) ((value >> 1) ^ -(value & 1));
+			}
+
+			for (i = opcodes[opcode].dest, n = 0; p && i < opcodes[opcode].length - 1; i++) {
+				p = trace_unvarint(p, end, &values[n++]);
+			}
+			if (p && (flags & TRACE_WRITE)) {
+				reg = *p++;
+				p = trace_unvarint(p, end, &value);
+			}
+			if (!p) {
+				break;
+			}
+
+			if (index >= start) {
+				fprintf(fp, "%12llu %5d: %-5s", index, pc, opcodes[opcode].name);
+				if (flags & TRACE_WRITE) {
+					fprintf(fp, " r%u", reg);
+				}
+				for (i = 0; i < n; i++) {
+					cfg_operand(fp, opcode, values[i]);
+				}
+				if (flags & TRACE_WRITE) {
+					fprintf(fp, "\t; r%u = %u", reg, value);
+				}
+				fprintf(fp, "\n");
+				count--;
+			}
+			pc += opcodes[opcode].length;
+		}
+	}
+
+	close(fd);
+	return 0;
+}
+
+/**
+ * Waits for GDB on local port and serves it until detach or kill
+ *
+ * After detach program continues with selected engine.
+ */
+
+int debug_run(vm_t *vm, int port)
+{
+	struct sockaddr_in address;
+	debug_t *debug;
+	int listener, one = 1, ret, i;
+
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&address, 0, sizeof(address));
+	address.sin_family		= AF_INET;
+	address.sin_port		= htons(port);
+	address.sin_addr.s_addr	= htonl(INADDR_LOOPBACK);
+	if (listener < 0 || setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+		bind(listener, (struct sockaddr *) &address, sizeof(address)) < 0 || listen(listener, 1) < 0) {
+		vm_fail("Cannot listen for debugger ... [port: %d]", port);
+	}
+
+	debug = calloc(1, sizeof(debug_t));
+	if (!debug) {
+		vm_fail("Function %s() failed!", __FUNCTION__);
+	}
+
+	vm_info("Waiting for GDB ... [port: %d]", port);
+	debug->fd = accept(listener, NULL, NULL);
+	close(listener);
+	if (debug->fd < 0) {
+		vm_fail("Cannot accept debugger connection ...");
+	}
+	vm_info("GDB connected ...");
+
+	debug->ack		= 1;
+	debug->hit		= -1;
+	debug->interval	= debug_interval;
+	debug->in		= vm->in;
+	debug->out		= vm->out;
+	vm->in			= debug_in;
+	vm->out			= debug_out;
+	vm->debug		= debug;
+	debug_snapshot(vm);
+
+	ret = debug_serve(vm);
+
+	vm->in		= debug->in;
+	vm->out		= debug->out;
+	vm->debug	= NULL;
+	close(debug->fd);
+	for (i = 0; i < debug->points; i++) {
+		snapshot_destroy(debug->point[i].snapshot);
+	}
+	free(debug->log.data);
+
+	if (debug->detach) {
+		vm_info("GDB detached ... [instructions: %llu]", debug->now);
+		free(debug);
+		return vm_exec(vm);
+	}
+
+	free(debug);
+	return ret;
+}
+
+/* Returns byte received from GDB, -1 when connection is closed */
+static int debug_getc(debug_t *debug)
+{
+	ssize_t ret;
+
+	if (debug->rx_position == debug->rx_length) {
+		ret = read(debug->fd, debug->rx, sizeof(debug->rx));
+		if (ret <= 0) {
+			return -1;
+		}
+		debug->rx_length	= ret;
+		debug->rx_position	= 0;
+	}
+
+	return debug->rx[debug->rx_position++];
+}
+
+/* Value of hex digit, -1 for other characters */
+static int debug_hex(int c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+	return -1;
+}
+
+/* Receives packet into debug->packet, returns its length or -1 */
+static int debug_recv(debug_t *debug)
+{
+	int c, length, sum, check;
+
+	while (1) {
+		do {
+			c = debug_getc(debug);
+		} while (c >= 0 && c != '$');
+		if (c < 0) {
+			return -1;
+		}
+
+		for (length = 0, sum = 0; (c = debug_getc(debug)) >= 0 && c != '#'; sum += c) {
+			if (length < DEBUG_PACKET_SIZE - 1) {
+				debug->packet[length++] = c;
+			}
+		}
+		check = debug_hex(debug_getc(debug)) << 4;
+		check |= debug_hex(debug_getc(debug));
+		if (c < 0) {
+			return -1;
+		}
+		debug->packet[length] = '\0';
+
+		if (!debug->ack) {
+			return length;
+		}
+		if (check == (sum & 0xff)) {
+			write(debug->fd, "+", 1);
+			return length;
+		}
+		write(debug->fd, "-", 1);
+	}
+}
+
+/* Sends packet, resends until GDB acknowledges it */
+static void debug_send(debug_t *debug, const char *data)
+{
+	char frame[DEBUG_PACKET_SIZE + 4];
+	int length, sum = 0, c;
+
+	for (length = 0; data[length] && length < DEBUG_PACKET_SIZE; length++) {
+		sum += (unsigned char) data[length];
+	}
+	length = snprintf(frame, sizeof(frame), "$%.*s#%02x", length, data, sum & 0xff);
+
+	do {
+		if (write(debug->fd, frame, length) != length) {
+			return;
+		}
+		c = debug->ack ? debug_getc(debug) : '+';
+	} while (c == '-');
+}
+
+/* Sends text as console output packet */
+static void debug_console(debug_t *debug, const char *text)
+{
+	char packet[DEBUG_PACKET_SIZE];
+	int i;
+
+	packet[0] = 'O';
+	for (i = 0; text[i] && 2 * i + 3 < DEBUG_PACKET_SIZE; i++) {
+		sprintf(packet + 1 + 2 * i, "%02x", (unsigned char) text[i]);
+	}
+	packet[1 + 2 * i] = '\0';
+	debug_send(debug, packet);
+}
+
+/* Returns value of register in GDB numbering */
+static unsigned int debug_register(vm_t *vm, int n)
+{
+	if (n < REGISTERS_SIZE) {
+		return vm->registers.contents[n];
+	}
+	if (n == REGISTERS_SIZE) {
+		return (vm->pc * 2) & 0xffff;
+	}
+	return vm->stack.position + 1 < 0xffff ? vm->stack.position + 1 : 0xffff;
+}
+
+/* Sets register in GDB numbering, stack pointer is read only */
+static int debug_set_register(vm_t *vm, int n, unsigned int value)
+{
+	if (n < REGISTERS_SIZE && value <= VALUE_MAX_LITERAL) {
+		vm->registers.contents[n] = value;
+		return 0;
+	}
+	if (n == REGISTERS_SIZE && value / 2 < MEMORY_SIZE) {
+		vm->pc = value / 2;
+		return 0;
+	}
+	return -1;
+}
+
+/* Parses little-endian 16-bit hex value */
+static unsigned int debug_word(const char *p)
+{
+	return (debug_hex(p[0]) << 4 | debug_hex(p[1])) | (debug_hex(p[2]) << 4 | debug_hex(p[3])) << 8;
+}
+
+/* Runs mode with vm_fail() trapped, fault is reported as stop */
+static int debug_execute(vm_t *vm, int mode)
+{
+	vm_t *outer = vm_active;
+	jmp_buf trap;
+	int ret;
+
+	vm->trap	= &trap;
+	vm_active	= vm;
+	if (setjmp(trap)) {
+		debug_console(vm->debug, vm->error);
+		debug_console(vm->debug, "\n");
+		ret = DEBUG_STOP_FAULT;
+	} else {
+		ret = debug_resume(vm, mode);
+	}
+	vm->trap	= NULL;
+	vm_active	= outer;
+
+	return ret;
+}
+
+/* Handles monitor command, output goes to GDB console */
+static void debug_monitor(vm_t *vm, const char *command)
+{
+	debug_t *debug = vm->debug;
+	char text[256];
+	int reg;
+	unsigned long long interval;
+
+	if (sscanf(command, "watch r%d", &reg) == 1 && reg >= 0 && reg < REGISTERS_SIZE) {
+		debug->watch_regs |= 1 << reg;
+		snprintf(text, sizeof(text), "Watching writes of r%d\n", reg);
+	} else if (sscanf(command, "unwatch r%d", &reg) == 1 && reg >= 0 && reg < REGISTERS_SIZE) {
+		debug->watch_regs &= ~(1 << reg);
+		snprintf(text, sizeof(text), "Not watching r%d\n", reg);
+	} else if (sscanf(command, "interval %llu", &interval) == 1 && interval) {
+		debug->interval = interval;
+		snprintf(text, sizeof(text), "Snapshot interval %llu\n", interval);
+	} else if (!strcmp(command, "where")) {
+		snprintf(text, sizeof(text), "Instruction %llu of %llu, %d snapshots every %llu\n",
+			debug->now, debug->frontier, debug->points, debug->interval);
+	} else {
+		snprintf(text, sizeof(text), "Commands: watch rN, unwatch rN, interval K, where\n");
+	}
+
+	debug_console(debug, text);
+}
+
+/* Sends stop reply for given reason */
+static void debug_stop(vm_t *vm, int reason)
+{
+	debug_t *debug = vm->debug;
+	char reply[64];
+
+	switch (reason) {
+		case DEBUG_STOP_WATCH :
+			/* Register hits have no data address, reported on console */
+			if (debug->hit >= MEMORY_SIZE) {
+				snprintf(reply, sizeof(reply), "Register r%d written\n", debug->hit - MEMORY_SIZE);
+				debug_console(debug, reply);
+			} else if (debug->hit >= 0) {
+				snprintf(reply, sizeof(reply), "T05watch:%x;", debug->hit * 2);
+				debug_send(debug, reply);
+				return;
+			}
+			break;
+		case DEBUG_STOP_BEGIN :
+			debug_send(debug, "T05replaylog:begin;");
+			return;
+		case DEBUG_STOP_HALT :
+			debug_console(debug, "Program halted\n");
+			break;
+		case DEBUG_STOP_FAULT :
+			debug_send(debug, "S0b");
+			return;
+		case DEBUG_STOP_INTERRUPT :
+			debug_send(debug, "S02");
+			return;
+	}
+
+	debug_send(debug, "S05");
+}
+
+/**
+ * Serves GDB packets until detach, kill or closed connection
+ */
+
+int debug_serve(vm_t *vm)
+{
+	static const char *features =
+		"<?xml version=\"1.0\"?><!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+		"<target><feature name=\"org.synacor.core\">"
+		"<reg name=\"r0\" bitsize=\"16\"/><reg name=\"r1\" bitsize=\"16\"/>"
+		"<reg name=\"r2\" bitsize=\"16\"/><reg name=\"r3\" bitsize=\"16\"/>"
+		"<reg name=\"r4\" bitsize=\"16\"/><reg name=\"r5\" bitsize=\"16\"/>"
+		"<reg name=\"r6\" bitsize=\"16\"/><reg name=\"r7\" bitsize=\"16\"/>"
+		"<reg name=\"pc\" bitsize=\"16\" type=\"code_ptr\"/><reg name=\"sp\" bitsize=\"16\"/>"
+		"</feature></target>";
+	debug_t *debug = vm->debug;
+	char reply[DEBUG_PACKET_SIZE], *p, *end;
+	unsigned long address, length, offset, i;
+	unsigned int value;
+	int n, type, byte;
+
+	while (debug_recv(debug) >= 0) {
+		p		= debug->packet;
+		reply[0] = '\0';
+
+		switch (p[0]) {
+			case '?' :
+				strcpy(reply, "S05");
+				break;
+			/* Registers */
+			case 'g' :
+				for (n = 0; n < DEBUG_REGISTERS; n++) {
+					value = debug_register(vm, n);
+					sprintf(reply + 4 * n, "%02x%02x", value & 0xff, value >> 8);
+				}
+				break;
+			case 'G' :
+				for (n = 0; n <= REGISTERS_SIZE && strlen(p + 1) >= 4 * (size_t) (n + 1); n++) {
+					debug_set_register(vm, n, debug_word(p + 1 + 4 * n));
+				}
+				debug_truncate(vm);
+				strcpy(reply, "OK");
+				break;
+			case 'p' :
+				n = strtol(p + 1, NULL, 16);
+				if (n < DEBUG_REGISTERS) {
+					value = debug_register(vm, n);
+					sprintf(reply, "%02x%02x", value & 0xff, value >> 8);
+				} else {
+					strcpy(reply, "E01");
+				}
+				break;
+			case 'P' :
+				n = strtol(p + 1, &end, 16);
+				if (*end == '=' && strlen(end + 1) >= 4) {
+					strcpy(reply, debug_set_register(vm, n, debug_word(end + 1)) < 0 ? "E01" : "OK");
+					debug_truncate(vm);
+				} else {
+					strcpy(reply, "E01");
+				}
+				break;
+			/* Memory, bytes of little-endian words */
+			case 'm' :
+				address	= strtoul(p + 1, &end, 16);
+				length	= strtoul(end + 1, NULL, 16);
+				if (address + length > MEMORY_SIZE * 2 || 2 * length >= sizeof(reply)) {
+					strcpy(reply, "E01");
+					break;
+				}
+				for (i = 0; i < length; i++) {
+					value = vm->memory.contents[(address + i) / 2];
+					sprintf(reply + 2 * i, "%02x", ((address + i) & 1 ? value >> 8 : value) & 0xff);
+				}
+				break;
+			case 'M' :
+				address	= strtoul(p + 1, &end, 16);
+				length	= strtoul(end + 1, &end, 16);
+				if (address + length > MEMORY_SIZE * 2 || *end != ':' || strlen(end + 1) < 2 * length) {
+					strcpy(reply, "E01");
+					break;
+				}
+				for (i = 0; i < length; i++) {
+					byte	= debug_hex(end[1 + 2 * i]) << 4 | debug_hex(end[2 + 2 * i]);
+					value	= vm->memory.contents[(address + i) / 2];
+					value	= (address + i) & 1 ? (value & 0xff) | byte << 8 : (value & 0xff00) | byte;
+					mem_write(vm, (address + i) / 2, value);
+				}
+				debug_truncate(vm);
+				strcpy(reply, "OK");
+				break;
+			/* Execution */
+			case 'c' :
+				debug_stop(vm, debug_execute(vm, DEBUG_CONTINUE));
+				continue;
+			case 's' :
+				debug_stop(vm, debug_execute(vm, DEBUG_STEP));
+				continue;
+			case 'b' :
+				if (p[1] == 'c' || p[1] == 's') {
+					debug_stop(vm, debug_execute(vm, p[1] == 'c' ? DEBUG_REVERSE_CONTINUE : DEBUG_REVERSE_STEP));
+					continue;
+				}
+				break;
+			/* Breakpoints and write watchpoints */
+			case 'Z' :
+			case 'z' :
+				type	= strtol(p + 1, &end, 16);
+				address	= strtoul(end + 1, &end, 16);
+				length	= strtoul(end + 1, NULL, 16);
+				if (type > 2 || address >= MEMORY_SIZE * 2) {
+					break;
+				}
+				for (i = address / 2; i <= (address + (type == 2 ? length - 1 : 0)) / 2 && i < MEMORY_SIZE; i++) {
+					if (p[0] == 'Z') {
+						debug->flags[i] |= type == 2 ? DEBUG_WATCH : DEBUG_BREAK;
+					} else {
+						debug->flags[i] &= ~(type == 2 ? DEBUG_WATCH : DEBUG_BREAK);
+					}
+				}
+				strcpy(reply, "OK");
+				break;
+			case 'H' :
+				strcpy(reply, "OK");
+				break;
+			case 'D' :
+				debug->detach = 1;
+				debug_send(debug, "OK");
+				return VM_STOPPED;
+			case 'k' :
+				return VM_STOPPED;
+			case 'v' :
+				if (!strcmp(p, "vKill;1") || !strncmp(p, "vKill", 5)) {
+					debug_send(debug, "OK");
+					return VM_STOPPED;
+				}
+				break;
+			case 'Q' :
+				if (!strcmp(p, "QStartNoAckMode")) {
+					debug_send(debug, "OK");
+					debug->ack = 0;
+					continue;
+				}
+				break;
+			case 'q' :
+				if (!strncmp(p, "qSupported", 10)) {
+					snprintf(reply, sizeof(reply), "PacketSize=%x;QStartNoAckMode+;ReverseStep+;"
+						"ReverseContinue+;qXfer:features:read+", DEBUG_PACKET_SIZE - 1);
+				} else if (!strcmp(p, "qAttached")) {
+					strcpy(reply, "1");
+				} else if (!strcmp(p, "qfThreadInfo")) {
+					strcpy(reply, "m1");
+				} else if (!strcmp(p, "qsThreadInfo")) {
+					strcpy(reply, "l");
+				} else if (!strcmp(p, "qC")) {
+					strcpy(reply, "QC1");
+				} else if (sscanf(p, "qXfer:features:read:target.xml:%lx,%lx", &offset, &length) == 2) {
+					/* Chunk prefixed by m (more) or l (last) */
+					n = strlen(features);
+					if (length > sizeof(reply) - 2) {
+						length = sizeof(reply) - 2;
+					}
+					if (offset >= (unsigned long) n) {
+						strcpy(reply, "l");
+					} else {
+						snprintf(reply, sizeof(reply), "%c%.*s",
+							offset + length >= (unsigned long) n ? 'l' : 'm', (int) length, features + offset);
+					}
+				} else if (!strncmp(p, "qRcmd,", 6)) {
+					for (i = 0; p[6 + 2 * i] && p[7 + 2 * i] && i < sizeof(reply) - 1; i++) {
+						reply[i] = debug_hex(p[6 + 2 * i]) << 4 | debug_hex(p[7 + 2 * i]);
+					}
+					reply[i] = '\0';
+					debug_monitor(vm, reply);
+					strcpy(reply, "OK");
+				}
+				break;
+		}
+
+		debug_send(debug, reply);
+	}
+
+	/* Connection closed */
+	return VM_STOPPED;
+}
+
+/* Returns true if GDB sent interrupt (Ctrl-C) */
+static int debug_interrupted(debug_t *debug)
+{
+	struct pollfd fd = { debug->fd, POLLIN, 0 };
+
+	while (debug->rx_position < debug->rx_length || poll(&fd, 1, 0) > 0) {
+		if (debug_getc(debug) == 0x03) {
+			return 1;
+		}
+		if (debug->rx_position == debug->rx_length) {
+			break;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Executes one instruction at frontier or replays one from history
+ *
+ * Returns 1 when halt is reached (not executed), 2 when input blocked,
+ * 0 otherwise. debug->hit is set to watched address written.
+ */
+
+static int debug_step(vm_t *vm)
+{
+	debug_t *debug = vm->debug;
+	unsigned short *m = vm->memory.contents;
+	int pc = vm->pc, opcode = m[pc], address = -1, reg = -1, status;
+
+	if (debug->now % debug->interval == 0 &&
+		debug->point[debug->points - 1].index < debug->now) {
+		debug_snapshot(vm);
+	}
+
+	debug->hit = -1;
+	if (opcode == 0) {
+		return 1;
+	}
+	if (opcode == 16) {
+		address = val_get(vm, m[pc+1]) & STORAGE_MEM_HIGH;
+	} else if (opcode < ARCH_OPCODES && opcodes[opcode].dest) {
+		reg = m[pc+1] - STORAGE_REG_LOW;
+	}
+
+	status = operation_exec(vm, m[pc], m[pc+1], m[pc+2], m[pc+3], &pc);
+	if (status == 2 && pc == vm->pc) {
+		return 2;
+	}
+	if (pc < 0 || pc > vm->binary.length) {
+		vm_fail("Program counter out of bounds.");
+	}
+
+	vm->pc = pc;
+	vm->insns++;
+	if (++debug->now > debug->frontier) {
+		debug->frontier = debug->now;
+	}
+
+	if (address >= 0 && (debug->flags[address] & DEBUG_WATCH)) {
+		debug->hit = address;
+	} else if (reg >= 0 && reg < REGISTERS_SIZE && (debug->watch_regs & (1 << reg))) {
+		debug->hit = MEMORY_SIZE + reg;
+	}
+	return 0;
+}
+
+/**
+ * Runs forward or backward in given mode, returns stop reason
+ *
+ * Reverse continue scans history from the latest snapshot back and
+ * stops at the last position where forward run would have stopped.
+ */
+
+int debug_resume(vm_t *vm, int mode)
+{
+	debug_t *debug = vm->debug;
+	unsigned long long now = debug->now, end, candidate, count = 0;
+	int i, ret, hit = -1;
+
+	switch (mode) {
+		case DEBUG_STEP :
+			ret = debug_step(vm);
+			if (ret == 1) {
+				return DEBUG_STOP_HALT;
+			}
+			return debug->hit >= 0 ? DEBUG_STOP_WATCH : DEBUG_STOP_TRAP;
+
+		case DEBUG_CONTINUE :
+			do {
+				ret = debug_step(vm);
+				if (ret == 1) {
+					return DEBUG_STOP_HALT;
+				}
+				if (ret == 2 || debug->hit >= 0) {
+					return ret == 2 ? DEBUG_STOP_TRAP : DEBUG_STOP_WATCH;
+				}
+				if (++count % DEBUG_POLL == 0 && debug_interrupted(debug)) {
+					return DEBUG_STOP_INTERRUPT;
+				}
+			} while (!(debug->flags[vm->pc] & DEBUG_BREAK));
+			return DEBUG_STOP_TRAP;
+
+		case DEBUG_REVERSE_STEP :
+			if (!now) {
+				return DEBUG_STOP_BEGIN;
+			}
+			debug_seek(vm, now - 1);
+			return DEBUG_STOP_TRAP;
+
+		case DEBUG_REVERSE_CONTINUE :
+			end = now;
+			for (i = debug->points - 1; i >= 0; i--) {
+				if (debug->point[i].index >= end) {
+					continue;
+				}
+
+				/* Replay segment, remember last stopping position */
+				debug_seek(vm, debug->point[i].index);
+				candidate = ~0ULL;
+				while (debug->now < end) {
+					if (debug->flags[vm->pc] & DEBUG_BREAK) {
+						candidate	= debug->now;
+						hit			= -1;
+					}
+					if (debug_step(vm)) {
+						break;
+					}
+					if (debug->hit >= 0 && debug->now < now) {
+						candidate	= debug->now;
+						hit			= debug->hit;
+					}
+				}
+				if (candidate != ~0ULL) {
+					debug_seek(vm, candidate);
+					debug->hit = hit;
+					return hit >= 0 ? DEBUG_STOP_WATCH : DEBUG_STOP_TRAP;
+				}
+				end = debug->point[i].index;
+			}
+			debug_seek(vm, 0);
+			return DEBUG_STOP_BEGIN;
+	}
+
+	return DEBUG_STOP_TRAP;
+}
+
+/**
+ * Moves to given instruction index of history
+ */
+
+void debug_seek(vm_t *vm, unsigned long long target)
+{
+	debug_t *debug = vm->debug;
+	debug_point_t *point;
+	int i;
+
+	for (i = debug->points - 1; i > 0 && debug->point[i].index > target; i--);
+	point = &debug->point[i];
+
+	/* Keep going forward when nearest snapshot is behind us */
+	if (target < debug->now || point->index > debug->now) {
+		snapshot_restore(vm, point->snapshot);
+		debug->now			= point->index;
+		debug->log.position	= point->input;
+	}
+
+	while (debug->now < target && debug_step(vm) == 0);
+}
+
+/**
+ * Takes snapshot at current instruction, thins list when full
+ */
+
+void debug_snapshot(vm_t *vm)
+{
+	debug_t *debug = vm->debug;
+	debug_point_t *point;
+	int i;
+
+	if (debug->points == DEBUG_SNAPSHOTS) {
+		for (i = 1; i < debug->points; i++) {
+			if (i % 2) {
+				snapshot_destroy(debug->point[i].snapshot);
+			} else {
+				debug->point[i / 2] = debug->point[i];
+			}
+		}
+		debug->points	= (debug->points + 1) / 2;
+		debug->interval	*= 2;
+		if (debug->now % debug->interval) {
+			return;
+		}
+	}
+
+	point = &debug->point[debug->points++];
+	point->index	= debug->now;
+	point->input	= debug->log.position;
+	point->snapshot	= snapshot_create();
+	snapshot_take(vm, point->snapshot);
+}
+
+/**
+ * Drops history after current instruction once state was modified
+ */
+
+void debug_truncate(vm_t *vm)
+{
+	debug_t *debug = vm->debug;
+
+	while (debug->points > 1 && debug->point[debug->points - 1].index >= debug->now) {
+		snapshot_destroy(debug->point[--debug->points].snapshot);
+	}
+	debug->frontier		= debug->now;
+	debug->log.length	= debug->log.position;
+
+	/* Snapshot of modified state, first one only when at start */
+	if (debug->point[debug->points - 1].index == debug->now) {
+		snapshot_destroy(debug->point[--debug->points].snapshot);
+	}
+	debug_snapshot(vm);
+}
+
+/**
+ * Input callback of debugged instance, replays logged input
+ */
+
+int debug_in(vm_t *vm)
+{
+	debug_t *debug = vm->debug;
+	char *data;
+	int value;
+
+	if (debug->log.position < debug->log.length) {
+		return (unsigned char) debug->log.data[debug->log.position++];
+	}
+
+	value = debug->in(vm);
+	if (value < 0) {
+		return value;
+	}
+
+	if (debug->log.length == debug->log_size) {
+		data = realloc(debug->log.data, debug->log_size ? debug->log_size * 2 : IO_BUFFER_SIZE);
+		if (!data) {
+			vm_fail("Function %s() failed!", __FUNCTION__);
+		}
+		debug->log.data	= data;
+		debug->log_size	= debug->log_size ? debug->log_size * 2 : IO_BUFFER_SIZE;
+	}
+	debug->log.data[debug->log.length++] = value;
+	debug->log.position++;
+
+	return value;
+}
+
+/**
+ * Output callback of debugged instance, replayed output is suppressed
+ */
+
+void debug_out(vm_t *vm, unsigned short value)
+{
+	debug_t *debug = vm->debug;
+
+	if (debug->now >= debug->frontier) {
+		debug->out(vm, value);
+	}
+}
+
+/**
+ * Serves sessions on given address until interrupted
+ *
+ * Instance of every connection is forked from program as loaded, so
+ * sessions share nothing but position of first instruction.
+ */
+
+int serve_run(vm_t *vm, const char *spec)
+{
+	struct epoll_event events[SERVE_EVENTS], event;
+	struct sockaddr_in address;
+	serve_session_t *s;
+	serve_t serve;
+	const char *colon = strrchr(spec, ':');
+	char host[64];
+	int one = 1, port, n, i;
+
+	/* Loopback unless host is given */
+	memset(&address, 0, sizeof(address));
+	address.sin_family		= AF_INET;
+	address.sin_addr.s_addr	= htonl(INADDR_LOOPBACK);
+	port = atoi(colon ? colon + 1 : spec);
+	if (colon) {
+		snprintf(host, sizeof(host), "%.*s", (int) (colon - spec), spec);
+		if (inet_pton(AF_INET, host, &address.sin_addr) != 1) {
+			vm_fail("Invalid listen address ... [%s]", spec);
+		}
+	}
+	if (port <= 0 || port > 65535) {
+		vm_fail("Invalid listen address ... [%s]", spec);
+	}
+	address.sin_port = htons(port);
+
+	memset(&serve, 0, sizeof(serve));
+	serve.listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (serve.listener < 0 || setsockopt(serve.listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+		bind(serve.listener, (struct sockaddr *) &address, sizeof(address)) < 0 ||
+		listen(serve.listener, SERVE_BACKLOG) < 0) {
+		vm_fail("Cannot listen for sessions ... [%s]", spec);
+	}
+
+	serve.epoll		= epoll_create1(0);
+	event.events	= EPOLLIN;
+	event.data.ptr	= NULL;
+	if (serve.epoll < 0 || epoll_ctl(serve.epoll, EPOLL_CTL_ADD, serve.listener, &event) < 0) {
+		vm_fail("Cannot create event loop ...");
+	}
+
+	serve.base = snapshot_create();
+	snapshot_take(vm, serve.base);
+	vm_info("Serving sessions ... [%s]", spec);
+
+	for (;;) {
+		/* Poll only when nothing is runnable */
+		n = epoll_wait(serve.epoll, events, SERVE_EVENTS, serve.head ? 0 : -1);
+		if (n < 0 && errno != EINTR) {
+			vm_fail("Event loop failed ...");
+		}
+		for (i = 0; i < n; i++) {
+			s = events[i].data.ptr;
+			if (!s) {
+				serve_accept(&serve);
+				continue;
+			}
+			if (events[i].events & EPOLLOUT) {
+				if (serve_flush(s) < 0 || (s->state == SERVE_CLOSING && s->out.length == s->out.position)) {
+					serve_close(&serve, s);
+					continue;
+				}
+				if (s->state == SERVE_PAUSED && s->out.length == s->out.position) {
+					serve_queue(&serve, s);
+				}
+				serve_watch(&serve, s);
+			}
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+				serve_read(&serve, s);
+			}
+		}
+
+		/* One slice for every session queued before this turn */
+		for (n = 0, s = serve.head; s; s = s->next) {
+			n++;
+		}
+		while (n--) {
+			s			= serve.head;
+			serve.head	= s->next;
+			if (!serve.head) {
+				serve.tail = NULL;
+			}
+			serve_exec(&serve, s);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Accepts pending connections, instances run to first input
+ */
+
+void serve_accept(serve_t *serve)
+{
+	struct epoll_event event;
+	serve_session_t *s;
+	int fd;
+
+	while ((fd = accept(serve->listener, NULL, NULL)) >= 0) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+		s = calloc(1, sizeof(serve_session_t));
+		if (!s || !(s->vm = vm_create()) ||
+			!(s->vm->input.data = malloc(SERVE_INPUT_SIZE)) || !(s->out.data = malloc(SERVE_OUTPUT_SIZE))) {
+			vm_fail("Function %s() failed!", __FUNCTION__);
+		}
+		s->fd	= fd;
+		s->id	= ++serve->next_id;
+		snapshot_restore(s->vm, serve->base);
+		s->vm->in	= io_buffer_in;
+		s->vm->out	= serve_out;
+		s->vm->user	= s;
+
+		s->events		= EPOLLIN;
+		event.events	= s->events;
+		event.data.ptr	= s;
+		if (epoll_ctl(serve->epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+			vm_fail("Cannot watch session ... [%d]", s->id);
+		}
+		serve->sessions++;
+		serve_queue(serve, s);
+	}
+}
+
+/**
+ * Appends received bytes to input of session, waiting instance is woken
+ */
+
+void serve_read(serve_t *serve, serve_session_t *s)
+{
+	buffer_t *input = &s->vm->input;
+	ssize_t ret;
+
+	/* Consumed input is dropped first */
+	if (input->position) {
+		memmove(input->data, input->data + input->position, input->length - input->position);
+		input->length	-= input->position;
+		input->position	= 0;
+	}
+
+	while (!s->eof && input->length < SERVE_INPUT_SIZE) {
+		ret = recv(s->fd, input->data + input->length, SERVE_INPUT_SIZE - input->length, 0);
+		if (ret > 0) {
+			input->length += ret;
+		} else if (ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+			s->eof = 1;
+		} else if (errno != EINTR) {
+			break;
+		}
+	}
+
+	if (s->state == SERVE_WAITING) {
+		if (input->length) {
+			serve_queue(serve, s);
+		} else if (s->eof) {
+			serve_close(serve, s);
+			return;
+		}
+	}
+	serve_watch(serve, s);
+}
+
+/**
+ * Runs one slice of session instance
+ */
+
+void serve_exec(serve_t *serve, serve_session_t *s)
+{
+	vm_t *vm = s->vm;
+	int ret;
+
+	s->state = SERVE_WAITING;
+	ret = vm_run(vm, SERVE_SLICE);
+
+	switch (ret) {
+		case VM_RUNNING :
+			serve_queue(serve, s);
+			return;
+		case VM_STOPPED :
+			/* Stopped by full output or waiting for input */
+			if (s->out.length == SERVE_OUTPUT_SIZE) {
+				s->state = SERVE_PAUSED;
+			} else if (s->eof && vm->input.position >= vm->input.length) {
+				s->state = SERVE_CLOSING;
+			}
+			break;
+		case VM_ERROR :
+			vm_info("Session failed ... [%d: %s]", s->id, vm_error(vm));
+			s->state = SERVE_CLOSING;
+			break;
+		default :
+			s->state = SERVE_CLOSING;
+			break;
+	}
+
+	if (serve_flush(s) < 0 || (s->state == SERVE_CLOSING && s->out.length == s->out.position)) {
+		serve_close(serve, s);
+		return;
+	}
+	if (s->state == SERVE_PAUSED && s->out.length == s->out.position) {
+		serve_queue(serve, s);
+	}
+	serve_watch(serve, s);
+}
+
+/**
+ * Sends coalesced output, returns -1 when peer is gone
+ */
+
+int serve_flush(serve_session_t *s)
+{
+	buffer_t *out = &s->out;
+	ssize_t ret;
+
+	while (out->position < out->length) {
+		ret = send(s->fd, out->data + out->position, out->length - out->position, MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return 0;
+		}
+		if (ret <= 0) {
+			return -1;
+		}
+		out->position += ret;
+	}
+	out->length		= 0;
+	out->position	= 0;
+
+	return 0;
+}
+
+/* Appends session to run queue */
+void serve_queue(serve_t *serve, serve_session_t *s)
+{
+	s->state	= SERVE_RUNNABLE;
+	s->next		= NULL;
+	if (serve->tail) {
+		serve->tail->next = s;
+	} else {
+		serve->head = s;
+	}
+	serve->tail = s;
+}
+
+/**
+ * Watches input while there is room for it and output while unsent
+ */
+
+void serve_watch(serve_t *serve, serve_session_t *s)
+{
+	struct epoll_event event;
+	unsigned int events = 0;
+
+	if (!s->eof && (s->vm->input.length < SERVE_INPUT_SIZE || s->vm->input.position)) {
+		events |= EPOLLIN;
+	}
+	if (s->out.position < s->out.length) {
+		events |= EPOLLOUT;
+	}
+	if (events != s->events) {
+		s->events		= events;
+		event.events	= events;
+		event.data.ptr	= s;
+		epoll_ctl(serve->epoll, EPOLL_CTL_MOD, s->fd, &event);
+	}
+}
+
+/**
+ * Closes connection and releases its instance, queued session is
+ * unlinked first
+ */
+
+void serve_close(serve_t *serve, serve_session_t *s)
+{
+	serve_session_t **link = &serve->head, *prev = NULL;
+
+	/* Send may fail while session waits for its next slice */
+	if (s->state == SERVE_RUNNABLE) {
+		while (*link != s) {
+			prev = *link;
+			link = &prev->next;
+		}
+		*link = s->next;
+		if (serve->tail == s) {
+			serve->tail = prev;
+		}
+	}
+
+	close(s->fd);
+	vm_destroy(s->vm);
+	free(s->out.data);
+	free(s);
+	serve->sessions--;
+}
+
+/**
+ * Output callback of session instances, full buffer stops instance
+ * until it is sent
+ */
+
+void serve_out(vm_t *vm, unsigned short value)
+{
+	serve_session_t *s = vm->user;
+
+	s->out.data[s->out.length++] = value;
+	if (s->out.length == SERVE_OUTPUT_SIZE) {
+		vm->stop = 1;
+	}
+}
+
+/**
+ * Returns breakpoints of instance, allocated on first use
+ */
+
+break_t *break_get(vm_t *vm)
+{
+	if (!vm->breaks) {
+		vm->breaks = calloc(1, sizeof(break_t));
+		if (!vm->breaks) {
+			vm_fail("Function %s() failed!", __FUNCTION__);
+		}
+		vm->breaks->resume = -1;
+	}
+
+	return vm->breaks;
+}
+
+/**
+ * Drops decoded entries affected by changed point, -1 for all
+ */
+
+void break_update(vm_t *vm, int address)
+{
+	if (!vm->decoded || !vm->decoded->active) {
+		return;
+	}
+
+	if (address < 0 || !vm->breaks->points) {
+		vm->decoded->active = 0;
+	} else {
+		decode_invalidate(vm, address, address + 1);
+	}
+}
+
+/* Appends character to recent ones, returns true once they end with pattern */
+static int break_match(break_t *b, int which, unsigned short value)
+{
+	char *seen = b->seen[which];
+	size_t length = strlen(seen), n = strlen(b->pattern[which]);
+
+	if (length == BREAK_PATTERN_SIZE - 1) {
+		memmove(seen, seen + 1, --length);
+	}
+	seen[length++]	= value;
+	seen[length]	= '\0';
+
+	return length >= n && !memcmp(seen + length - n, b->pattern[which], n);
+}
+
+/**
+ * Executes instruction of patched entry through operation_exec()
+ *
+ * Returns operation_exec() status, 2 also when break was hit. Stop
+ * before breakpoint is passed once, so resuming executes it.
+ */
+
+int break_exec(vm_t *vm, int *pc)
+{
+	break_t *b = vm->breaks;
+	unsigned short *m = vm->memory.contents;
+	unsigned short before[REGISTERS_SIZE];
+	int start = *pc, opcode = m[start], address = -1, reason = VM_BREAK_NONE, status, i;
+	unsigned short value = 0;
+
+	if ((b->flags[start] & BREAK_PC) && b->resume != start) {
+		b->resume	= start;
+		b->reason	= VM_BREAK_PC;
+		b->address	= start;
+		return 2;
+	}
+	b->resume = -1;
+
+	if (opcode == 16 && b->words) {
+		address = val_get(vm, m[start+1]) & STORAGE_MEM_HIGH;
+	} else if (opcode == 19) {
+		value = val_get(vm, m[start+1]);
+	}
+	memcpy(before, vm->registers.contents, sizeof(before));
+
+	status = operation_exec(vm, m[start], m[start+1], m[start+2], m[start+3], pc);
+	if (status == 2 && *pc == start) {
+		return status;			/* Input blocked, nothing happened */
+	}
+
+	if (address >= 0 && (b->flags[address] & BREAK_WRITE)) {
+		reason	= VM_BREAK_MEMORY;
+	} else if (opcode == 19 && b->pattern[BREAK_OUTPUT][0] && break_match(b, BREAK_OUTPUT, value)) {
+		reason	= VM_BREAK_OUTPUT;
+		address	= start;
+	} else if (opcode == 20 && b->pattern[BREAK_INPUT][0] &&
+		break_match(b, BREAK_INPUT, vm->registers.contents[m[start+1] - STORAGE_REG_LOW])) {
+		reason	= VM_BREAK_INPUT;
+		address	= start;
+	} else if (b->regs) {
+		for (i = 0; i < REGISTERS_SIZE; i++) {
+			if ((b->regs & (1 << i)) && (before[i] != vm->registers.contents[i] ||
+				(opcodes[opcode].dest && m[start+1] == STORAGE_REG_LOW + i))) {
+				reason	= VM_BREAK_REGISTER;
+				address	= i;
+				break;
+			}
+		}
+	}
+
+	if (reason != VM_BREAK_NONE) {
+		b->reason	= reason;
+		b->address	= address;
+		return status ? status : 2;
+	}
+	return status;
+}
+
+/**
+ * Sets point from command line - ADDR, w:ADDR, r:N, o:TEXT or i:TEXT
+ */
+
+int break_option(vm_t *vm, const char *spec)
+{
+	const char *start = spec;
+	char *end, kind = 'p';
+	long value;
+
+	if (spec[0] && spec[1] == ':') {
+		kind	= spec[0];
+		start	= spec + 2;
+	}
+	if (kind == 'o' || kind == 'i') {
+		return kind == 'o' ? vm_break_output(vm, start) : vm_break_input(vm, start);
+	}
+
+	value = strtol(start, &end, 0);
+	if (*end || end == start) {
+		return -1;
+	}
+
+	switch (kind) {
+		case 'p' :
+			return vm_break(vm, value, 1);
+		case 'w' :
+			return vm_watch_memory(vm, value, 1);
+		case 'r' :
+			return vm_watch_register(vm, value, 1);
+	}
+	return -1;
+}
+
+/**
+ * Indexes length prefixed strings in memory [0, length)
+ */
+
+void strings_index(strings_t *strings, const unsigned short *memory, int length)
+{
+	int address, i, n;
+
+	strings->count = 0;
+	for (address = 0; address < MEMORY_SIZE; address++) {
+		strings->index[address] = -1;
+	}
+
+	for (address = 0; address < length; address++) {
+		n = memory[address];
+		if (n < STRINGS_MIN_LENGTH || address + n >= length) {
+			continue;
+		}
+		for (i = 1; i <= n; i++) {
+			if ((memory[address + i] < 32 || memory[address + i] > 126) &&
+				memory[address + i] != '\n' && memory[address + i] != '\t') {
+				break;
+			}
+		}
+		if (i <= n) {
+			continue;
+		}
+
+		strings->entry[strings->count].address	= address;
+		strings->entry[strings->count].length	= n;
+		for (i = 0; i <= n; i++) {
+			strings->index[address + i] = strings->count;
+		}
+		strings->count++;
+		address += n;
+	}
+}
+
+/**
+ * Returns string covering address, NULL if none
+ */
+
+const string_t *strings_lookup(const strings_t *strings, int address)
+{
+	if (address < 0 || address >= MEMORY_SIZE || strings->index[address] < 0) {
+		return NULL;
+	}
+
+	return &strings->entry[strings->index[address]];
+}
+
+/* Writes string quoted with escapes */
+static void strings_write(FILE *fp, const unsigned short *memory, const string_t *string)
+{
+	int i, c;
+
+	fputc('"', fp);
+	for (i = 1; i <= string->length; i++) {
+		c = memory[string->address + i];
+		if (c == '\n') {
+			fprintf(fp, "\\n");
+		} else if (c == '\t') {
+			fprintf(fp, "\\t");
+		} else {
+			if (c == '"' || c == '\\') {
+				fputc('\\', fp);
+			}
+			fputc(c, fp);
+		}
+	}
+	fputc('"', fp);
+}
+
+/**
+ * Indexes strings of loaded image and after self-decryption
+ *
+ * Copy of the machine runs with no input and discarded output until it
+ * first asks for input (or halts), by then the challenge binary has
+ * decrypted its text. Both indexes are merged by address and every
+ * string is tagged:
+ *   - S:	static only, overwritten at runtime
+ *   - R:	runtime only, decrypted or generated
+ *   - C:	changed text at the same address
+ *   - =:	identical in both
+ * Query ADDR prints string covering that address in either index.
+ */
+
+int strings_run(vm_t *vm, const char *query)
+{
+	static strings_t before, after;
+	const string_t *s, *r;
+	const unsigned short *memory;
+	char *end;
+	vm_t *run;
+	int address, tag, counts[4] = { 0 };
+
+	run = vm_create();
+	if (!run) {
+		vm_fail("Cannot create virtual machine ...");
+	}
+	vm_clone(run, vm);
+	run->binary.engine	= vm->binary.engine;
+	run->in				= io_buffer_in;
+	run->out			= io_discard_out;
+
+	vm_info("Running until first input ...");
+	vm_exec(run);
+	vm_info("Stopped ... [pc: %d]", run->pc);
+
+	strings_index(&before,	vm->memory.contents,	vm->binary.length);
+	strings_index(&after,	run->memory.contents,	MEMORY_SIZE);
+
+	/* Single address */
+	if (strcmp(query, "all")) {
+		address = strtol(query, &end, 0);
+		if (*end || address < 0 || address >= MEMORY_SIZE) {
+			vm_fail("Invalid strings query ... [%s]", query);
+		}
+		s = strings_lookup(&after, address);
+		memory = run->memory.contents;
+		if (!s) {
+			s = strings_lookup(&before, address);
+			memory = vm->memory.contents;
+		}
+		if (!s) {
+			vm_info("No string at address ... [%d]", address);
+			vm_destroy(run);
+			return -1;
+		}
+		printf("%d %d ", s->address, s->length);
+		strings_write(stdout, memory, s);
+		printf("\n");
+		vm_destroy(run);
+		return 0;
+	}
+
+	for (address = 0; address < MEMORY_SIZE; address++) {
+		s = (before.index[address] >= 0 && before.entry[before.index[address]].address == address) ?
+			&before.entry[before.index[address]] : NULL;
+		r = (after.index[address] >= 0 && after.entry[after.index[address]].address == address) ?
+			&after.entry[after.index[address]] : NULL;
+		if (!s && !r) {
+			continue;
+		}
+
+		if (s && r) {
+			tag = (s->length == r->length && !memcmp(vm->memory.contents + address,
+				run->memory.contents + address, (s->length + 1) * sizeof(unsigned short))) ? '=' : 'C';
+		} else {
+			tag = s ? 'S' : 'R';
+		}
+		counts[tag == '=' ? 0 : tag == 'C' ? 1 : tag == 'S' ? 2 : 3]++;
+
+		printf("%6d %5d %c ", address, (r ? r : s)->length, tag);
+		strings_write(stdout, r ? run->memory.contents : vm->memory.contents, r ? r : s);
+		printf("\n");
+	}
+
+	vm_info("Strings ... [static: %d] [runtime: %d] [same: %d] [changed: %d] [static only: %d] [runtime only: %d]",
+		before.count, after.count, counts[0], counts[1], counts[2], counts[3]);
+	vm_destroy(run);
+	return 0;
+}
+
+/**
+ * JIT engine - interprets cold code and runs hot basic blocks natively
+ *
+ * Every address reached by the interpreter has execution counter, once
+ * it crosses JIT_THRESHOLD the basic block starting there is compiled.
+ * Block keeps the eight VM registers in host registers r8d..r15d and
+ * jumps into compiled block of next instruction, address of next
+ * instruction is returned when there is none. Blocks only reference helpers
+ * and storage through jit_ctx_t so generated code is position independent.
+ */
+
+int exec_jit(vm_t *vm)
+{
+	int pc 		= vm->pc;	/* Program counter */
+	int status 	= 0;		/* Halt or stop */
+	int follow	= 0;		/* Sequential within static block */
+	unsigned long long left = VM_BUDGET(vm);
+	unsigned short opcode;
+	int last;
+	jit_block_fn fn;
+	jit_t *jit;
+
+	if (jit_init(vm) < 0) {
+		vm_info("JIT is not available, using decoded engine ...");
+		vm->binary.engine = ENGINE_DECODED;
+		return exec_decoded(vm);
+	}
+	jit = vm->jit;
+
+	/* Execute binary program */
+	while (!status) {
+		if (!left--) {
+			vm->pc = pc;
+			return VM_RUNNING;
+		}
+
+		fn = jit->entries[pc];
+		if (fn) {
+			/* Back edges and chained blocks take from same budget */
+			jit->ctx.loops = left;
+			pc = fn(&jit->ctx);
+			left = jit->ctx.loops;
+			follow = 0;
+		} else if (!follow && ++jit->counters[pc] == JIT_THRESHOLD && jit_compile(vm, pc) == 0) {
+			continue;
+		} else {
+			last	= pc;
+			opcode	= vm->memory.contents[pc];
+			status	= operation_exec(vm, 
+				opcode,
+				vm->memory.contents[pc+1],
+				vm->memory.contents[pc+2],
+				vm->memory.contents[pc+3],
+				&pc);
+
+			/*
+			 * With static CFG, blocks are only started at leaders, after
+			 * control transfer and after instructions left uncompiled.
+			 */
+			follow = vm->cfg && !(vm->cfg->flags[pc] & CFG_LEADER) &&
+				pc == last + opcodes[opcode].length && opcode != 19 && opcode != 20;
+		}
+
+		if (pc < 0 || pc > vm->binary.length) {
+			vm_fail("Program counter out of bounds.");
+		}
+	}
+
+	vm->pc = pc;
+	return status == 1 ? VM_HALTED : VM_STOPPED;
+}
+
+#if HAVE_JIT
+
+/**
+ * Helpers called from generated code
+ */
+
+void jit_push(jit_ctx_t *ctx, unsigned int value)
+{
+	stack_push(ctx->vm, value);
+}
+
+unsigned int jit_pop(jit_ctx_t *ctx)
+{
+	return stack_pop(ctx->vm);
+}
+
+void jit_wmem(jit_ctx_t *ctx, unsigned int address, unsigned int value)
+{
+	mem_write(ctx->vm, address, value);
+}
+
+unsigned int jit_call(jit_ctx_t *ctx, unsigned int target, unsigned int next)
+{
+	if (accel.map[target] && accel_call(ctx->vm, target, next)) {
+		return next;
+	}
+
+	stack_push(ctx->vm, next);	/* Push address of next instruction to stack */
+	return target;
+}
+
+/* Fails on mod by zero at pc, registers are stored */
+void jit_fault(jit_ctx_t *ctx, unsigned int pc)
+{
+	vm_fail("Division by zero ... [pc: %d]", pc);
+}
+
+unsigned int jit_ret(jit_ctx_t *ctx)
+{
+	unsigned short address = stack_pop(ctx->vm);	/* Pop address of next instruction from stack */
+
+	if (ACCEL_RETURNING(ctx->vm)) {
+		accel_ret(ctx->vm, address);
+	}
+	return address;
+}
+
+/**
+ * Allocates code buffer and initializes block tables
+ */
+
+int jit_init(vm_t *vm)
+{
+	jit_t *jit = vm->jit;
+
+	if (jit && jit->active) {
+		return 0;
+	}
+	if (!jit) {
+		jit = vm->jit = calloc(1, sizeof(jit_t));
+		if (!jit) {
+			return -1;
+		}
+	}
+
+	jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (jit->code == MAP_FAILED) {
+		jit->code = NULL;
+		return -1;
+	}
+
+	jit->ctx.registers	= vm->registers.contents;
+	jit->ctx.memory		= vm->memory.contents;
+	jit->ctx.helpers[JIT_HELPER_PUSH]	= (void *) jit_push;
+	jit->ctx.helpers[JIT_HELPER_POP]		= (void *) jit_pop;
+	jit->ctx.helpers[JIT_HELPER_WMEM]	= (void *) jit_wmem;
+	jit->ctx.helpers[JIT_HELPER_CALL]	= (void *) jit_call;
+	jit->ctx.helpers[JIT_HELPER_RET]		= (void *) jit_ret;
+	jit->ctx.helpers[JIT_HELPER_FAULT]	= (void *) jit_fault;
+	jit->ctx.vm		= vm;
+	jit->ctx.entries	= (void **) jit->entries;
+	jit->ctx.accel		= accel.map;
+
+	jit_flush(vm);
+	jit->active = 1;
+	return 0;
+}
+
+/**
+ * Drops all compiled blocks and resets code buffer
+ */
+
+void jit_flush(vm_t *vm)
+{
+	jit_t *jit = vm->jit;
+
+	memset(jit->entries,		0, sizeof(jit->entries));
+	memset(jit->counters,	0, sizeof(jit->counters));
+	memset(jit->covered,		0, sizeof(jit->covered));
+
+	jit->used	= 0;
+	jit->blocks	= 0;
+}
+
+/**
+ * Drops compiled blocks covering any address in [start, end)
+ */
+
+void jit_invalidate(vm_t *vm, int start, int end)
+{
+	jit_t *jit = vm->jit;
+	jit_block_t *block;
+	int i, j;
+
+	for (i = 0; i < jit->blocks; i++) {
+		block = &jit->block[i];
+		if (end <= block->start || start >= block->end) {
+			continue;
+		}
+
+		for (j = block->start; j < block->end; j++) {
+			jit->covered[j]--;
+		}
+		jit->entries[block->start]	= NULL;
+		jit->counters[block->start]	= 0;
+
+		/* Keep table dense, code memory is reclaimed on flush */
+		jit->block[i--] = jit->block[--jit->blocks];
+	}
+}
+
+/**
+ * x86-64 code emitter
+ *   - VM register n lives in host register r8d + n
+ *   - rbx holds jit_ctx_t pointer, eax/ecx/edx/esi/edi are scratch
+ */
+
+#define X_EAX	0
+#define X_ECX	1
+#define X_EDX	2
+#define X_EBX	3
+#define X_ESI	6
+#define X_EDI	7
+#define X_VM(n)	(8 + (n))
+
+/* ALU opcodes - r/m32, r32 form and /digit of imm32 form */
+#define X_ADD	0x01, 0
+#define X_OR	0x09, 1
+#define X_AND	0x21, 4
+#define X_XOR	0x31, 6
+#define X_CMP	0x39, 7
+
+static void x_byte(jit_t *jit, unsigned char byte)
+{
+	jit->code[jit->used++] = byte;
+}
+
+static void x_imm32(jit_t *jit, unsigned int imm)
+{
+	memcpy(&jit->code[jit->used], &imm, 4);
+	jit->used += 4;
+}
+
+static void x_imm64(jit_t *jit, unsigned long long imm)
+{
+	memcpy(&jit->code[jit->used], &imm, 8);
+	jit->used += 8;
+}
+
+/* REX prefix for reg field r and r/m field b, omitted when not needed */
+static void x_rex(jit_t *jit, int w, int r, int b)
+{
+	if (w || r >= 8 || b >= 8) {
+		x_byte(jit, 0x40 | (w << 3) | ((r >> 3) << 2) | (b >> 3));
+	}
+}
+
+static void x_modrm_rr(jit_t *jit, int r, int b)
+{
+	x_byte(jit, 0xc0 | ((r & 7) << 3) | (b & 7));
+}
+
+/* ModRM of [b + disp32] for low register b other than rsp */
+static void x_modrm_disp(jit_t *jit, int r, int b, int disp)
+{
+	x_byte(jit, 0x80 | ((r & 7) << 3) | (b & 7));
+	x_imm32(jit, disp);
+}
+
+/* op r/m32, r32 */
+static void x_op_rr(jit_t *jit, unsigned char op, int ext, int dst, int src)
+{
+	x_rex(jit, 0, src, dst);
+	x_byte(jit, op);
+	x_modrm_rr(jit, src, dst);
+}
+
+/* op r/m32, imm32 */
+static void x_op_ri(jit_t *jit, unsigned char op, int ext, int dst, unsigned int imm)
+{
+	x_rex(jit, 0, 0, dst);
+	x_byte(jit, 0x81);
+	x_modrm_rr(jit, ext, dst);
+	x_imm32(jit, imm);
+}
+
+static void x_mov_rr(jit_t *jit, int dst, int src)
+{
+	if (dst != src) {
+		x_op_rr(jit, 0x89, 0, dst, src);
+	}
+}
+
+static void x_mov_ri(jit_t *jit, int dst, unsigned int imm)
+{
+	x_rex(jit, 0, 0, dst);
+	x_byte(jit, 0xb8 + (dst & 7));
+	x_imm32(jit, imm);
+}
+
+/* Loads decoded operand n into host register */
+static void x_load(jit_t *jit, int dst, const decode_t *d, int n)
+{
+	if (d->regs & (1 << n)) {
+		x_mov_rr(jit, dst, X_VM(d->operand[n]));
+	} else {
+		x_mov_ri(jit, dst, d->operand[n]);
+	}
+}
+
+/* Applies ALU operation with decoded operand n as source */
+static void x_alu(jit_t *jit, unsigned char op, int ext, int dst, const decode_t *d, int n)
+{
+	if (d->regs & (1 << n)) {
+		x_op_rr(jit, op, ext, dst, X_VM(d->operand[n]));
+	} else {
+		x_op_ri(jit, op, ext, dst, d->operand[n]);
+	}
+}
+
+/* mov r64, [rbx + disp8] */
+static void x_load_ctx(jit_t *jit, int dst, int disp)
+{
+	x_rex(jit, 1, dst, X_EBX);
+	x_byte(jit, 0x8b);
+	x_byte(jit, 0x40 | ((dst & 7) << 3) | X_EBX);
+	x_byte(jit, disp);
+}
+
+/* call [rbx + disp8] with rdi = ctx */
+static void x_call_helper(jit_t *jit, int helper)
+{
+	x_byte(jit, 0x48); x_byte(jit, 0x89); x_byte(jit, 0xdf);		/* mov rdi, rbx */
+	x_byte(jit, 0xff);
+	x_byte(jit, 0x40 | (2 << 3) | X_EBX);
+	x_byte(jit, offsetof(jit_ctx_t, helpers) + helper * sizeof(void *));
+}
+
+/* Loads (or stores) VM registers first..last from (to) registers in ctx */
+static void x_sync(jit_t *jit, int store, int first, int last)
+{
+	int n;
+
+	x_load_ctx(jit, X_ECX, offsetof(jit_ctx_t, registers));
+	for (n = first; n <= last; n++) {
+		if (store) {
+			/* mov [rcx + 2n], r16 */
+			x_byte(jit, 0x66);
+			x_rex(jit, 0, X_VM(n), X_ECX);
+			x_byte(jit, 0x89);
+		} else {
+			/* movzx r32, word [rcx + 2n] */
+			x_rex(jit, 0, X_VM(n), X_ECX);
+			x_byte(jit, 0x0f);
+			x_byte(jit, 0xb7);
+		}
+		x_byte(jit, 0x40 | ((X_VM(n) & 7) << 3) | X_ECX);
+		x_byte(jit, n * 2);
+	}
+}
+
+/* Calls helper, caller saved r8d..r11d are spilled unless all are synced */
+static void x_helper(jit_t *jit, int helper, int full)
+{
+	x_sync(jit, 1, 0, full ? REGISTERS_SIZE - 1 : 3);
+	x_call_helper(jit, helper);
+	x_sync(jit, 0, 0, full ? REGISTERS_SIZE - 1 : 3);
+}
+
+static void x_prologue(jit_t *jit)
+{
+	x_byte(jit, 0x53);								/* push rbx */
+	x_byte(jit, 0x41); x_byte(jit, 0x54);					/* push r12 */
+	x_byte(jit, 0x41); x_byte(jit, 0x55);					/* push r13 */
+	x_byte(jit, 0x41); x_byte(jit, 0x56);					/* push r14 */
+	x_byte(jit, 0x41); x_byte(jit, 0x57);					/* push r15 */
+	x_byte(jit, 0x48); x_byte(jit, 0x89); x_byte(jit, 0xfb);	/* mov rbx, rdi */
+	x_sync(jit, 0, 0, REGISTERS_SIZE - 1);
+}
+
+/* Stores registers and returns next pc held in eax */
+static void x_epilogue(jit_t *jit)
+{
+	x_sync(jit, 1, 0, REGISTERS_SIZE - 1);
+	x_byte(jit, 0x41); x_byte(jit, 0x5f);					/* pop r15 */
+	x_byte(jit, 0x41); x_byte(jit, 0x5e);					/* pop r14 */
+	x_byte(jit, 0x41); x_byte(jit, 0x5d);					/* pop r13 */
+	x_byte(jit, 0x41); x_byte(jit, 0x5c);					/* pop r12 */
+	x_byte(jit, 0x5b);								/* pop rbx */
+	x_byte(jit, 0xc3);								/* ret */
+}
+
+/* Emits short jcc with zero displacement, returns offset to patch */
+static int x_jcc_short(jit_t *jit, unsigned char cc)
+{
+	x_byte(jit, cc);
+	x_byte(jit, 0);
+	return jit->used - 1;
+}
+
+/* Points short jump at current offset */
+static void x_patch(jit_t *jit, int at)
+{
+	jit->code[at] = jit->used - (at + 1);
+}
+
+/* Emits near jcc (cc 0 is jmp) with zero displacement, returns offset to patch */
+static int x_jcc_near(jit_t *jit, unsigned char cc)
+{
+	if (cc) {
+		x_byte(jit, 0x0f);
+		x_byte(jit, cc);
+	} else {
+		x_byte(jit, 0xe9);
+	}
+	x_imm32(jit, 0);
+	return jit->used - 4;
+}
+
+/* Points near jump at current offset */
+static void x_patch_near(jit_t *jit, int at)
+{
+	int rel = jit->used - (at + 4);
+
+	memcpy(&jit->code[at], &rel, 4);
+}
+
+/* Takes one from loop counter in ctx, jumps to returned offset when none is left */
+static int x_count(jit_t *jit)
+{
+	x_byte(jit, 0x48); x_byte(jit, 0x83);						/* cmp qword [rbx + loops], 0 */
+	x_byte(jit, 0x40 | (7 << 3) | X_EBX);
+	x_byte(jit, offsetof(jit_ctx_t, loops));
+	x_byte(jit, 0);
+	x_byte(jit, 0x74); x_byte(jit, 0);							/* je rel8 */
+	x_byte(jit, 0x48); x_byte(jit, 0xff);						/* dec qword [rbx + loops] */
+	x_byte(jit, 0x40 | (1 << 3) | X_EBX);
+	x_byte(jit, offsetof(jit_ctx_t, loops));
+	return jit->used - 5;
+}
+
+/**
+ * Loops back to block body at given code offset
+ *
+ * Taken when branch condition holds (cc 0 is always) and loop counter
+ * in ctx is left, otherwise eax is set to address at which block exits.
+ */
+
+static void x_jump_back(jit_t *jit, unsigned char cc, int target, int next, int start)
+{
+	int skip = -1, empty;
+
+	x_mov_ri(jit, X_EAX, next);
+	if (cc) {
+		skip = x_jcc_short(jit, (cc - 0x10) ^ 0x01);			/* inverted cc */
+	}
+
+	x_mov_ri(jit, X_EAX, start);
+	empty = x_count(jit);
+	x_byte(jit, 0xe9);											/* jmp rel32 */
+	x_imm32(jit, target - (jit->used + 4));
+
+	x_patch(jit, empty);
+	if (skip >= 0) {
+		x_patch(jit, skip);
+	}
+}
+
+/**
+ * Exits block with next pc in eax
+ *
+ * Compiled block of that pc is entered past its prologue while loop
+ * counter lasts, registers stay in host registers. Otherwise pc is
+ * returned to exec_jit().
+ */
+
+static void x_exit(jit_t *jit, int prologue)
+{
+	int range, missing, empty;
+
+	/* Register, ret or rmem target may lie past table, exec_jit() fails it */
+	x_op_ri(jit, X_CMP, X_EAX, ARCH_MODULO);
+	range = x_jcc_short(jit, 0x73);								/* jae */
+	x_load_ctx(jit, X_ECX, offsetof(jit_ctx_t, entries));
+	x_byte(jit, 0x48); x_byte(jit, 0x8b);						/* mov rcx, [rcx + rax * 8] */
+	x_byte(jit, 0x0c); x_byte(jit, 0xc1);
+	x_byte(jit, 0x48); x_byte(jit, 0x85); x_byte(jit, 0xc9);	/* test rcx, rcx */
+	missing = x_jcc_short(jit, 0x74);							/* jz */
+	empty = x_count(jit);
+	x_byte(jit, 0x48); x_byte(jit, 0x81); x_byte(jit, 0xc1);	/* add rcx, imm32 */
+	x_imm32(jit, prologue);
+	x_byte(jit, 0xff); x_byte(jit, 0xe1);						/* jmp rcx */
+
+	x_patch(jit, range);
+	x_patch(jit, missing);
+	x_patch(jit, empty);
+	x_epilogue(jit);
+}
+
+/* Sets rax to HASH_KEY(eax), clobbers rdx */
+static void x_hash_key(jit_t *jit)
+{
+	x_byte(jit, 0x48); x_byte(jit, 0xff); x_byte(jit, 0xc0);	/* inc rax */
+	x_byte(jit, 0x48); x_byte(jit, 0xba);						/* mov rdx, imm64 */
+	x_imm64(jit, HASH_STEP);
+	x_byte(jit, 0x48); x_byte(jit, 0x0f); x_byte(jit, 0xaf);	/* imul rax, rdx */
+	x_byte(jit, 0xc2);
+	x_byte(jit, 0x48); x_byte(jit, 0x89); x_byte(jit, 0xc2);	/* mov rdx, rax */
+	x_byte(jit, 0x48); x_byte(jit, 0xc1); x_byte(jit, 0xea);	/* shr rdx, 31 */
+	x_byte(jit, 31);
+	x_byte(jit, 0x48); x_byte(jit, 0x31); x_byte(jit, 0xd0);	/* xor rax, rdx */
+	x_byte(jit, 0x48); x_byte(jit, 0xba);						/* mov rdx, imm64 */
+	x_imm64(jit, HASH_MULT);
+	x_byte(jit, 0x48); x_byte(jit, 0x0f); x_byte(jit, 0xaf);	/* imul rax, rdx */
+	x_byte(jit, 0xc2);
+	x_byte(jit, 0x48); x_byte(jit, 0x83); x_byte(jit, 0xc8);	/* or rax, 1 */
+	x_byte(jit, 1);
+}
+
+/* Points rdx + rdi * 2 at stack word eax, rcx holds vm */
+static void x_stack_slot(jit_t *jit)
+{
+	x_byte(jit, 0x48); x_byte(jit, 0x8b);						/* mov rdx, [rcx + segment] */
+	x_modrm_disp(jit, X_EDX, X_ECX, offsetof(vm_t, stack.segment));
+	x_mov_rr(jit, X_EDI, X_EAX);
+	x_byte(jit, 0xc1); x_byte(jit, 0xef);						/* shr edi, shift */
+	x_byte(jit, STACK_SEGMENT_SHIFT);
+	x_byte(jit, 0x48); x_byte(jit, 0x8b);						/* mov rdx, [rdx + rdi * 8] */
+	x_byte(jit, 0x14); x_byte(jit, 0xfa);
+	x_mov_rr(jit, X_EDI, X_EAX);
+	x_op_ri(jit, X_AND, X_EDI, STACK_SEGMENT_MASK);
+}
+
+/**
+ * Pushes esi to VM stack
+ *
+ * Done inline like stack_push() while new top lies in allocated segment
+ * with own dirty bit, jit_push() grows stack otherwise.
+ */
+
+static void x_push(jit_t *jit)
+{
+	int full, deep, done;
+
+	x_load_ctx(jit, X_ECX, offsetof(jit_ctx_t, vm));
+	x_byte(jit, 0x8b);											/* mov eax, [rcx + position] */
+	x_modrm_disp(jit, X_EAX, X_ECX, offsetof(vm_t, stack.position));
+	x_byte(jit, 0xff); x_byte(jit, 0xc0);						/* inc eax */
+	x_byte(jit, 0x3b);											/* cmp eax, [rcx + capacity] */
+	x_modrm_disp(jit, X_EAX, X_ECX, offsetof(vm_t, stack.capacity));
+	full = x_jcc_near(jit, 0x8d);								/* jge */
+	x_op_ri(jit, X_CMP, X_EAX, 63 << STACK_SEGMENT_SHIFT);
+	deep = x_jcc_near(jit, 0x83);								/* jae */
+
+	x_byte(jit, 0x89);											/* mov [rcx + position], eax */
+	x_modrm_disp(jit, X_EAX, X_ECX, offsetof(vm_t, stack.position));
+	x_stack_slot(jit);
+	x_byte(jit, 0x66); x_byte(jit, 0x89);						/* mov [rdx + rdi * 2], si */
+	x_byte(jit, 0x34); x_byte(jit, 0x7a);
+
+	x_mov_rr(jit, X_EDI, X_EAX);
+	x_byte(jit, 0xc1); x_byte(jit, 0xef);						/* shr edi, shift */
+	x_byte(jit, STACK_SEGMENT_SHIFT);
+	x_byte(jit, 0x48); x_byte(jit, 0x8b);						/* mov rdx, [rcx + dirty_stack] */
+	x_modrm_disp(jit, X_EDX, X_ECX, offsetof(vm_t, dirty_stack));
+	x_byte(jit, 0x48); x_byte(jit, 0x0f); x_byte(jit, 0xab);	/* bts rdx, rdi */
+	x_byte(jit, 0xfa);
+	x_byte(jit, 0x48); x_byte(jit, 0x89);						/* mov [rcx + dirty_stack], rdx */
+	x_modrm_disp(jit, X_EDX, X_ECX, offsetof(vm_t, dirty_stack));
+
+	x_hash_key(jit);
+	x_byte(jit, 0x48); x_byte(jit, 0x0f); x_byte(jit, 0xaf);	/* imul rax, rsi */
+	x_byte(jit, 0xc6);
+	x_byte(jit, 0x48); x_byte(jit, 0x01);						/* add [rcx + hash_stack], rax */
+	x_modrm_disp(jit, X_EAX, X_ECX, offsetof(vm_t, hash_stack));
+	done = x_jcc_near(jit, 0);
+
+	x_patch_near(jit, full);
+	x_patch_near(jit, deep);
+	x_helper(jit, JIT_HELPER_PUSH, 0);
+	x_patch_near(jit, done);
+}
+
+/**
+ * Pops VM stack into eax
+ *
+ * Done inline like stack_pop() unless top is first word of its segment,
+ * jit_pop() fails empty stack and releases segments.
+ */
+
+static void x_pop(jit_t *jit)
+{
+	int first, empty, done;
+
+	x_load_ctx(jit, X_ECX, offsetof(jit_ctx_t, vm));
+	x_byte(jit, 0x8b);											/* mov eax, [rcx + position] */
+	x_modrm_disp(jit, X_EAX, X_ECX, offsetof(vm_t, stack.position));
+	x_byte(jit, 0xa9);											/* test eax, mask */
+	x_imm32(jit, STACK_SEGMENT_MASK);
+	first = x_jcc_near(jit, 0x84);								/* jz */
+	x_op_rr(jit, 0x85, 0, X_EAX, X_EAX);						/* test eax, eax */
+	empty = x_jcc_near(jit, 0x88);								/* js */
+
+	x_byte(jit, 0x8d); x_byte(jit, 0x50); x_byte(jit, 0xff);	/* lea edx, [rax - 1] */
+	x_byte(jit, 0x89);											/* mov [rcx + position], edx */
+	x_modrm_disp(jit, X_EDX, X_ECX, offsetof(vm_t, stack.position));
+	x_stack_slot(jit);
+	x_byte(jit, 0x0f); x_byte(jit, 0xb7);						/* movzx esi, word [rdx + rdi * 2] */
+	x_byte(jit, 0x34); x_byte(jit, 0x7a);
+
+	x_hash_key(jit);
+	x_byte(jit, 0x48); x_byte(jit, 0x0f); x_byte(jit, 0xaf);	/* imul rax, rsi */
+	x_byte(jit, 0xc6);
+	x_byte(jit, 0x48); x_byte(jit, 0x29);						/* sub [rcx + hash_stack], rax */
+	x_modrm_disp(jit, X_EAX, X_ECX, offsetof(vm_t, hash_stack));
+	x_mov_rr(jit, X_EAX, X_ESI);
+	done = x_jcc_near(jit, 0);
+
+	x_patch_near(jit, first);
+	x_patch_near(jit, empty);
+	x_helper(jit, JIT_HELPER_POP, 0);
+	x_patch_near(jit, done);
+}
+
+/**
+ * Writes edx to memory at esi, exits block at next when code may change
+ *
+ * Done inline like mem_write() unless address is covered by compiled
+ * block or decoded cache is active, jit_wmem() invalidates those.
+ */
+
+static void x_wmem(jit_t *jit, int next, int prologue)
+{
+	int decoded, covered, off, done;
+
+	x_load_ctx(jit, X_ECX, offsetof(jit_ctx_t, vm));
+	x_byte(jit, 0x48); x_byte(jit, 0x8b);						/* mov rdi, [rcx + decoded] */
+	x_modrm_disp(jit, X_EDI, X_ECX, offsetof(vm_t, decoded));
+	x_byte(jit, 0x48); x_byte(jit, 0x85); x_byte(jit, 0xff);	/* test rdi, rdi */
+	off = x_jcc_short(jit, 0x74);								/* jz */
+	x_byte(jit, 0x83); x_byte(jit, 0x3f); x_byte(jit, 0x00);	/* cmp dword [rdi + active], 0 */
+	decoded = x_jcc_near(jit, 0x85);							/* jnz */
+	x_patch(jit, off);
+
+	x_mov_rr(jit, X_EAX, X_ESI);
+	x_op_ri(jit, X_AND, X_EAX, STORAGE_MEM_HIGH);
+	x_byte(jit, 0x80);											/* cmp byte [rbx + rax + covered], 0 */
+	x_byte(jit, 0xbc); x_byte(jit, 0x03);
+	x_imm32(jit, offsetof(jit_t, covered) - offsetof(jit_t, ctx));
+	x_byte(jit, 0x00);
+	covered = x_jcc_near(jit, 0x85);							/* jnz */
+
+	x_mov_rr(jit, X_ESI, X_EAX);
+	x_load_ctx(jit, X_EDI, offsetof(jit_ctx_t, memory));
+	x_byte(jit, 0x0f); x_byte(jit, 0xb7);						/* movzx eax, word [rdi + rsi * 2] */
+	x_byte(jit, 0x04); x_byte(jit, 0x77);
+	x_byte(jit, 0x66); x_byte(jit, 0x89);						/* mov [rdi + rsi * 2], dx */
+	x_byte(jit, 0x14); x_byte(jit, 0x77);
+	x_byte(jit, 0x48); x_byte(jit, 0x29); x_byte(jit, 0xc2);	/* sub rdx, rax */
+	x_byte(jit, 0x48); x_byte(jit, 0x89); x_byte(jit, 0xd7);	/* mov rdi, rdx */
+
+	x_mov_rr(jit, X_EAX, X_ESI);
+	x_hash_key(jit);
+	x_byte(jit, 0x48); x_byte(jit, 0x0f); x_byte(jit, 0xaf);	/* imul rax, rdi */
+	x_byte(jit, 0xc7);
+	x_byte(jit, 0x48); x_byte(jit, 0x01);						/* add [rcx + hash_memory], rax */
+	x_modrm_disp(jit, X_EAX, X_ECX, offsetof(vm_t, hash_memory));
+	x_byte(jit, 0xff);											/* inc dword [rcx + effects] */
+	x_modrm_disp(jit, 0, X_ECX, offsetof(vm_t, accel.effects));
+
+	x_byte(jit, 0xc1); x_byte(jit, 0xee);						/* shr esi, page shift */
+	x_byte(jit, SNAPSHOT_PAGE_SHIFT);
+	x_byte(jit, 0x48); x_byte(jit, 0x8b);						/* mov rdx, [rcx + dirty_memory] */
+	x_modrm_disp(jit, X_EDX, X_ECX, offsetof(vm_t, dirty_memory));
+	x_byte(jit, 0x48); x_byte(jit, 0x0f); x_byte(jit, 0xab);	/* bts rdx, rsi */
+	x_byte(jit, 0xf2);
+	x_byte(jit, 0x48); x_byte(jit, 0x89);						/* mov [rcx + dirty_memory], rdx */
+	x_modrm_disp(jit, X_EDX, X_ECX, offsetof(vm_t, dirty_memory));
+	done = x_jcc_near(jit, 0);
+
+	x_patch_near(jit, decoded);
+	x_patch_near(jit, covered);
+	x_helper(jit, JIT_HELPER_WMEM, 0);
+	x_mov_ri(jit, X_EAX, next);
+	x_exit(jit, prologue);
+	x_patch_near(jit, done);
+}
+
+/**
+ * Returns true if instruction can be compiled into block
+ */
+
+static int jit_supported(const decode_t *d)
+{
+	switch (d->handler) {
+		case 1 : case 2 : case 3 : case 4 : case 5 : case 6 : case 7 :
+		case 8 : case 9 : case 10 : case 12 : case 13 : case 14 :
+		case 15 : case 16 : case 17 : case 18 : case 21 :
+			return 1;
+		/* Literal zero divisor faults in interpreter */
+		case 11 :
+			return (d->regs & 4) || d->operand[2];
+		default :
+			/* Halt, I/O and faults are left for interpreter */
+			return 0;
+	}
+}
+
+/**
+ * Returns true if instruction ends basic block
+ */
+
+static int jit_terminator(const decode_t *d)
+{
+	switch (d->handler) {
+		case 6 : case 7 : case 8 : case 17 : case 18 :
+			return 1;
+		default :
+			return 0;
+	}
+}
+
+/**
+ * Compiles basic block starting at given address
+ */
+
+int jit_compile(vm_t *vm, unsigned short start)
+{
+	jit_t *jit = vm->jit;
+	decode_t insn, *d = &insn;
+	unsigned short pc = start;
+	int entry, body, count, a, skip, done;
+	int terminated = 0;
+	cfg_range_t range[REGISTERS_SIZE];
+
+	/* Nothing is known on entry, so loops back to body start agree */
+	for (a = 0; a < REGISTERS_SIZE; a++) {
+		range[a].lo = 0;
+		range[a].hi = VALUE_MAX_WORD;
+	}
+
+	/* Make room for longest possible block */
+	if (jit->used + JIT_BLOCK_BYTES > JIT_CODE_SIZE || jit->blocks == JIT_MAX_BLOCKS) {
+		jit_flush(vm);
+	}
+
+	decode_fill(vm, d, pc);
+	if (!jit_supported(d)) {
+		return -1;
+	}
+
+	entry = jit->used;
+	x_prologue(jit);
+	body  = jit->used;
+
+	for (count = 0; count < JIT_MAX_INSNS; count++) {
+
+		decode_fill(vm, d, pc);
+		if (!jit_supported(d) || pc + d->length > vm->binary.length) {
+			break;
+		}
+		a = X_VM(d->operand[0]);
+
+		switch (d->handler) {
+			/* Set */
+			case 1 :
+				x_load(jit, a, d, 1);
+				break;
+			/* Push */
+			case 2 :
+				x_load(jit, X_ESI, d, 0);
+				x_push(jit);
+				break;
+			/* Pop */
+			case 3 :
+				x_pop(jit);
+				x_mov_rr(jit, a, X_EAX);
+				break;
+			/* Eq, Gt */
+			case 4 :
+			case 5 :
+				x_load(jit, X_EAX, d, 1);
+				x_alu(jit, X_CMP, X_EAX, d, 2);
+				x_byte(jit, 0x0f);
+				x_byte(jit, d->handler == 4 ? 0x94 : 0x97);		/* sete / seta al */
+				x_byte(jit, 0xc0);
+				x_rex(jit, 0, a, X_EAX);
+				x_byte(jit, 0x0f); x_byte(jit, 0xb6);					/* movzx a, al */
+				x_modrm_rr(jit, a, X_EAX);
+				break;
+			/* Jmp */
+			case 6 :
+				if (!(d->regs & 1) && d->operand[0] == start) {
+					x_jump_back(jit, 0, body, start, start);
+				} else {
+					x_load(jit, X_EAX, d, 0);
+				}
+				break;
+			/* Jt, Jf */
+			case 7 :
+			case 8 :
+				x_load(jit, X_EDX, d, 0);
+				x_op_rr(jit, 0x85, 0, X_EDX, X_EDX);				/* test edx, edx */
+				if (!(d->regs & 2) && d->operand[1] == start) {
+					x_jump_back(jit, d->handler == 7 ? 0x85 : 0x84, body, pc + 3, start);
+				} else {
+					x_mov_ri(jit, X_EAX, pc + 3);
+					x_load(jit, X_ECX, d, 1);
+					x_byte(jit, 0x0f);
+					x_byte(jit, d->handler == 7 ? 0x45 : 0x44);	/* cmovnz / cmovz eax, ecx */
+					x_modrm_rr(jit, X_EAX, X_ECX);
+				}
+				break;
+			/* Add, And, Or */
+			case 9 :
+			case 12 :
+			case 13 :
+				x_load(jit, X_EAX, d, 1);
+				if (d->handler == 9) {
+					x_alu(jit, X_ADD, X_EAX, d, 2);
+					if (cfg_range_wraps(range, d)) {
+						x_op_ri(jit, X_AND, X_EAX, 0x7fff);
+					}
+				} else if (d->handler == 12) {
+					x_alu(jit, X_AND, X_EAX, d, 2);
+				} else {
+					x_alu(jit, X_OR, X_EAX, d, 2);
+				}
+				x_mov_rr(jit, a, X_EAX);
+				break;
+			/* Mult */
+			case 10 :
+				x_load(jit, X_EAX, d, 1);
+				x_load(jit, X_ECX, d, 2);
+				x_byte(jit, 0x0f); x_byte(jit, 0xaf);					/* imul eax, ecx */
+				x_modrm_rr(jit, X_EAX, X_ECX);
+				if (cfg_range_wraps(range, d)) {
+					x_op_ri(jit, X_AND, X_EAX, 0x7fff);
+				}
+				x_mov_rr(jit, a, X_EAX);
+				break;
+			/* Mod */
+			case 11 :
+				x_load(jit, X_EAX, d, 1);
+				x_load(jit, X_ECX, d, 2);
+				if (d->regs & 4) {
+					x_op_rr(jit, 0x85, 0, X_ECX, X_ECX);			/* test ecx, ecx */
+					skip = x_jcc_short(jit, 0x75);					/* jnz */
+					x_mov_ri(jit, X_ESI, pc);
+					x_sync(jit, 1, 0, REGISTERS_SIZE - 1);
+					x_call_helper(jit, JIT_HELPER_FAULT);
+					x_patch(jit, skip);
+				}
+				x_op_rr(jit, X_XOR, X_EDX, X_EDX);
+				x_byte(jit, 0xf7);								/* div ecx */
+				x_modrm_rr(jit, 6, X_ECX);
+				x_mov_rr(jit, a, X_EDX);
+				break;
+			/* Not */
+			case 14 :
+				x_load(jit, X_EAX, d, 1);
+				x_byte(jit, 0xf7);								/* not eax */
+				x_modrm_rr(jit, 2, X_EAX);
+				x_op_ri(jit, X_AND, X_EAX, 0x7fff);
+				x_mov_rr(jit, a, X_EAX);
+				break;
+			/* Rmem */
+			case 15 :
+				x_load(jit, X_EAX, d, 1);
+				x_op_ri(jit, X_AND, X_EAX, STORAGE_MEM_HIGH);
+				x_load_ctx(jit, X_ECX, offsetof(jit_ctx_t, memory));
+				x_rex(jit, 0, a, 0);
+				x_byte(jit, 0x0f); x_byte(jit, 0xb7);					/* movzx a, word [rcx + rax*2] */
+				x_byte(jit, ((a & 7) << 3) | 0x04);
+				x_byte(jit, 0x41);
+				break;
+			/* Wmem - ends block only when it may invalidate code */
+			case 16 :
+				x_load(jit, X_ESI, d, 0);
+				x_load(jit, X_EDX, d, 1);
+				x_wmem(jit, pc + 3, body - entry);
+				break;
+			/* Call - literal target that is not declared skips helper */
+			case 17 :
+				skip = -1;
+				if (!(d->regs & 1)) {
+					x_load_ctx(jit, X_ECX, offsetof(jit_ctx_t, accel));
+					x_byte(jit, 0x80);								/* cmp byte [rcx + target], 0 */
+					x_modrm_disp(jit, 7, X_ECX, d->operand[0]);
+					x_byte(jit, 0x00);
+					done = x_jcc_near(jit, 0x85);					/* jnz */
+					x_mov_ri(jit, X_ESI, pc + 2);
+					x_push(jit);
+					x_mov_ri(jit, X_EAX, d->operand[0]);
+					skip = x_jcc_near(jit, 0);
+					x_patch_near(jit, done);
+				}
+				x_load(jit, X_ESI, d, 0);
+				x_mov_ri(jit, X_EDX, pc + 2);
+				x_helper(jit, JIT_HELPER_CALL, 1);
+				if (skip >= 0) {
+					x_patch_near(jit, skip);
+				}
+				break;
+			/* Ret - pops without helper unless recorded call may complete */
+			case 18 :
+				x_load_ctx(jit, X_ECX, offsetof(jit_ctx_t, vm));
+				x_byte(jit, 0x83);									/* cmp dword [rcx + depth], 0 */
+				x_modrm_disp(jit, 7, X_ECX, offsetof(vm_t, accel.depth));
+				x_byte(jit, 0x00);
+				done = x_jcc_near(jit, 0x85);						/* jnz */
+				x_pop(jit);
+				skip = x_jcc_near(jit, 0);
+				x_patch_near(jit, done);
+				x_helper(jit, JIT_HELPER_RET, 1);
+				x_patch_near(jit, skip);
+				break;
+			/* No op */
+			case 21 :
+				break;
+		}
+		cfg_range(range, d);
+
+		pc += d->length;
+		if (jit_terminator(d)) {
+			terminated = 1;
+			break;
+		}
+	}
+
+	/* Fell out of block - continue at next instruction */
+	if (!terminated) {
+		x_mov_ri(jit, X_EAX, pc);
+	}
+	x_exit(jit, body - entry);
+
+	/* Register block */
+	jit->block[jit->blocks].start	= start;
+	jit->block[jit->blocks].end	= pc;
+	jit->block[jit->blocks].entry	= entry;
+	jit->blocks++;
+
+	for (a = start; a < pc; a++) {
+		jit->covered[a]++;
+	}
+	jit->entries[start] = (jit_block_fn) (jit->code + entry);
+
+	if (perf_map_file) {
+		perf_map(jit->code + entry, jit->used - entry, start, pc);
+	}
+	return 0;
+}
+
+#else
+
+int jit_init(vm_t *vm)
+{
+	/* No code generator for this host */
+	return -1;
+}
+
+void jit_invalidate(vm_t *vm, int start, int end)
+{
+}
+
+int jit_compile(vm_t *vm, unsigned short start)
+{
+	return -1;
+}
+
+#endif
+
+/**
+ * Executes given operation
+ *
+ * Returns 0 to continue, 1 when halted and 2 when execution should
+ * stop and later resume at *pc.
+ */
+
+int operation_exec(vm_t *vm, unsigned short opcode, unsigned short a, unsigned short b, unsigned short c, int *pc)
+{	
+	int halt = 0;		/* Halt execution */
+	int value;
+
+	switch (opcode) {
+		/* Halt */
+		case 0 	:
+			halt = 1;
+			*pc += 1;
+			break;
+		/* Set */
+		case 1 	:
+			reg_write(vm, a, reg_read(vm, b));
+			*pc += 3;
+			break;
+		/* Push */
+		case 2 	:
+			stack_push(vm, val_get(vm, a));
+			*pc += 2;		
+			break;
+		/* Pop */
+		case 3 	:
+			reg_write(vm, a, stack_pop(vm));
+			*pc += 2;
+			break;
+		/* Eq */
+		case 4 	:
+			reg_write(vm, a, val_get(vm, b) == val_get(vm, c) ? 1 : 0);
+			*pc += 4;
+			break;
+		/* Gt */
+		case 5 	:
+			reg_write(vm, a, val_get(vm, b) > val_get(vm, c) ? 1 : 0);
+			*pc += 4;
+			break;
+		/* Jmp */
+		case 6 	:
+			*pc = val_get(vm, a);
+			break;
+		/* Jt */
+		case 7 	:
+			*pc = (val_get(vm, a) != 0) ? val_get(vm, b) : *pc + 3;
+			break;
+		/* Jf */
+		case 8 	:
+			*pc = (val_get(vm, a) == 0) ? val_get(vm, b) : *pc + 3;
+			break;
+		/* Add */
+		case 9 	:
+			reg_write(vm, a, (val_get(vm, b) + val_get(vm, c)) % ARCH_MODULO);
+			*pc += 4;
+			break;
+		/* Mult */
+		case 10 :
+			reg_write(vm, a, (val_get(vm, b) * val_get(vm, c)) % ARCH_MODULO);
+			*pc += 4;
+			break;
+		/* Mod */
+		case 11 :
+			if (!val_get(vm, c)) {
+				vm_fail("Division by zero ... [pc: %d]", *pc);
+			}
+			reg_write(vm, a, val_get(vm, b) % val_get(vm, c));
+			*pc += 4;
+			break;		  
+		/* And */
+		case 12 :
+			reg_write(vm, a, val_get(vm, b) & val_get(vm, c));
+			*pc += 4;
+			break;	
+		/* Or */
+		case 13 :
+			reg_write(vm, a, val_get(vm, b) | val_get(vm, c));
+			*pc += 4;
+			break;
+		/* Not */
+		case 14 :
+			reg_write(vm, a, (~val_get(vm, b)) & 0x7fff);
+			*pc += 3;
+			break;
+		/* Rmem */
+		case 15 :
+			reg_write(vm, a, mem_read(vm, val_get(vm, b)));
+			*pc += 3;
+			break;
+		/* Wmem */
+		case 16 :
+			mem_write(vm, val_get(vm, a), val_get(vm, b));
+			*pc += 3;
+			break;
+		/* Call */
+		case 17 :
+			if (accel.map[val_get(vm, a)] && accel_call(vm, val_get(vm, a), *pc+2)) {
+				*pc += 2;		/* Call satisfied from memo table or native code */
+				break;
+			}
+			stack_push(vm, *pc+2);	/* Push address of next instruction to stack */
+			*pc = val_get(vm, a);	
+			break;
+		/* Ret */
+		case 18 :
+			*pc = stack_pop(vm);  /* Pop address of next instruction from stack */
+			if (ACCEL_RETURNING(vm)) {
+				accel_ret(vm, *pc);
+			}
+			break;
+		/* Out */
+		case 19 :
+			vm->accel.effects++;
+			vm->out(vm, val_get(vm, a));
+			*pc += 2;
+			if (vm->stop) {
+				halt = 2;
+			}
+			break;
+		/* In */
+		case 20 :
+			vm->accel.effects++;
+			vm->pc = *pc;
+			value = vm->in(vm);
+			if (value == IO_BLOCKED) {
+				halt = 2;		/* Resume at this instruction */
+				break;
+			}
+			reg_write(vm, a, value);
+			*pc += 2;
+			break;
+		/* No op */
+		case 21 :
+			*pc += 1;
+			break;
+		/* Error */
+		default :
+			vm_fail("Function %s() failed! [opcode:%d] [pc:%d]", __FUNCTION__, opcode, *pc);
+	}
+	
+	return halt;
+}
+
+/**
+ * Returns literal value or value stored in register
+ */
+
+unsigned short val_get(vm_t *vm, unsigned short input)
+{
+	if (input <= VALUE_MAX_LITERAL) {
+		return input;
+	}
+	if (input <= VALUE_MAX_REGISTER) {
+		return reg_read(vm, input);
+	}
+	
+	vm_fail("Function %s() failed!", __FUNCTION__);
+	return 0;
+}
+
+/**
+ * Initializes registers
+ */
+ 
+void reg_init(vm_t *vm)
+{
+	memset(&vm->registers, 0, sizeof(registers_t));
+}
+
+/**
+ * Writes value to register
+ */
+
+void reg_write(vm_t *vm, unsigned short address, unsigned short value)
+{
+	if (address < STORAGE_REG_LOW || address > STORAGE_REG_HIGH) {
+		vm_fail("Function %s() failed!", __FUNCTION__);
+	}
+	
+	vm->registers.contents[address-STORAGE_REG_LOW] = value;
+}
+
+/**
+ * Reads form register or returns literal value
+ */
+
+unsigned short reg_read(vm_t *vm, unsigned short address)
+{
+	if (address < STORAGE_REG_LOW) {
+		return address;
+	} else {
+		return vm->registers.contents[address-STORAGE_REG_LOW];
+	}
+}
+
+/**
+ * Initializes memory
+ */
+ 
+void mem_init(vm_t *vm)
+{
+	memset(vm->memory.contents, 0, MEMORY_MAP_SIZE);
+}
+
+/**
+ * Reads from memory, address is wrapped into 15-bit space
+ */
+ 
+unsigned short mem_read(vm_t *vm, unsigned short address)
+{
+	return vm->memory.contents[address & STORAGE_MEM_HIGH];
+}
+
+/**
+ * Writes to memory
+ */
+
+void mem_write(vm_t *vm, unsigned short address, unsigned short value)
+{
+	address &= STORAGE_MEM_HIGH;
+	vm->hash_memory += ((unsigned long long) value - vm->memory.contents[address]) * HASH_KEY(address);
+	vm->memory.contents[address] = value;
+	vm->accel.effects++;
+
+	vm->dirty_memory |= SNAPSHOT_PAGE_BIT(address);
+
+	if (vm->decoded && vm->decoded->active) {
+		decode_invalidate(vm, address, address + 1);
+	}
+	if (vm->jit && vm->jit->active && vm->jit->covered[address]) {
+		jit_invalidate(vm, address, address + 1);
+	}
+}
+
+/**
+ * Initializes stack
+ */
+ 
+void stack_init(vm_t *vm)
+{
+	vm->stack.position = -1;
+}
+
+/**
+ * Pops element from stack
+ */
+
+unsigned short stack_pop(vm_t *vm)
+{
+	unsigned short value;
+
+	if (stack_is_empty(vm)) {
+		vm_fail("Function stack_pop(vm) failed!");
+	}
+	
+	value = STACK_AT(&vm->stack, vm->stack.position);
+	vm->hash_stack -= value * HASH_KEY(vm->stack.position);
+
+	/* Left segment, release segments beyond spare one, their words are gone for snapshots */
+	if ((vm->stack.position-- & STACK_SEGMENT_MASK) == 0 &&
+		vm->stack.segments > (vm->stack.position >> STACK_SEGMENT_SHIFT) + 3) {
+		stack_trim(&vm->stack);
+		vm->dirty_stack |= ~(SNAPSHOT_STACK_BIT(vm->stack.position + 1) - 1);
+	}
+
+	return value;
+}
+ 
+/**
+ * Pushes element to stack
+ */
+ 
+void stack_push(vm_t *vm, unsigned short element) 
+{
+	int position = vm->stack.position + 1;
+
+	if (position >= vm->stack.capacity) {
+		if (stack_is_full(vm)) {
+			vm_fail("Function %s() failed!", __FUNCTION__);	
+		}
+		stack_reserve(&vm->stack, position + 1);
+	}
+
+	STACK_AT(&vm->stack, position) = element;
+	vm->stack.position = position;
+	vm->dirty_stack |= SNAPSHOT_STACK_BIT(position);
+	vm->hash_stack += element * HASH_KEY(position);
+}
+
+/**
+ * Computes state hashes from scratch
+ */
+
+void hash_reset(vm_t *vm)
+{
+	int i;
+
+	vm->hash_memory	= 0;
+	vm->hash_stack	= 0;
+	for (i = 0; i < MEMORY_SIZE; i++) {
+		vm->hash_memory += vm->memory.contents[i] * HASH_KEY(i);
+	}
+	for (i = 0; i <= vm->stack.position; i++) {
+		vm->hash_stack += STACK_AT(&vm->stack, i) * HASH_KEY(i);
+	}
+}
+
+/**
+ * Maps huge page backed region, size is multiple of HUGE_PAGE_SIZE
+ *
+ * Reserved huge pages are used when available, otherwise region is
+ * aligned and advised for transparent huge pages.
+ */
+
+void *huge_alloc(size_t size)
+{
+	char *region;
+	size_t skip;
+
+#ifdef MAP_HUGETLB
+	region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (region != MAP_FAILED) {
+		return region;
+	}
+#endif
+
+	/* Over-map and trim to huge page boundary */
+	region = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (region == MAP_FAILED) {
+		return NULL;
+	}
+	skip = (HUGE_PAGE_SIZE - ((size_t) region & (HUGE_PAGE_SIZE - 1))) & (HUGE_PAGE_SIZE - 1);
+	if (skip) {
+		munmap(region, skip);
+	}
+	munmap(region + skip + size, HUGE_PAGE_SIZE - skip);
+	region += skip;
+
+#ifdef MADV_HUGEPAGE
+	madvise(region, size, MADV_HUGEPAGE);
+#endif
+	return region;
+}
+
+/**
+ * Takes block of given size from arena, arena grows by slabs which
+ * are never freed - one huge page with -H, else few blocks
+ */
+
+void *arena_get(arena_t *arena, size_t size)
+{
+	void *block;
+	char *slab;
+	int i, blocks;
+
+	pthread_mutex_lock(&arena->lock);
+	if (!arena->free) {
+		if (huge_pages) {
+			blocks	= HUGE_PAGE_SIZE / size;
+			slab	= huge_alloc(HUGE_PAGE_SIZE);
+		} else {
+			blocks	= STACK_ARENA_SLAB;
+			slab	= NULL;
+			if (posix_memalign((void **) &slab, CACHE_LINE, blocks * size)) {
+				slab = NULL;
+			}
+		}
+		if (!slab) {
+			pthread_mutex_unlock(&arena->lock);
+			vm_fail("Function %s() failed!", __FUNCTION__);
+		}
+		for (i = 0; i < blocks; i++) {
+			*(void **) slab = arena->free;
+			arena->free = slab;
+			slab += size;
+		}
+		arena->allocated += blocks;
+	}
+	block = arena->free;
+	arena->free = *(void **) block;
+	pthread_mutex_unlock(&arena->lock);
+
+	return block;
+}
+
+/**
+ * Returns block to arena
+ */
+
+void arena_put(arena_t *arena, void *block)
+{
+	pthread_mutex_lock(&arena->lock);
+	*(void **) block = arena->free;
+	arena->free = block;
+	pthread_mutex_unlock(&arena->lock);
+}
+
+/**
+ * Allocates segments until stack holds given number of words
+ */
+
+void stack_reserve(stack_t *stack, int words)
+{
+	unsigned short **segment;
+	int slots;
+
+	if (words > STACK_LIMIT) {
+		vm_fail("Function %s() failed! [words:%d]", __FUNCTION__, words);
+	}
+
+	while (stack->capacity < words) {
+		if (stack->segments == stack->slots) {
+			slots	= stack->slots ? stack->slots * 2 : STACK_DIRECTORY;
+			segment	= realloc(stack->segment, slots * sizeof(*segment));
+			if (!segment) {
+				vm_fail("Function %s() failed!", __FUNCTION__);
+			}
+			stack->segment	= segment;
+			stack->slots	= slots;
+		}
+		stack->segment[stack->segments++] = arena_get(&stack_arena, STACK_SEGMENT_WORDS * sizeof(unsigned short));
+		stack->capacity += STACK_SEGMENT_WORDS;
+	}
+}
+
+/**
+ * Returns segments above top and one spare segment to arena
+ */
+
+void stack_trim(stack_t *stack)
+{
+	int keep = ((stack->position + 1 + STACK_SEGMENT_MASK) >> STACK_SEGMENT_SHIFT) + 1;
+
+	while (stack->segments > keep) {
+		arena_put(&stack_arena, stack->segment[--stack->segments]);
+		stack->capacity -= STACK_SEGMENT_WORDS;
+	}
+}
+
+/**
+ * Returns all segments to arena
+ */
+
+void stack_release(stack_t *stack)
+{
+	while (stack->segments) {
+		arena_put(&stack_arena, stack->segment[--stack->segments]);
+	}
+	free(stack->segment);
+
+	stack->segment	= NULL;
+	stack->slots	= 0;
+	stack->capacity	= 0;
+	stack->position	= -1;
+}
+
+/**
+ * Copies words of one stack into same positions of another
+ */
+
+void stack_copy(stack_t *dst, const stack_t *src, int start, int count)
+{
+	int words;
+
+	stack_reserve(dst, start + count);
+	while (count > 0) {
+		words = STACK_SEGMENT_WORDS - (start & STACK_SEGMENT_MASK);
+		if (words > count) {
+			words = count;
+		}
+		memcpy(&STACK_AT(dst, start), &STACK_AT(src, start), words * sizeof(unsigned short));
+		start += words;
+		count -= words;
+	}
+}
+	
+/**
+ * Returns true if stack is full
+ */
+ 
+int stack_is_full(vm_t *vm)
+{
+	return vm->stack.position >= (STACK_LIMIT - 1);
+}
+/**
+ * Returns true if stack is empty
+ */
+ 
+int stack_is_empty(vm_t *vm)
+{
+	return vm->stack.position < 0;
+}
+	
+/**
+ * Declares accelerated subroutine
+ *   - pure:   ADDR:INPUTS:OUTPUTS, registers given as digits (e.g. 6027:017:01)
+ *   - native: ADDR:NAME of function in accel_natives
+ */
+
+int accel_declare(const char *spec, int native)
+{
+	unsigned long address;
+	const char *field;
+	char *end;
+	int i, *mask;
+
+	address = strtoul(spec, &end, 0);
+	if (end == spec || *end != ':' || address > STORAGE_MEM_HIGH) {
+		return -1;
+	}
+	field = end + 1;
+
+	if (native) {
+		for (i = 0; accel_natives[i].name; i++) {
+			if (!strcmp(accel_natives[i].name, field)) {
+				return accel_add(address, 0, 0, accel_natives[i].fn);
+			}
+		}
+		return -1;
+	} else {
+		/* Parse input and output register lists */
+		int masks[2] = { 0, 0 };
+
+		for (mask = &masks[0]; *field; field++) {
+			if (*field == ':' && mask == &masks[0]) {
+				mask = &masks[1];
+			} else if (*field >= '0' && *field < '0' + REGISTERS_SIZE) {
+				*mask |= 1 << (*field - '0');
+			} else {
+				return -1;
+			}
+		}
+		if (mask != &masks[1] || !masks[1]) {
+			return -1;
+		}
+		return accel_add(address, masks[0], masks[1], NULL);
+	}
+}
+
+/**
+ * Adds accelerated subroutine, memoized over register masks unless
+ * native replacement is given
+ */
+
+int accel_add(unsigned short address, int inputs, int outputs, accel_native_fn native)
+{
+	accel_func_t *f;
+
+	if (accel.map[address] || accel.funcs == ACCEL_MAX_FUNCS) {
+		return -1;
+	}
+
+	f = &accel.func[accel.funcs];
+	memset(f, 0, sizeof(accel_func_t));
+	f->address	= address;
+	f->inputs	= inputs;
+	f->outputs	= outputs;
+	f->native	= native;
+
+	accel.map[address] = ++accel.funcs;
+	return 0;
+}
+
+/**
+ * Declares pure subroutines with loops or calls found by cfg_effects()
+ *
+ * Returns number of declared subroutines. Results are still recorded
+ * only for calls without effects, as for declared ones.
+ */
+
+int accel_auto(vm_t *vm)
+{
+	const cfg_func_t *f;
+	int i, count = 0;
+
+	for (i = 0; i < vm->cfg->funcs; i++) {
+		f = &vm->cfg->func[i];
+		if ((f->effects & CFG_FX_IMPURE) || !(f->effects & CFG_FX_LOOPS) || !f->writes) {
+			continue;
+		}
+		if (accel_add(f->entry, f->reads, f->writes, NULL) == 0) {
+			vm_info("Pure subroutine ... [address: %d] [inputs: %02x] [outputs: %02x]",
+				f->entry, f->reads, f->writes);
+			count++;
+		}
+	}
+
+	return count;
+}
+
+/**
+ * Handles call of accelerated subroutine
+ *
+ * Returns 1 when registers were updated from memo table or native code
+ * and the call should be skipped. Otherwise the call is recorded and
+ * result is stored once matching ret is executed.
+ */
+
+int accel_call(vm_t *vm, unsigned short target, unsigned short next)
+{
+	int func = accel.map[target] - 1;
+	accel_func_t *f = &accel.func[func];
+	unsigned short inputs[REGISTERS_SIZE];
+	accel_entry_t *entry;
+	accel_frame_t *frame;
+	int i;
+
+	if (f->native) {
+		if (!f->native(vm->registers.contents)) {
+			return 0;
+		}
+		vm->accel.hits++;
+		return 1;
+	}
+
+	for (i = 0; i < REGISTERS_SIZE; i++) {
+		inputs[i] = (f->inputs & (1 << i)) ? vm->registers.contents[i] : 0;
+	}
+
+	/* Memoized result */
+	entry = accel_lookup(vm, func, inputs, 0);
+	if (entry) {
+		for (i = 0; i < REGISTERS_SIZE; i++) {
+			if (f->outputs & (1 << i)) {
+				vm->registers.contents[i] = entry->outputs[i];
+			}
+		}
+		vm->accel.hits++;
+		return 1;
+	}
+
+	/* Grow frame stack */
+	if (vm->accel.depth == vm->accel.frames && vm->accel.frames < ACCEL_MAX_DEPTH) {
+		frame = realloc(vm->accel.frame,
+			(vm->accel.frames ? vm->accel.frames * 2 : ACCEL_FRAMES) * sizeof(accel_frame_t));
+		if (frame) {
+			vm->accel.frame		= frame;
+			vm->accel.frames	= vm->accel.frames ? vm->accel.frames * 2 : ACCEL_FRAMES;
+		}
+	}
+
+	/* Record call */
+	vm->accel.misses++;
+	if (vm->accel.depth < vm->accel.frames) {
+		frame = &vm->accel.frame[vm->accel.depth++];
+		frame->position	= vm->stack.position;
+		frame->next		= next;
+		frame->func		= func;
+		frame->effects	= vm->accel.effects;
+		memcpy(frame->inputs, inputs, sizeof(inputs));
+	}
+	return 0;
+}
+
+/**
+ * Completes recorded calls returning to given address
+ *
+ * Only calls which return with balanced stack (zero stack delta) and
+ * without wmem/in/out in between are stored in memo table.
+ */
+
+void accel_ret(vm_t *vm, unsigned short address)
+{
+	accel_frame_t *frame;
+	accel_entry_t *entry;
+	int i;
+
+	while (vm->accel.depth) {
+		frame = &vm->accel.frame[vm->accel.depth - 1];
+		if (vm->stack.position > frame->position) {
+			return;
+		}
+		vm->accel.depth--;
+
+		/* Frames left below stack position were abandoned */
+		if (vm->stack.position != frame->position || address != frame->next) {
+			continue;
+		}
+		if (frame->effects != vm->accel.effects) {
+			return;
+		}
+
+		entry = accel_lookup(vm, frame->func, frame->inputs, 1);
+		for (i = 0; i < REGISTERS_SIZE; i++) {
+			entry->outputs[i] = vm->registers.contents[i];
+		}
+		return;
+	}
+}
+
+/**
+ * Finds memo table entry, optionally inserting new one
+ */
+
+accel_entry_t *accel_lookup(vm_t *vm, int func, const unsigned short *inputs, int insert)
+{
+	accel_entry_t *old, *entry;
+	unsigned int hash, i, size;
+
+	/* Grow table at half load */
+	if (insert && vm->accel.count * 2 >= vm->accel.size) {
+		old		= vm->accel.table;
+		size	= vm->accel.size;
+
+		vm->accel.size	= size ? size * 2 : ACCEL_TABLE_SIZE;
+		vm->accel.table	= calloc(vm->accel.size, sizeof(accel_entry_t));
+		vm->accel.count	= 0;
+		if (!vm->accel.table) {
+			vm_fail("Function %s() failed!", __FUNCTION__);
+		}
+		for (i = 0; i < size; i++) {
+			if (old[i].used) {
+				entry = accel_lookup(vm, old[i].func, old[i].inputs, 1);
+				memcpy(entry->outputs, old[i].outputs, sizeof(entry->outputs));
+			}
+		}
+		free(old);
+	}
+	if (!vm->accel.size) {
+		return NULL;
+	}
+
+	/* FNV-1a over function and inputs */
+	hash = 2166136261u ^ func;
+	for (i = 0; i < REGISTERS_SIZE; i++) {
+		hash = (hash ^ inputs[i]) * 16777619u;
+	}
+
+	for (i = hash & (vm->accel.size - 1); ; i = (i + 1) & (vm->accel.size - 1)) {
+		entry = &vm->accel.table[i];
+		if (!entry->used) {
+			break;
+		}
+		if (entry->func == func && !memcmp(entry->inputs, inputs, sizeof(entry->inputs))) {
+			return entry;
+		}
+	}
+	if (!insert) {
+		return NULL;
+	}
+
+	entry->used = 1;
+	entry->func = func;
+	memcpy(entry->inputs, inputs, sizeof(entry->inputs));
+	vm->accel.count++;
+	return entry;
+}
+
+/* Creates key of per-thread row tables */
+static void accel_rows_init(void)
+{
+	pthread_key_create(&accel_rows_key, free);
+}
+
+/**
+ * Native replacement of teleporter confirmation routine
+ *
+ * Ackermann style function of r0 and r1 with r7 as parameter:
+ *   A(0, n) = n + 1
+ *   A(m, 0) = A(m - 1, r7)
+ *   A(m, n) = A(m - 1, A(m, n - 1))
+ * Result is returned in r0, r1 holds result - 1 as in the VM routine.
+ */
+
+int accel_ackermann(unsigned short *registers)
+{
+	unsigned short m = registers[0], n = registers[1], k = registers[7];
+	unsigned short *prev, *curr, *swap;
+	int i, j;
+
+	if (m > 4 || n > STORAGE_MEM_HIGH || k > STORAGE_MEM_HIGH) {
+		return 0;
+	}
+
+	/* Too large for small thread stacks, kept until thread exits */
+	pthread_once(&accel_rows_once, accel_rows_init);
+	prev = pthread_getspecific(accel_rows_key);
+	if (!prev) {
+		prev = malloc(2 * ARCH_MODULO * sizeof(unsigned short));
+		if (!prev || pthread_setspecific(accel_rows_key, prev)) {
+			free(prev);
+			return 0;
+		}
+	}
+	curr = prev + ARCH_MODULO;
+
+	/* Row m = 0 */
+	for (j = 0; j < ARCH_MODULO; j++) {
+		prev[j] = (j + 1) % ARCH_MODULO;
+	}
+
+	/* Rows 1..m */
+	for (i = 1; i <= m; i++) {
+		curr[0] = prev[k];
+		for (j = 1; j < ARCH_MODULO; j++) {
+			curr[j] = prev[curr[j - 1]];
+		}
+		swap = prev; prev = curr; curr = swap;
+	}
+
+	registers[0] = prev[n];
+	registers[1] = (prev[n] + ARCH_MODULO - 1) % ARCH_MODULO;
+	return 1;
+}
+
+/**
+ * Writes pending console output
+ */
+
+void io_flush()
+{
+	buffer_t *out = &console.out;
+	ssize_t ret;
+
+	if (console.backend == IO_BACKEND_STDIO) {
+		fwrite(out->data, 1, out->length, stdout);
+		fflush(stdout);
+		out->length = 0;
+		return;
+	}
+
+	/* Anything already written through stdio goes first */
+	fflush(stdout);
+	for (out->position = 0; out->position < out->length; out->position += ret) {
+		ret = write(STDOUT_FILENO, out->data + out->position, out->length - out->position);
+		if (ret <= 0) {
+			break;
+		}
+	}
+	out->length = 0;
+}
+
+/**
+ * Reads character from console
+ *
+ * Whole line is read when previous one is consumed, pending output is
+ * flushed first so prompt is visible.
+ */
+
+int io_stdin(vm_t *vm)
+{
+	buffer_t *in = &console.in;
+	ssize_t ret;
+	int c;
+
+	if (in->position < in->length) {
+		return (unsigned char) in->data[in->position++];
+	}
+
+	if (!in->data) {
+		in->data = malloc(IO_BUFFER_SIZE);
+		if (!in->data) {
+			vm_fail("Function %s() failed!", __FUNCTION__);
+		}
+	}
+
+	io_flush();
+
+	do {
+		checkpoint_poll(vm);
+		in->position	= 0;
+		in->length		= 0;
+
+		if (console.backend == IO_BACKEND_STDIO) {
+			while (in->length < IO_BUFFER_SIZE) {
+				c = getc_unlocked(stdin);
+				if (c == EOF && ferror(stdin) && checkpoint.requested) {
+					clearerr(stdin);
+					checkpoint_poll(vm);
+					continue;
+				}
+				if (c == EOF) {
+					break;
+				}
+				in->data[in->length++] = c;
+				if (c == '\n') {
+					break;
+				}
+			}
+		} else {
+			/* Terminal returns single line, pipe whatever is ready */
+			do {
+				checkpoint_poll(vm);
+				ret = read(STDIN_FILENO, in->data, IO_BUFFER_SIZE);
+			} while (ret < 0 && checkpoint.requested);
+			in->length = ret > 0 ? ret : 0;
+		}
+
+		if (!in->length) {
+			return EOF;
+		}
+	} while (checkpoint_command(vm, in) && in->position >= in->length);
+
+	return (unsigned char) in->data[in->position++];
+}
+
+/**
+ * Writes character to console
+ */
+
+void io_stdout(vm_t *vm, unsigned short value)
+{
+	buffer_t *out = &console.out;
+
+	if (!out->data) {
+		out->data = malloc(IO_BUFFER_SIZE);
+		if (!out->data) {
+			vm_fail("Function %s() failed!", __FUNCTION__);
+		}
+	}
+	if (out->length == IO_BUFFER_SIZE) {
+		io_flush();
+	}
+
+	out->data[out->length++] = value;
+}
+
+/**
+ * Reads character from input buffer, blocks when buffer is exhausted
+ */
+
+int io_buffer_in(vm_t *vm)
+{
+	if (vm->input.position >= vm->input.length) {
+		return IO_BLOCKED;
+	}
+
+	return (unsigned char) vm->input.data[vm->input.position++];
+}
+
+/**
+ * Appends character to output buffer, keeps newest half when full
+ */
+
+void io_buffer_out(vm_t *vm, unsigned short value)
+{
+	buffer_t *output = &vm->output;
+
+	if (!output->data) {
+		output->data = malloc(SEARCH_OUTPUT_SIZE);
+		if (!output->data) {
+			vm_fail("Function %s() failed!", __FUNCTION__);
+		}
+	}
+	if (output->length == SEARCH_OUTPUT_SIZE) {
+		memmove(output->data, output->data + SEARCH_OUTPUT_SIZE / 2, SEARCH_OUTPUT_SIZE / 2);
+		output->length = SEARCH_OUTPUT_SIZE / 2;
+	}
+
+	output->data[output->length++] = value;
+}
+
+/**
+ * Reads character from input file, continues on console once exhausted
+ */
+
+int io_script_in(vm_t *vm)
+{
+	buffer_t *input = &vm->input;
+	size_t length;
+	int value;
+
+	/* Command and marker lines are consumed, not fed to program */
+	while (input->position < input->length &&
+		(!input->position || input->data[input->position - 1] == '\n') &&
+		checkpoint_command(vm, input));
+
+	if (vm->forward && vm->marker &&
+		(!input->position || input->data[input->position - 1] == '\n')) {
+		length = strlen(vm->marker);
+		if (input->position + length <= input->length &&
+			!memcmp(input->data + input->position, vm->marker, length) &&
+			(input->position + length == input->length || input->data[input->position + length] == '\n')) {
+			input->position += length + (input->position + length < input->length);
+			io_forward_end(vm);
+		}
+	}
+
+	value = io_buffer_in(vm);
+	if (value != IO_BLOCKED) {
+		return value;
+	}
+
+	if (vm->forward) {
+		io_forward_end(vm);
+	}
+	return io_stdin(vm);
+}
+
+/**
+ * Ends fast-forward, output goes to console from now on
+ */
+
+void io_forward_end(vm_t *vm)
+{
+	vm->forward	= 0;
+	vm->out		= io_stdout;
+
+	vm_info("Fast-forward done ... [pc: %d] [input: %zu B]", vm->pc, vm->input.position);
+}
+
+/**
+ * Drops written character
+ */
+
+void io_discard_out(vm_t *vm, unsigned short value)
+{
+}
+
+/**
+ * Reads whole file into buffer
+ */
+
+int buffer_read(buffer_t *buffer, const char *path)
+{
+	FILE *fp;
+	long size;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		return -1;
+	}
+
+	fseek(fp, 0L, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, 0L, SEEK_SET);
+
+	buffer->data		= malloc(size + 1);
+	buffer->length		= size;
+	buffer->position	= 0;
+	if (!buffer->data || fread(buffer->data, 1, size, fp) != (size_t) size) {
+		fclose(fp);
+		return -1;
+	}
+
+	buffer->data[size] = '\0';
+	fclose(fp);
+	return 0;
+}
+
+/**
+ * Maps whole file read-only into buffer
+ */
+
+int buffer_map(buffer_t *buffer, const char *path)
+{
+	struct stat st;
+	void *data;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+
+	buffer->data		= NULL;
+	buffer->length		= st.st_size;
+	buffer->position	= 0;
+
+	if (st.st_size) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			close(fd);
+			return -1;
+		}
+		madvise(data, st.st_size, MADV_SEQUENTIAL);
+		buffer->data = data;
+	}
+
+	close(fd);
+	return 0;
+}
+
+/**
+ * Parses search option
+ *   - threads:	-j N
+ *   - vary:	-V rN=FROM:TO or -V line:FILE
+ *   - until:	-u out:TEXT or -u rN=VALUE
+ *   - then:	-t FILE with input fed after variation
+ *   - lanes:	-L N instances per thread in lockstep
+ *   - gpu:		-G ADDR subroutine called by candidates
+ */
+
+int search_option(int opt, const char *arg)
+{
+	char *cursor;
+
+	switch (opt) {
+		case 'j' :
+			search.threads = atoi(arg);
+			return (search.threads > 0 && search.threads <= SEARCH_MAX_THREADS) ? 0 : -1;
+
+		case 'V' :
+			if (!search.threads) {
+				search.threads = sysconf(_SC_NPROCESSORS_ONLN);
+				if (search.threads < 1 || search.threads > SEARCH_MAX_THREADS) {
+					search.threads = 1;
+				}
+			}
+			if (sscanf(arg, "r%d=%d:%d", &search.reg, &search.from, &search.to) == 3) {
+				if (search.reg < 0 || search.reg >= REGISTERS_SIZE ||
+					search.from < 0 || search.to > STORAGE_MEM_HIGH || search.from > search.to) {
+					return -1;
+				}
+				search.count = search.to - search.from + 1;
+				return 0;
+			}
+			if (strncmp(arg, "line:", 5) || buffer_read(&search.lines, arg + 5) < 0) {
+				return -1;
+			}
+
+			/* Split into lines, newline is kept with line */
+			search.line = malloc((search.lines.length + 1) * sizeof(char *));
+			if (!search.line) {
+				return -1;
+			}
+			for (cursor = search.lines.data; *cursor; search.count++) {
+				search.line[search.count] = cursor;
+				cursor = strchr(cursor, '\n');
+				if (!cursor) {
+					break;
+				}
+				cursor++;
+			}
+			search.reg = -1;
+			return 0;
+
+		case 'u' :
+			if (!strncmp(arg, "out:", 4)) {
+				search.until_output = arg + 4;
+				return 0;
+			}
+			if (sscanf(arg, "r%d=%d", &search.until_reg, &search.until_value) == 2) {
+				return (search.until_reg >= 0 && search.until_reg < REGISTERS_SIZE) ? 0 : -1;
+			}
+			return -1;
+
+		case 't' :
+			return buffer_read(&search.input, arg);
+
+		case 'L' :
+			search.lanes = atoi(arg);
+			return (search.lanes > 0 && search.lanes <= LANES_MAX) ? 0 : -1;
+
+		case 'G' :
+			search.gpu = strtol(arg, &cursor, 0);
+			return (*arg && !*cursor && search.gpu >= 0 && search.gpu <= STORAGE_MEM_HIGH) ? 0 : -1;
+	}
+
+	return -1;
+}
+
+/**
+ * Runs parallel search
+ *
+ * Given instance runs until it waits for input (this is the snapshot),
+ * then worker threads fork instances from the snapshot, apply one
+ * variation to each and run them until predicate holds, program halts
+ * or input is exhausted. Search stops at first match.
+ */
+
+int search_run(vm_t *vm)
+{
+	pthread_t threads[SEARCH_MAX_THREADS];
+	int i, ret;
+
+	if (!search.count) {
+		vm_info("Search needs variation ...");
+		return -1;
+	}
+	if (!search.until_output && search.until_reg < 0) {
+		vm_info("Search needs predicate ...");
+		return -1;
+	}
+
+	/* Run to snapshot point */
+	vm_info("Running to search snapshot ...");
+	vm->in	= io_buffer_in;
+	vm->out	= io_discard_out;
+
+	ret = vm_exec(vm);
+	if (ret == VM_HALTED) {
+		vm_info("Program halted before search ... [pc: %d]", vm->pc);
+		return -1;
+	}
+
+	vm_info("Searching %d candidates on %d threads ... [pc: %d]", search.count, search.threads, vm->pc);
+	pthread_mutex_init(&search.lock, NULL);
+	search.snapshot	= snapshot_create();
+	search.next		= 0;
+	search.found	= 0;
+	snapshot_take(vm, search.snapshot);
+
+#if !HAVE_LANES
+	if (search.lanes) {
+		vm_info("Lockstep lanes are not supported by this compiler ...");
+		search.lanes = 0;
+	}
+#endif
+	if (search.lanes && search.gpu >= 0) {
+		vm_info("Lockstep lanes do not sweep subroutines ...");
+		search.lanes = 0;
+	}
+
+	/* Device sweep, search threads run unless it was done */
+	ret = -1;
+#ifdef VM_OPENCL
+	if (search.gpu >= 0) {
+		ret = gpu_sweep(vm);
+	}
+#else
+	if (search.gpu >= 0) {
+		vm_info("OpenCL is not built in, compile with -DVM_OPENCL ... [sweeping on CPU]");
+	}
+#endif
+
+	for (i = 0; ret < 0 && i < search.threads; i++) {
+#if HAVE_LANES
+		if (pthread_create(&threads[i], NULL, search.lanes ? search_lanes : search_worker, NULL)) {
+#else
+		if (pthread_create(&threads[i], NULL, search_worker, NULL)) {
+#endif
+			vm_fail("Cannot create search thread ...");
+		}
+	}
+	for (i = 0; ret < 0 && i < search.threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	pthread_mutex_destroy(&search.lock);
+	snapshot_destroy(search.snapshot);
+	if (!search.found) {
+		vm_info("No match found ...");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Search thread - takes candidates until exhausted or match is found
+ */
+
+void *search_worker(void *arg)
+{
+	buffer_t input = { NULL, 0, 0 };
+	vm_t *vm;
+	int candidate, status;
+
+	vm = vm_create();
+	if (!vm) {
+		vm_fail("Cannot create virtual machine ...");
+	}
+	vm->in	= io_buffer_in;
+	vm->out	= search_out;
+
+	for (;;) {
+		pthread_mutex_lock(&search.lock);
+		candidate = search.found ? search.count : search.next++;
+		pthread_mutex_unlock(&search.lock);
+		if (candidate >= search.count) {
+			break;
+		}
+
+		/* Fork from snapshot, only pages dirtied by last candidate are copied */
+		snapshot_restore(vm, search.snapshot);
+		vm->output.length = 0;
+		search_apply(vm, candidate, &input);
+
+		status = search.gpu >= 0 ? search_call(vm) : vm_exec(vm);
+		if (search_match(vm)) {
+			search_report(vm, candidate, status);
+		}
+	}
+
+	free(input.data);
+	vm_destroy(vm);
+	return NULL;
+}
+
+/**
+ * Reports first match, later ones are dropped
+ */
+
+void search_report(vm_t *vm, int candidate, int status)
+{
+	pthread_mutex_lock(&search.lock);
+	if (!search.found) {
+		search.found = 1;
+		if (search.reg >= 0) {
+			vm_info("Match found ... [r%d=%d] [pc: %d]", search.reg, search.from + candidate, vm->pc);
+		} else {
+			vm_info("Match found ... [line %d] [pc: %d]", candidate + 1, vm->pc);
+		}
+		if (status == VM_HALTED) {
+			vm_info("Program halted ...");
+		}
+		fwrite(vm->output.data, 1, vm->output.length, stdout);
+		fflush(stdout);
+	}
+	pthread_mutex_unlock(&search.lock);
+}
+
+/**
+ * Applies variation of candidate to forked instance
+ */
+
+int search_apply(vm_t *vm, int candidate, buffer_t *input)
+{
+	size_t length = 0;
+	char *line, *end;
+
+	/* Register variation */
+	if (search.reg >= 0) {
+		vm->registers.contents[search.reg] = search.from + candidate;
+	} else {
+		line	= search.line[candidate];
+		end		= strchr(line, '\n');
+		length	= end ? (size_t) (end - line + 1) : strlen(line);
+	}
+
+	/* Input of instance - varied line followed by common input */
+	free(input->data);
+	input->data = malloc(length + search.input.length + 1);
+	if (!input->data) {
+		vm_fail("Function %s() failed!", __FUNCTION__);
+	}
+	if (length) {
+		memcpy(input->data, search.line[candidate], length);
+	}
+	memcpy(input->data + length, search.input.data, search.input.length);
+	input->length	= length + search.input.length;
+	input->position	= 0;
+
+	vm->input = *input;
+
+	/* Subroutine sweep calls from snapshot pc, return stops there */
+	if (search.gpu >= 0) {
+		vm_break(vm, vm->pc, 1);
+		vm->breaks->resume = -1;
+		stack_push(vm, vm->pc);
+		vm->pc = search.gpu;
+	}
+	return 0;
+}
+
+/**
+ * Runs candidate calling swept subroutine until it returns
+ *
+ * Returning pc is breakpoint, hits inside deeper calls are passed.
+ */
+
+int search_call(vm_t *vm)
+{
+	int base = vm->stack.position - 1, status;
+
+	for (;;) {
+		status = vm_exec(vm);
+		if (status != VM_STOPPED || vm->breaks->reason != VM_BREAK_PC || vm->stack.position <= base) {
+			return status;
+		}
+	}
+}
+
+/**
+ * Returns true if search predicate holds for stopped instance
+ */
+
+int search_match(vm_t *vm)
+{
+	if (search.until_output) {
+		return vm->stop;
+	}
+
+	return vm->registers.contents[search.until_reg] == search.until_value;
+}
+
+/**
+ * Output callback of search instances, stops instance once output
+ * ends with searched text
+ */
+
+void search_out(vm_t *vm, unsigned short value)
+{
+	size_t length = strlen(search.until_output ? search.until_output : "");
+
+	io_buffer_out(vm, value);
+
+	if (length && vm->output.length >= length &&
+		!memcmp(vm->output.data + vm->output.length - length, search.until_output, length)) {
+		vm->stop = 1;
+	}
+}
+
+#if HAVE_LANES
+
+/**
+ * Search thread running candidates in lockstep groups
+ */
+
+void *search_lanes(void *arg)
+{
+	buffer_t input[LANES_MAX];
+	int candidate[LANES_MAX];
+	lanes_t *lanes = NULL;
+	int n, i;
+
+	/* Vectors need their own alignment, above that of malloc() */
+	if (posix_memalign((void **) &lanes, sizeof(lanes_vec_t), sizeof(lanes_t)) ||
+		!(lanes->decoded = malloc(sizeof(decode_cache_t)))) {
+		vm_fail("Function %s() failed!", __FUNCTION__);
+	}
+	for (i = 0; i < search.lanes; i++) {
+		lanes->vm[i] = vm_create();
+		if (!lanes->vm[i]) {
+			vm_fail("Cannot create virtual machine ...");
+		}
+		lanes->vm[i]->in	= io_buffer_in;
+		lanes->vm[i]->out	= search_out;
+		input[i].data		= NULL;
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&search.lock);
+		for (n = 0; n < search.lanes && !search.found && search.next < search.count; n++) {
+			candidate[n] = search.next++;
+		}
+		pthread_mutex_unlock(&search.lock);
+		if (!n) {
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			snapshot_restore(lanes->vm[i], search.snapshot);
+			lanes->vm[i]->output.length = 0;
+			search_apply(lanes->vm[i], candidate[i], &input[i]);
+		}
+		lanes->count = n;
+		lanes_exec(lanes);
+
+		for (i = 0; i < n; i++) {
+			if (search_match(lanes->vm[i])) {
+				search_report(lanes->vm[i], candidate[i], lanes->status[i]);
+			}
+		}
+	}
+
+	for (i = 0; i < search.lanes; i++) {
+		free(input[i].data);
+		vm_destroy(lanes->vm[i]);
+	}
+	free(lanes->decoded);
+	free(lanes);
+	return NULL;
+}
+
+/* Value of decoded operand n in lane i */
+#define LN_LANE(n, i)	((d->regs & (1 << (n))) ? l->r[d->operand[n]][i] : d->operand[n])
+
+/* Vector of operand n, literal is broadcast */
+#define LN_VAL(n)		((d->regs & (1 << (n))) ? l->r[d->operand[n]] : zero + d->operand[n])
+
+/* Writes destination register of lanes in group */
+#define LN_SET(v)		(l->r[d->operand[0]] = ((v) & mask) | (l->r[d->operand[0]] & ~mask))
+
+/* Lanes of group, one by one */
+#define LN_EACH(i, bits)	for (bits = group; bits && ((i = __builtin_ctz(bits)), 1); bits &= bits - 1)
+
+/* True if any lane of vector is non zero */
+static inline int lanes_any(const lanes_vec_t *v)
+{
+	unsigned long long words[sizeof(*v) / sizeof(unsigned long long)], any = 0;
+	unsigned int i;
+
+	memcpy(words, v, sizeof(*v));
+	for (i = 0; i < sizeof(*v) / sizeof(unsigned long long); i++) {
+		any |= words[i];
+	}
+	return any != 0;
+}
+
+/* Ends lane, state is written back to its instance */
+static void lanes_finish(lanes_t *l, int i, int pc, int status)
+{
+	int k;
+
+	for (k = 0; k < REGISTERS_SIZE; k++) {
+		l->vm[i]->registers.contents[k] = l->r[k][i];
+	}
+	l->vm[i]->pc	= pc;
+	l->pc[i]		= pc;
+	l->status[i]	= status;
+	l->active		&= ~(1u << i);
+}
+
+/* Copies registers of lane to its instance or back */
+static void lanes_sync(lanes_t *l, int i, int back)
+{
+	int k;
+
+	for (k = 0; k < REGISTERS_SIZE; k++) {
+		if (back) {
+			l->r[k][i] = l->vm[i]->registers.contents[k];
+		} else {
+			l->vm[i]->registers.contents[k] = l->r[k][i];
+		}
+	}
+}
+
+/**
+ * Executes instances of lanes in lockstep until all halt or stop
+ *
+ * Group at lowest pc runs while it stays together and no waiting lane
+ * is reached, then next group is chosen. Semantics follow
+ * operation_exec(), accelerated calls run lane by lane.
+ */
+
+LANES_TARGETS
+int lanes_exec(lanes_t *l)
+{
+	const lanes_vec_t zero = { 0 };
+	lanes_vec_t mask, value, test;
+	decode_t *d, *entries = l->decoded->entries;
+	unsigned int group, bits, word;
+	int taken;
+	int pc, wait, lead, i, k, target, status, length;
+	unsigned short *m;
+
+	l->active = 0;
+	for (i = 0; i < l->count; i++) {
+		l->pc[i] = l->vm[i]->pc;
+		for (k = 0; k < REGISTERS_SIZE; k++) {
+			l->r[k][i] = l->vm[i]->registers.contents[k];
+		}
+		l->active |= 1u << i;
+	}
+	for (i = 0; i < ARCH_MODULO; i++) {
+		entries[i].handler = DECODE_MISS;
+	}
+	memset(l->written, 0, sizeof(l->written));
+
+	while (l->active) {
+		/* Lowest pc runs, next lowest is where group waits for others */
+		pc = wait = MEMORY_SIZE;
+		for (bits = l->active; bits; bits &= bits - 1) {
+			i = __builtin_ctz(bits);
+			if (l->pc[i] < pc) {
+				wait	= pc;
+				pc		= l->pc[i];
+			} else if (l->pc[i] > pc && l->pc[i] < wait) {
+				wait	= l->pc[i];
+			}
+		}
+		group = 0;
+		for (bits = l->active; bits; bits &= bits - 1) {
+			i = __builtin_ctz(bits);
+			group |= (l->pc[i] == pc) << i;
+		}
+		for (i = 0; i < LANES_MAX; i++) {
+			mask[i] = (group >> i) & 1 ? 0xffff : 0;
+		}
+		lead	= __builtin_ctz(group);
+		m		= l->vm[lead]->memory.contents;
+
+		while (group && pc < wait) {
+			d = &entries[pc];
+			if (d->handler == DECODE_MISS) {
+				decode_fill(l->vm[lead], d, pc);
+			}
+			length = d->length;
+
+			/* Code written by some lane may differ between lanes */
+			for (k = 0, word = 0; k < length && pc + k < MEMORY_SIZE; k++) {
+				word |= l->written[pc + k];
+			}
+			if (word) {
+				decode_fill(l->vm[lead], d, pc);
+				LN_EACH(i, bits) {
+					if (memcmp(&l->vm[i]->memory.contents[pc], &m[pc], length * sizeof(unsigned short))) {
+						word = 2;
+					}
+				}
+			}
+			/* Tail of binary keeps full checks as in exec_decoded() */
+			if (word == 2 || d->handler == DECODE_TAIL) {
+				LN_EACH(i, bits) {
+					lanes_sync(l, i, 0);
+					target	= pc;
+					status	= operation_exec(l->vm[i], l->vm[i]->memory.contents[pc],
+						l->vm[i]->memory.contents[pc+1], l->vm[i]->memory.contents[pc+2],
+						l->vm[i]->memory.contents[pc+3], &target);
+					lanes_sync(l, i, 1);
+					l->pc[i] = target;
+					if (status) {
+						lanes_finish(l, i, target, status == 1 ? VM_HALTED : VM_STOPPED);
+					} else if (target > l->vm[i]->binary.length) {
+						vm_fail("Program counter out of bounds.");
+					}
+				}
+				group = 0;
+				break;
+			}
+
+			switch (d->handler) {
+				/* Halt */
+				case 0 :
+					LN_EACH(i, bits) {
+						lanes_finish(l, i, pc + 1, VM_HALTED);
+					}
+					group = 0;
+					continue;
+				case 1 :
+					LN_SET(LN_VAL(1));
+					break;
+				/* Push, pop */
+				case 2 :
+					LN_EACH(i, bits) {
+						stack_push(l->vm[i], LN_LANE(0, i));
+					}
+					break;
+				case 3 :
+					LN_EACH(i, bits) {
+						l->r[d->operand[0]][i] = stack_pop(l->vm[i]);
+					}
+					break;
+				/* Eq, gt */
+				case 4 :
+					LN_SET((lanes_vec_t) (LN_VAL(1) == LN_VAL(2)) & 1);
+					break;
+				case 5 :
+					LN_SET((lanes_vec_t) (LN_VAL(1) > LN_VAL(2)) & 1);
+					break;
+				/* Jmp, jt, jf - lanes may split */
+				case 6 :
+				case 7 :
+				case 8 :
+					if (d->handler == 6) {
+						value = mask;
+					} else {
+						value = (lanes_vec_t) (LN_VAL(0) != zero) & mask;
+						value = d->handler == 7 ? value : value ^ mask;
+					}
+					target = d->handler == 6 ? 0 : 1;
+					test = value ^ mask;
+					if (!(d->regs & (1 << target)) && !lanes_any(&test)) {
+						pc = d->operand[target];
+					} else if (!lanes_any(&value)) {
+						break;
+					} else {
+						LN_EACH(i, bits) {
+							l->pc[i] = value[i] ? LN_LANE(target, i) : pc + 3;
+							if (l->pc[i] > l->vm[i]->binary.length) {
+								vm_fail("Program counter out of bounds.");
+							}
+						}
+						group = 0;
+						continue;
+					}
+					if (pc > l->vm[lead]->binary.length) {
+						vm_fail("Program counter out of bounds.");
+					}
+					continue;
+				/* Add, mult, mod, and, or, not */
+				case 9 :
+					LN_SET((LN_VAL(1) + LN_VAL(2)) & 0x7fff);
+					break;
+				case 10 :
+					LN_SET((LN_VAL(1) * LN_VAL(2)) & 0x7fff);
+					break;
+				case 11 :
+					value = LN_VAL(2);
+					test = (lanes_vec_t) (value == zero) & mask;
+					if (lanes_any(&test)) {
+						vm_fail("Division by zero ... [pc: %d]", pc);
+					}
+					value |= (lanes_vec_t) (value == zero) & 1;
+					LN_SET(LN_VAL(1) % value);
+					break;
+				case 12 :
+					LN_SET(LN_VAL(1) & LN_VAL(2));
+					break;
+				case 13 :
+					LN_SET(LN_VAL(1) | LN_VAL(2));
+					break;
+				case 14 :
+					LN_SET(~LN_VAL(1) & 0x7fff);
+					break;
+				/* Rmem, wmem */
+				case 15 :
+					LN_EACH(i, bits) {
+						l->r[d->operand[0]][i] = mem_read(l->vm[i], LN_LANE(1, i));
+					}
+					break;
+				case 16 :
+					LN_EACH(i, bits) {
+						target = LN_LANE(0, i) & STORAGE_MEM_HIGH;
+						mem_write(l->vm[i], target, LN_LANE(1, i));
+						l->written[target] = 1;
+						for (k = target - (DECODE_MAX_LENGTH - 1); k <= target; k++) {
+							if (k >= 0) {
+								entries[k].handler = DECODE_MISS;
+							}
+						}
+					}
+					break;
+				/* Call, ret - accelerated lanes skip call */
+				case 17 :
+					taken = 0;
+					LN_EACH(i, bits) {
+						target = LN_LANE(0, i);
+						if (accel.map[target]) {
+							lanes_sync(l, i, 0);
+							if (accel_call(l->vm[i], target, pc + 2)) {
+								lanes_sync(l, i, 1);
+								l->pc[i] = pc + 2;
+								taken = 1;
+								continue;
+							}
+						}
+						stack_push(l->vm[i], pc + 2);
+						l->pc[i] = target;
+					}
+					if ((d->regs & 1) || taken) {
+						group = 0;
+						continue;
+					}
+					pc = d->operand[0];
+					if (pc > l->vm[lead]->binary.length) {
+						vm_fail("Program counter out of bounds.");
+					}
+					continue;
+				case 18 :
+					target = -1;
+					LN_EACH(i, bits) {
+						l->pc[i] = stack_pop(l->vm[i]);
+						if (ACCEL_RETURNING(l->vm[i])) {
+							lanes_sync(l, i, 0);
+							accel_ret(l->vm[i], l->pc[i]);
+						}
+						if (l->pc[i] > l->vm[i]->binary.length) {
+							vm_fail("Program counter out of bounds.");
+						}
+						target = (target == -1 || target == l->pc[i]) ? l->pc[i] : -2;
+					}
+					if (target < 0) {
+						group = 0;
+						continue;
+					}
+					pc = target;
+					continue;
+				/* Out, in - lane may stop */
+				case 19 :
+					LN_EACH(i, bits) {
+						l->vm[i]->accel.effects++;
+						l->vm[i]->out(l->vm[i], LN_LANE(0, i));
+						if (l->vm[i]->stop) {
+							lanes_finish(l, i, pc + 2, VM_STOPPED);
+						}
+					}
+					break;
+				case 20 :
+					LN_EACH(i, bits) {
+						l->vm[i]->accel.effects++;
+						lanes_sync(l, i, 0);
+						l->vm[i]->pc = pc;
+						status = l->vm[i]->in(l->vm[i]);
+						if (status == IO_BLOCKED) {
+							lanes_finish(l, i, pc, VM_STOPPED);
+						} else {
+							l->r[d->operand[0]][i] = status;
+						}
+					}
+					break;
+				case 21 :
+					break;
+				case DECODE_FAULT_OPCODE :
+					vm_fail("Function %s() failed! [opcode:%d] [pc:%d]", __FUNCTION__, m[pc], pc);
+				case DECODE_FAULT_REGISTER :
+					vm_fail("Function reg_write(vm) failed!");
+				default :
+					vm_fail("Function val_get(vm) failed!");
+			}
+
+			/* Fall through stays within binary, stopped lanes leave group */
+			pc += length;
+			if (group & ~l->active) {
+				group &= l->active;
+				break;
+			}
+		}
+
+		/* Group stays at pc, split lanes set their own */
+		LN_EACH(i, bits) {
+			l->pc[i] = pc;
+		}
+	}
+
+	return 0;
+}
+
+#undef LN_LANE
+#undef LN_VAL
+#undef LN_SET
+#undef LN_EACH
+
+#endif
+
+#ifdef VM_OPENCL
+
+/**
+ * Sweeps subroutine over register variation on OpenCL device
+ *
+ * Returns -1 when no device can be used, search threads take over.
+ */
+
+int gpu_sweep(vm_t *vm)
+{
+	gpu_t gpu;
+	vm_t *host;
+	int first, count, i;
+
+	if (search.reg < 0) {
+		vm_info("Device sweeps register variation only ... [sweeping on CPU]");
+		return -1;
+	}
+	if (gpu_open(&gpu, vm) < 0) {
+		gpu_close(&gpu);
+		return -1;
+	}
+
+	/* Items left on device are finished on one host instance */
+	host = vm_create();
+	if (!host) {
+		vm_fail("Cannot create virtual machine ...");
+	}
+	host->in	= io_buffer_in;
+	host->out	= search_out;
+
+	vm_info("Sweeping subroutine on OpenCL device ... [address: %d]", search.gpu);
+	for (first = 0; first < search.count && !search.found; first += count) {
+		count = search.count - first < GPU_BATCH ? search.count - first : GPU_BATCH;
+		if (gpu_batch(&gpu, vm, first, count) < 0) {
+			vm_fail("OpenCL sweep failed ... [candidate: %d]", first);
+		}
+		for (i = 0; i < count && !search.found; i++) {
+			gpu_finish(&gpu, host, i, first + i);
+		}
+	}
+
+	vm_destroy(host);
+	gpu_close(&gpu);
+	return 0;
+}
+
+/**
+ * Opens first OpenCL device and builds sweep kernel over memory image
+ */
+
+int gpu_open(gpu_t *gpu, vm_t *vm)
+{
+	cl_platform_id platform;
+	cl_device_id device;
+	cl_uint length = vm->binary.length, steps = GPU_STEPS, depth = GPU_STACK_SIZE;
+	unsigned short *image;
+	cl_int err;
+	char log[1024];
+
+	memset(gpu, 0, sizeof(gpu_t));
+	if (clGetPlatformIDs(1, &platform, NULL) != CL_SUCCESS ||
+		(clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &device, NULL) != CL_SUCCESS &&
+		 clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 1, &device, NULL) != CL_SUCCESS)) {
+		vm_info("No OpenCL device found ... [sweeping on CPU]");
+		return -1;
+	}
+
+	gpu->context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
+	if (err != CL_SUCCESS) {
+		vm_info("Cannot create OpenCL context ... [error: %d]", err);
+		return -1;
+	}
+	gpu->queue = clCreateCommandQueue(gpu->context, device, 0, &err);
+	if (err != CL_SUCCESS) {
+		vm_info("Cannot create OpenCL queue ... [error: %d]", err);
+		return -1;
+	}
+
+	gpu->program = clCreateProgramWithSource(gpu->context, 1, &gpu_source, NULL, &err);
+	if (err != CL_SUCCESS || clBuildProgram(gpu->program, 1, &device, NULL, NULL, NULL) != CL_SUCCESS) {
+		log[0] = 0;
+		clGetProgramBuildInfo(gpu->program, device, CL_PROGRAM_BUILD_LOG, sizeof(log), log, NULL);
+		vm_info("Cannot build sweep kernel ... [%s]", log);
+		return -1;
+	}
+	gpu->kernel = clCreateKernel(gpu->program, "sweep", &err);
+	if (err != CL_SUCCESS) {
+		vm_info("Cannot create sweep kernel ... [error: %d]", err);
+		return -1;
+	}
+
+	/* Image padded with operands of last instruction */
+	image = calloc(MEMORY_SIZE + DECODE_MAX_LENGTH, sizeof(unsigned short));
+	if (!image) {
+		vm_fail("Function %s() failed!", __FUNCTION__);
+	}
+	memcpy(image, vm->memory.contents, MEMORY_SIZE * sizeof(unsigned short));
+	gpu->memory = clCreateBuffer(gpu->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		(MEMORY_SIZE + DECODE_MAX_LENGTH) * sizeof(unsigned short), image, &err);
+	free(image);
+
+	gpu->regs	= clCreateBuffer(gpu->context, CL_MEM_READ_WRITE, GPU_BATCH * REGISTERS_SIZE * sizeof(cl_ushort), NULL, NULL);
+	gpu->pcs	= clCreateBuffer(gpu->context, CL_MEM_READ_WRITE, GPU_BATCH * sizeof(cl_uint), NULL, NULL);
+	gpu->sps	= clCreateBuffer(gpu->context, CL_MEM_READ_WRITE, GPU_BATCH * sizeof(cl_uint), NULL, NULL);
+	gpu->status	= clCreateBuffer(gpu->context, CL_MEM_READ_WRITE, GPU_BATCH * sizeof(cl_uchar), NULL, NULL);
+	gpu->stacks	= clCreateBuffer(gpu->context, CL_MEM_READ_WRITE, (size_t) GPU_BATCH * GPU_STACK_SIZE * sizeof(cl_ushort), NULL, NULL);
+	if (err != CL_SUCCESS || !gpu->regs || !gpu->pcs || !gpu->sps || !gpu->status || !gpu->stacks) {
+		vm_info("Cannot allocate OpenCL buffers ...");
+		return -1;
+	}
+
+	gpu->host_regs		= malloc(GPU_BATCH * REGISTERS_SIZE * sizeof(unsigned short));
+	gpu->host_pcs		= malloc(GPU_BATCH * sizeof(unsigned int));
+	gpu->host_sps		= malloc(GPU_BATCH * sizeof(unsigned int));
+	gpu->host_status	= malloc(GPU_BATCH * sizeof(unsigned char));
+	gpu->host_stacks	= malloc((size_t) GPU_BATCH * GPU_STACK_SIZE * sizeof(unsigned short));
+	if (!gpu->host_regs || !gpu->host_pcs || !gpu->host_sps || !gpu->host_status || !gpu->host_stacks) {
+		vm_fail("Function %s() failed!", __FUNCTION__);
+	}
+
+	clSetKernelArg(gpu->kernel, 0, sizeof(cl_mem), &gpu->memory);
+	clSetKernelArg(gpu->kernel, 1, sizeof(cl_uint), &length);
+	clSetKernelArg(gpu->kernel, 2, sizeof(cl_uint), &steps);
+	clSetKernelArg(gpu->kernel, 3, sizeof(cl_uint), &depth);
+	clSetKernelArg(gpu->kernel, 4, sizeof(cl_mem), &gpu->regs);
+	clSetKernelArg(gpu->kernel, 5, sizeof(cl_mem), &gpu->pcs);
+	clSetKernelArg(gpu->kernel, 6, sizeof(cl_mem), &gpu->sps);
+	clSetKernelArg(gpu->kernel, 7, sizeof(cl_mem), &gpu->status);
+	clSetKernelArg(gpu->kernel, 8, sizeof(cl_mem), &gpu->stacks);
+
+	return 0;
+}
+
+/**
+ * Releases device objects and host copies, also after failed open
+ */
+
+void gpu_close(gpu_t *gpu)
+{
+	cl_mem *buffers[] = { &gpu->memory, &gpu->regs, &gpu->pcs, &gpu->sps, &gpu->status, &gpu->stacks };
+	unsigned int i;
+
+	for (i = 0; i < sizeof(buffers) / sizeof(buffers[0]); i++) {
+		if (*buffers[i]) {
+			clReleaseMemObject(*buffers[i]);
+		}
+	}
+	if (gpu->kernel) {
+		clReleaseKernel(gpu->kernel);
+	}
+	if (gpu->program) {
+		clReleaseProgram(gpu->program);
+	}
+	if (gpu->queue) {
+		clReleaseCommandQueue(gpu->queue);
+	}
+	if (gpu->context) {
+		clReleaseContext(gpu->context);
+	}
+
+	free(gpu->host_regs);
+	free(gpu->host_pcs);
+	free(gpu->host_sps);
+	free(gpu->host_status);
+	free(gpu->host_stacks);
+	free(gpu->input.data);
+}
+
+/**
+ * Runs batch of candidates on device until none is running
+ *
+ * Launches are bounded by GPU_STEPS, so long calls do not trip
+ * watchdog of display devices.
+ */
+
+int gpu_batch(gpu_t *gpu, vm_t *vm, int first, int count)
+{
+	size_t items = count;
+	int i, running;
+
+	for (i = 0; i < count; i++) {
+		memcpy(&gpu->host_regs[i * REGISTERS_SIZE], vm->registers.contents, sizeof(vm->registers.contents));
+		gpu->host_regs[i * REGISTERS_SIZE + search.reg] = search.from + first + i;
+		gpu->host_pcs[i]	= search.gpu;
+		gpu->host_sps[i]	= 0;
+		gpu->host_status[i]	= GPU_RUNNING;
+	}
+
+	if (clEnqueueWriteBuffer(gpu->queue, gpu->regs, CL_FALSE, 0, count * REGISTERS_SIZE * sizeof(cl_ushort), gpu->host_regs, 0, NULL, NULL) ||
+		clEnqueueWriteBuffer(gpu->queue, gpu->pcs, CL_FALSE, 0, count * sizeof(cl_uint), gpu->host_pcs, 0, NULL, NULL) ||
+		clEnqueueWriteBuffer(gpu->queue, gpu->sps, CL_FALSE, 0, count * sizeof(cl_uint), gpu->host_sps, 0, NULL, NULL) ||
+		clEnqueueWriteBuffer(gpu->queue, gpu->status, CL_FALSE, 0, count * sizeof(cl_uchar), gpu->host_status, 0, NULL, NULL)) {
+		return -1;
+	}
+
+	do {
+		if (clEnqueueNDRangeKernel(gpu->queue, gpu->kernel, 1, NULL, &items, NULL, 0, NULL, NULL) ||
+			clEnqueueReadBuffer(gpu->queue, gpu->status, CL_TRUE, 0, count * sizeof(cl_uchar), gpu->host_status, 0, NULL, NULL)) {
+			return -1;
+		}
+		for (i = 0, running = 0; i < count; i++) {
+			running += gpu->host_status[i] == GPU_RUNNING;
+		}
+	} while (running);
+
+	if (clEnqueueReadBuffer(gpu->queue, gpu->regs, CL_FALSE, 0, count * REGISTERS_SIZE * sizeof(cl_ushort), gpu->host_regs, 0, NULL, NULL) ||
+		clEnqueueReadBuffer(gpu->queue, gpu->pcs, CL_FALSE, 0, count * sizeof(cl_uint), gpu->host_pcs, 0, NULL, NULL) ||
+		clEnqueueReadBuffer(gpu->queue, gpu->sps, CL_FALSE, 0, count * sizeof(cl_uint), gpu->host_sps, 0, NULL, NULL) ||
+		clEnqueueReadBuffer(gpu->queue, gpu->stacks, CL_TRUE, 0, (size_t) count * GPU_STACK_SIZE * sizeof(cl_ushort), gpu->host_stacks, 0, NULL, NULL)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Checks predicate of work item, item left to host continues there
+ */
+
+void gpu_finish(gpu_t *gpu, vm_t *vm, int item, int candidate)
+{
+	const unsigned short *r = &gpu->host_regs[item * REGISTERS_SIZE];
+	const unsigned short *s = &gpu->host_stacks[(size_t) item * GPU_STACK_SIZE];
+	unsigned int i;
+	int status;
+
+	/* Returned item wrote no output */
+	if (gpu->host_status[item] == GPU_RETURNED &&
+		(search.until_output || r[search.until_reg] != search.until_value)) {
+		return;
+	}
+
+	/* Rebuild instance, device stack lies above return pc */
+	snapshot_restore(vm, search.snapshot);
+	vm->output.length = 0;
+	search_apply(vm, candidate, &gpu->input);
+	for (i = 0; i < gpu->host_sps[item]; i++) {
+		stack_push(vm, s[i]);
+	}
+	memcpy(vm->registers.contents, r, sizeof(vm->registers.contents));
+
+	if (gpu->host_status[item] == GPU_RETURNED) {
+		vm->pc = stack_pop(vm);
+		status = VM_STOPPED;
+	} else {
+		vm->pc = gpu->host_pcs[item];
+		status = search_call(vm);
+	}
+	if (search_match(vm)) {
+		search_report(vm, candidate, status);
+	}
+}
+
+#endif
+
+/**
+ * Starts scheduler with given number of worker threads
+ *
+ * Zero threads use one per online CPU, zero slice runs instances until
+ * they halt or block.
+ */
+
+sched_t *sched_create(int threads, unsigned long long slice, vm_done_fn done)
+{
+	sched_t *sched;
+	int i;
+
+	if (threads <= 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = threads > 0 ? threads : 1;
+	}
+
+	sched = calloc(1, sizeof(sched_t));
+	if (!sched || !(sched->worker = calloc(threads, sizeof(sched_worker_t)))) {
+		vm_fail("Function %s() failed!", __FUNCTION__);
+	}
+	sched->threads	= threads;
+	sched->slice	= slice;
+	sched->done		= done;
+	pthread_mutex_init(&sched->lock, NULL);
+	pthread_cond_init(&sched->ready, NULL);
+	pthread_cond_init(&sched->settled, NULL);
+
+	for (i = 0; i < threads; i++) {
+		sched->worker[i].sched = sched;
+		sched->worker[i].index = i;
+		pthread_mutex_init(&sched->worker[i].queue.lock, NULL);
+	}
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&sched->worker[i].thread, NULL, sched_worker, &sched->worker[i])) {
+			vm_fail("Function %s() failed!", __FUNCTION__);
+		}
+	}
+
+	return sched;
+}
+
+/**
+ * Stops workers after their current slice and releases scheduler,
+ * instances are left to caller
+ */
+
+void sched_destroy(sched_t *sched)
+{
+	int i;
+
+	pthread_mutex_lock(&sched->lock);
+	sched->stop = 1;
+	pthread_cond_broadcast(&sched->ready);
+	pthread_mutex_unlock(&sched->lock);
+
+	for (i = 0; i < sched->threads; i++) {
+		pthread_join(sched->worker[i].thread, NULL);
+		pthread_mutex_destroy(&sched->worker[i].queue.lock);
+		free(sched->worker[i].queue.items);
+	}
+
+	pthread_cond_destroy(&sched->settled);
+	pthread_cond_destroy(&sched->ready);
+	pthread_mutex_destroy(&sched->lock);
+	free(sched->worker);
+	free(sched);
+}
+
+/**
+ * Adds runnable instance
+ */
+
+void sched_submit(sched_t *sched, vm_t *vm)
+{
+	pthread_mutex_lock(&sched->lock);
+	sched->live++;
+	pthread_mutex_unlock(&sched->lock);
+
+	vm->sched_state = SCHED_QUEUED;
+	sched_push(sched, __atomic_fetch_add(&sched->next, 1, __ATOMIC_RELAXED) % sched->threads, vm);
+}
+
+/**
+ * Makes parked instance runnable once its input is available
+ *
+ * Wake during running slice is remembered, instance is then queued
+ * again instead of being parked.
+ */
+
+void sched_wake(sched_t *sched, vm_t *vm)
+{
+	int state;
+
+	while (1) {
+		state = SCHED_PARKED;
+		if (__atomic_compare_exchange_n(&vm->sched_state, &state, SCHED_QUEUED, 0,
+				__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+			pthread_mutex_lock(&sched->lock);
+			sched->parked--;
+			pthread_mutex_unlock(&sched->lock);
+
+			sched_push(sched, __atomic_fetch_add(&sched->next, 1, __ATOMIC_RELAXED) % sched->threads, vm);
+			return;
+		}
+
+		/* Queued or already woken instance reads input on its own */
+		if (state != SCHED_RUNNING) {
+			return;
+		}
+		if (__atomic_compare_exchange_n(&vm->sched_state, &state, SCHED_WOKEN, 0,
+				__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+			return;
+		}
+	}
+}
+
+/**
+ * Waits until every instance finished or is parked
+ */
+
+void sched_wait(sched_t *sched)
+{
+	pthread_mutex_lock(&sched->lock);
+	while (sched->live > sched->parked) {
+		pthread_cond_wait(&sched->settled, &sched->lock);
+	}
+	pthread_mutex_unlock(&sched->lock);
+}
+
+/**
+ * Appends instance to queue of worker, wakes idle worker
+ */
+
+void sched_push(sched_t *sched, int index, vm_t *vm)
+{
+	sched_queue_t *queue = &sched->worker[index].queue;
+	vm_t **items;
+	int i, size;
+
+	pthread_mutex_lock(&queue->lock);
+	if (queue->count == queue->size) {
+		size	= queue->size ? queue->size * 2 : SCHED_QUEUE_SIZE;
+		items	= malloc(size * sizeof(vm_t *));
+		if (!items) {
+			pthread_mutex_unlock(&queue->lock);
+			vm_fail("Function %s() failed!", __FUNCTION__);
+		}
+		for (i = 0; i < queue->count; i++) {
+			items[i] = queue->items[(queue->head + i) % queue->size];
+		}
+		free(queue->items);
+		queue->items	= items;
+		queue->head		= 0;
+		queue->size		= size;
+	}
+	queue->items[(queue->head + queue->count++) % queue->size] = vm;
+	pthread_mutex_unlock(&queue->lock);
+
+	/* Pairs with idle counter in sched_take(), one of the two sees the other */
+	__atomic_add_fetch(&sched->runnable, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&sched->idle, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&sched->lock);
+		pthread_cond_signal(&sched->ready);
+		pthread_mutex_unlock(&sched->lock);
+	}
+}
+
+/**
+ * Takes instance from own queue or steals oldest one from others,
+ * sleeps while there is none, returns NULL once scheduler stops
+ */
+
+vm_t *sched_take(sched_t *sched, int index)
+{
+	sched_queue_t *queue;
+	vm_t *vm;
+	int i;
+
+	while (1) {
+		for (i = 0; i < sched->threads; i++) {
+			queue	= &sched->worker[(index + i) % sched->threads].queue;
+			vm		= NULL;
+
+			pthread_mutex_lock(&queue->lock);
+			if (queue->count) {
+				vm = queue->items[queue->head];
+				queue->head = (queue->head + 1) % queue->size;
+				queue->count--;
+			}
+			pthread_mutex_unlock(&queue->lock);
+
+			if (vm) {
+				__atomic_sub_fetch(&sched->runnable, 1, __ATOMIC_SEQ_CST);
+				return vm;
+			}
+		}
+
+		pthread_mutex_lock(&sched->lock);
+		__atomic_add_fetch(&sched->idle, 1, __ATOMIC_SEQ_CST);
+		while (!__atomic_load_n(&sched->runnable, __ATOMIC_SEQ_CST) && !sched->stop) {
+			pthread_cond_wait(&sched->ready, &sched->lock);
+		}
+		__atomic_sub_fetch(&sched->idle, 1, __ATOMIC_SEQ_CST);
+		i = sched->stop;
+		pthread_mutex_unlock(&sched->lock);
+
+		if (i) {
+			return NULL;
+		}
+	}
+}
+
+/**
+ * Worker thread, runs slices of instances from queues
+ *
+ * Slice used up puts instance at the end of own queue, so instances
+ * of one worker take turns. Stopped instance waits for input and is
+ * parked, halted or failed one is handed to done callback.
+ */
+
+void *sched_worker(void *arg)
+{
+	sched_worker_t *worker = arg;
+	sched_t *sched = worker->sched;
+	vm_t *vm;
+	int status, state;
+
+	while ((vm = sched_take(sched, worker->index))) {
+		__atomic_store_n(&vm->sched_state, SCHED_RUNNING, __ATOMIC_SEQ_CST);
+		status = vm_run(vm, sched->slice);
+
+		if (status == VM_RUNNING) {
+			__atomic_store_n(&vm->sched_state, SCHED_QUEUED, __ATOMIC_SEQ_CST);
+			sched_push(sched, worker->index, vm);
+			continue;
+		}
+
+		if (status == VM_STOPPED) {
+			state = SCHED_RUNNING;
+			if (__atomic_compare_exchange_n(&vm->sched_state, &state, SCHED_PARKED, 0,
+					__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+				pthread_mutex_lock(&sched->lock);
+				sched->parked++;
+				pthread_cond_broadcast(&sched->settled);
+				pthread_mutex_unlock(&sched->lock);
+			} else {
+				/* Woken while running, input is already there */
+				__atomic_store_n(&vm->sched_state, SCHED_QUEUED, __ATOMIC_SEQ_CST);
+				sched_push(sched, worker->index, vm);
+			}
+			continue;
+		}
+
+		if (sched->done) {
+			sched->done(vm, status);
+		}
+		pthread_mutex_lock(&sched->lock);
+		sched->live--;
+		pthread_cond_broadcast(&sched->settled);
+		pthread_mutex_unlock(&sched->lock);
+	}
+
+	return NULL;
+}
+
+/* Register operand */
+#define R(n)		(STORAGE_REG_LOW + (n))
+
+/* Appends instruction words to benchmark program */
+static int bench_emit(vm_t *vm, int count, ...)
+{
+	va_list args;
+	int i;
+
+	va_start(args, count);
+	for (i = 0; i < count; i++) {
+		vm->memory.contents[vm->binary.length++] = va_arg(args, int);
+	}
+	va_end(args);
+	return vm->binary.length;
+}
+
+/**
+ * Runs benchmarks and prints results as JSON to standard output
+ *   - arith:	loop over add, mult, mod, and, or, not
+ *   - call:	recursive fib(24) through call/ret
+ *   - memory:	rmem/wmem streaming over 16K words
+ *   - output:	out-heavy printing into discarding callback
+ *   - wide:	add, mult and not of memory word above 15 bits
+ *   - binary:	given binary replaying input or script until exhausted
+ *
+ * Returns -1 when final registers of some engine differ.
+ */
+
+int bench_run(vm_t *vm)
+{
+	vm_t *image;
+	int loop, inner, fib, rec, data, count = 0, failed = 0;
+
+	image = vm_create();
+	if (!image) {
+		vm_fail("Cannot create virtual machine ...");
+	}
+	if (perf_counters && perf_open(&perf) < 0) {
+		vm_info("Hardware counters unavailable ... [%s]", strerror(errno));
+	}
+
+	printf("{\n  \"runs\": %d,\n  \"benchmarks\": [\n", BENCH_RUNS);
+
+	/* Arithmetic, r6 counts outer iterations */
+	bench_emit(image, 3, 1, R(6), 0);
+	loop = bench_emit(image, 0);
+	bench_emit(image, 3, 1, R(0), 0);
+	inner = bench_emit(image, 4, 9, R(1), R(1), R(0)) - 4;
+	bench_emit(image, 4, 10, R(2), R(1), 3);
+	bench_emit(image, 4, 11, R(3), R(2), 1009);
+	bench_emit(image, 4, 12, R(4), R(3), R(1));
+	bench_emit(image, 4, 13, R(5), R(4), R(2));
+	bench_emit(image, 3, 14, R(1), R(5));
+	bench_emit(image, 4, 9, R(0), R(0), 1);
+	bench_emit(image, 4, 4, R(7), R(0), 10000);
+	bench_emit(image, 3, 8, R(7), inner);
+	bench_emit(image, 4, 9, R(6), R(6), 1);
+	bench_emit(image, 4, 4, R(7), R(6), 1000);
+	bench_emit(image, 3, 8, R(7), loop);
+	bench_emit(image, 1, 0);
+	failed |= bench_program("arith", image, count++);
+
+	/* Recursion, fib(n) in r0 */
+	image->binary.length = 0;
+	bench_emit(image, 3, 1, R(6), 0);
+	loop = bench_emit(image, 0);
+	bench_emit(image, 3, 1, R(0), 24);
+	bench_emit(image, 2, 17, 0);
+	bench_emit(image, 4, 9, R(6), R(6), 1);
+	bench_emit(image, 4, 4, R(7), R(6), 10);
+	bench_emit(image, 3, 8, R(7), loop);
+	fib = bench_emit(image, 1, 0);
+	image->memory.contents[loop + 4] = fib;
+	bench_emit(image, 4, 5, R(1), R(0), 1);
+	rec = bench_emit(image, 3, 7, R(1), 0);
+	bench_emit(image, 1, 18);
+	image->memory.contents[rec - 1] = image->binary.length;
+	bench_emit(image, 2, 2, R(0));
+	bench_emit(image, 4, 9, R(0), R(0), 32767);
+	bench_emit(image, 2, 17, fib);
+	bench_emit(image, 2, 3, R(1));
+	bench_emit(image, 2, 2, R(0));
+	bench_emit(image, 4, 9, R(0), R(1), 32766);
+	bench_emit(image, 2, 17, fib);
+	bench_emit(image, 2, 3, R(1));
+	bench_emit(image, 4, 9, R(0), R(0), R(1));
+	bench_emit(image, 1, 18);
+	failed |= bench_program("call", image, count++);
+
+	/* Memory streaming over [16384, 32768) */
+	image->binary.length = 0;
+	bench_emit(image, 3, 1, R(6), 0);
+	loop = bench_emit(image, 0);
+	inner = bench_emit(image, 3, 1, R(0), 16384);
+	bench_emit(image, 3, 15, R(1), R(0));
+	bench_emit(image, 4, 9, R(1), R(1), R(6));
+	bench_emit(image, 3, 16, R(0), R(1));
+	bench_emit(image, 4, 9, R(0), R(0), 1);
+	bench_emit(image, 3, 7, R(0), inner);
+	bench_emit(image, 4, 9, R(6), R(6), 1);
+	bench_emit(image, 4, 4, R(7), R(6), 1024);
+	bench_emit(image, 3, 8, R(7), loop);
+	bench_emit(image, 1, 0);
+	failed |= bench_program("memory", image, count++);
+
+	/* Output, 26 letters and newline per line */
+	image->binary.length = 0;
+	bench_emit(image, 3, 1, R(6), 0);
+	loop = bench_emit(image, 0);
+	inner = bench_emit(image, 3, 1, R(0), 'a');
+	bench_emit(image, 2, 19, R(0));
+	bench_emit(image, 4, 9, R(0), R(0), 1);
+	bench_emit(image, 4, 5, R(1), R(0), 'z');
+	bench_emit(image, 3, 8, R(1), inner);
+	bench_emit(image, 2, 19, '\n');
+	bench_emit(image, 4, 9, R(6), R(6), 1);
+	bench_emit(image, 4, 4, R(7), R(6), 32000);
+	bench_emit(image, 3, 8, R(7), loop);
+	bench_emit(image, 1, 0);
+	failed |= bench_program("output", image, count++);
+
+	/* Wide words, identity add and mult must still mask, r5 sums results */
+	image->binary.length = 0;
+	bench_emit(image, 3, 1, R(6), 0);
+	loop = bench_emit(image, 0);
+	bench_emit(image, 3, 1, R(0), 0);
+	inner = bench_emit(image, 0);
+	data = bench_emit(image, 3, 15, R(1), 0);
+	bench_emit(image, 4, 9, R(2), R(1), 0);
+	bench_emit(image, 4, 10, R(3), R(1), 1);
+	bench_emit(image, 3, 14, R(4), R(1));
+	bench_emit(image, 4, 9, R(5), R(5), R(2));
+	bench_emit(image, 4, 9, R(5), R(5), R(3));
+	bench_emit(image, 4, 9, R(5), R(5), R(4));
+	bench_emit(image, 4, 9, R(0), R(0), 1);
+	bench_emit(image, 4, 4, R(7), R(0), 10000);
+	bench_emit(image, 3, 8, R(7), inner);
+	bench_emit(image, 4, 9, R(6), R(6), 1);
+	bench_emit(image, 4, 4, R(7), R(6), 100);
+	bench_emit(image, 3, 8, R(7), loop);
+	bench_emit(image, 1, 0);
+	image->memory.contents[data - 1] = image->binary.length;
+	bench_emit(image, 1, 40000);
+	failed |= bench_program("wide", image, count++);
+
+	/* Replay of given binary */
+	if (vm->binary.path) {
+		if (binary_load(vm) < 0) {
+			vm_fail("Loading failed ...");
+		}
+		failed |= bench_program(vm->binary.path, vm, count++);
+	}
+
+	printf("\n  ]\n}\n");
+	perf_close(&perf);
+	vm_destroy(image);
+	return failed ? -1 : 0;
+}
+
+/**
+ * Runs program from image with every engine, prints JSON object
+ *
+ * Image is cloned into fresh instance for every run, so caches are
+ * cold and program starts at pc 0 with image input from its start.
+ * Hardware counters, when open, are those of the fastest run. Every
+ * run must end with registers of counting run, returns -1 otherwise.
+ */
+
+int bench_program(const char *name, const vm_t *image, int index)
+{
+	static const char *names[BENCH_ENGINES] = { "switch", "threaded", "decoded", "jit" };
+	struct timespec start, end;
+	unsigned long long insns = 0, counters[PERF_COUNTERS] = { 0 };
+	unsigned short registers[REGISTERS_SIZE];
+	double seconds, best;
+	int engine, run, ret, i, failed = 0;
+	vm_t *vm;
+
+	vm_info("Benchmark %s ...", name);
+	printf("%s    {\n      \"name\": \"%s\",\n", index ? ",\n" : "", name);
+
+	for (engine = -1; engine < BENCH_ENGINES; engine++) {
+		best = 0;
+		for (run = 0; run < (engine < 0 ? 1 : BENCH_RUNS); run++) {
+			vm = vm_create();
+			if (!vm) {
+				vm_fail("Cannot create virtual machine ...");
+			}
+			vm_clone(vm, image);
+			vm->pc					= 0;
+			vm->binary.engine		= engine < 0 ? ENGINE_SWITCH : engine;
+			vm->input				= image->input;
+			vm->input.position		= 0;
+			vm->in					= io_buffer_in;
+			vm->out					= io_discard_out;
+
+			perf_start(&perf);
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			ret = vm_exec(vm);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			perf_stop(&perf);
+
+			seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+			if (!run || seconds < best) {
+				best = seconds;
+				memcpy(counters, perf.value, sizeof(counters));
+			}
+
+			/* Counting run */
+			if (engine < 0) {
+				memcpy(registers, vm->registers.contents, sizeof(registers));
+				insns = vm->insns;
+				printf("      \"instructions\": %llu,\n      \"status\": \"%s\",\n"
+					"      \"results\": [\n", insns, ret == VM_HALTED ? "halted" : "blocked");
+			} else if (memcmp(registers, vm->registers.contents, sizeof(registers)) && !failed) {
+				vm_info("Engine result differs ... [%s] [%s]", name, names[engine]);
+				failed = 1;
+			}
+			vm_destroy(vm);
+		}
+
+		if (engine >= 0) {
+			printf("        { \"engine\": \"%s\", \"seconds\": %.6f, \"ips\": %.0f",
+				names[engine], best, best > 0 ? insns / best : 0);
+			if (perf.leader >= 0) {
+				printf(", \"counters\": {");
+				for (i = 0; i < PERF_COUNTERS; i++) {
+					if (perf.fd[i] >= 0) {
+						printf(" \"%s\": %llu%s", perf_names[i], counters[i], i < PERF_COUNTERS - 1 ? "," : "");
+					} else {
+						printf(" \"%s\": null%s", perf_names[i], i < PERF_COUNTERS - 1 ? "," : "");
+					}
+				}
+				printf(" }");
+			}
+			printf(" }%s\n", engine < BENCH_ENGINES - 1 ? "," : "");
+			vm_info("  %-8s %10.3f s %12.0f insn/s", names[engine], best, best > 0 ? insns / best : 0);
+		}
+	}
+
+	printf("      ]\n    }");
+	fflush(stdout);
+	return failed ? -1 : 0;
+}
+
+#undef R
+
+/**
+ * Opens counter group of calling thread, disabled until perf_start()
+ *
+ * Counters kernel refuses stay closed, returns -1 if none opened.
+ */
+
+int perf_open(perf_t *perf)
+{
+	static const struct {
+		unsigned int		type;
+		unsigned long long	config;
+	} events[PERF_COUNTERS] = {
+		{ PERF_TYPE_HARDWARE,	PERF_COUNT_HW_CPU_CYCLES },
+		{ PERF_TYPE_HARDWARE,	PERF_COUNT_HW_INSTRUCTIONS },
+		{ PERF_TYPE_HARDWARE,	PERF_COUNT_HW_BRANCH_MISSES },
+		{ PERF_TYPE_HW_CACHE,	PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+			(PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+	};
+	struct perf_event_attr attr;
+	int i;
+
+	perf->leader = -1;
+	for (i = 0; i < PERF_COUNTERS; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size			= sizeof(attr);
+		attr.type			= events[i].type;
+		attr.config			= events[i].config;
+		attr.read_format	= PERF_FORMAT_GROUP;
+		attr.disabled		= perf->leader < 0;
+		attr.exclude_kernel	= 1;
+		attr.exclude_hv		= 1;
+
+		perf->fd[i]		= syscall(SYS_perf_event_open, &attr, 0, -1, perf->leader, 0);
+		perf->value[i]	= 0;
+		if (perf->fd[i] >= 0 && perf->leader < 0) {
+			perf->leader = perf->fd[i];
+		}
+	}
+
+	return perf->leader < 0 ? -1 : 0;
+}
+
+/**
+ * Closes counter group
+ */
+
+void perf_close(perf_t *perf)
+{
+	int i;
+
+	for (i = 0; i < PERF_COUNTERS; i++) {
+		if (perf->fd[i] >= 0) {
+			close(perf->fd[i]);
+		}
+		perf->fd[i] = -1;
+	}
+	perf->leader = -1;
+}
+
+/**
+ * Starts counting from zero, nothing happens without open group
+ */
+
+void perf_start(perf_t *perf)
+{
+	if (perf->leader >= 0) {
+		ioctl(perf->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(perf->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	}
+}
+
+/**
+ * Stops counting, counts are kept in value
+ */
+
+void perf_stop(perf_t *perf)
+{
+	if (perf->leader >= 0) {
+		ioctl(perf->leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+		perf_read(perf, perf->value);
+	}
+}
+
+/**
+ * Reads current counts, group lists opened counters in order
+ */
+
+int perf_read(const perf_t *perf, unsigned long long *values)
+{
+	unsigned long long data[PERF_COUNTERS + 1];
+	int i, n = 1;
+
+	if (perf->leader < 0 || read(perf->leader, data, sizeof(data)) < (ssize_t) sizeof(data[0])) {
+		return -1;
+	}
+	for (i = 0; i < PERF_COUNTERS; i++) {
+		values[i] = (perf->fd[i] >= 0 && n <= (int) data[0]) ? data[n++] : 0;
+	}
+
+	return 0;
+}
+
+/**
+ * Prints counts of last run with engine name
+ */
+
+void perf_report(const perf_t *perf, int engine)
+{
+	char text[256];
+	int i, n = 0;
+
+	text[0] = 0;
+	for (i = 0; i < PERF_COUNTERS; i++) {
+		if (perf->fd[i] >= 0) {
+			n += snprintf(text + n, sizeof(text) - n, " [%s: %llu]", perf_names[i], perf->value[i]);
+		}
+	}
+	if (perf->fd[PERF_CYCLES] >= 0 && perf->fd[PERF_INSTRUCTIONS] >= 0 && perf->value[PERF_CYCLES]) {
+		snprintf(text + n, sizeof(text) - n, " [ipc: %.2f]",
+			(double) perf->value[PERF_INSTRUCTIONS] / perf->value[PERF_CYCLES]);
+	}
+
+	vm_info("Hardware counters ... [%s]%s", engine_names[engine], text);
+}
+
+/**
+ * Appends compiled block to perf map, symbol names guest address range
+ */
+
+void perf_map(const void *code, size_t size, int start, int end)
+{
+	fprintf(perf_map_file, "%lx %zx vm_block_%d_%d\n", (unsigned long) code, size, start, end);
+	fflush(perf_map_file);
+}
+
+/**
+ * Output callback of differential run, hashes written words
+ */
+
+void diff_out(vm_t *vm, unsigned short value)
+{
+	diff_side_t *side = vm->user;
+
+	side->now.output = (side->now.output ^ value) * 1099511628211ULL;
+	side->now.written++;
+}
+
+/* Marks start of round */
+static void diff_save(diff_side_t *side)
+{
+	snapshot_take(side->vm, side->snapshot);
+	side->now.input	= side->vm->input.position;
+	side->saved		= side->now;
+}
+
+/* Returns side to start of round */
+static void diff_restore(diff_side_t *side)
+{
+	snapshot_restore(side->vm, side->snapshot);
+	side->now					= side->saved;
+	side->vm->input.position	= side->saved.input;
+	side->vm->failed			= 0;
+	side->status				= VM_RUNNING;
+}
+
+/* True if trailing side reached state of leading side */
+static int diff_equal(const diff_side_t *trail, const diff_side_t *lead)
+{
+	const vm_t *a = trail->vm, *b = lead->vm;
+
+	/* Failed engine may not have written back its state */
+	if (lead->status == VM_ERROR) {
+		return trail->status == VM_ERROR;
+	}
+
+	return trail->status == lead->status && a->pc == b->pc &&
+		a->stack.position == b->stack.position &&
+		a->hash_memory == b->hash_memory && a->hash_stack == b->hash_stack &&
+		a->input.position == b->input.position &&
+		trail->now.written == lead->now.written && trail->now.output == lead->now.output &&
+		!memcmp(a->registers.contents, b->registers.contents, sizeof(a->registers.contents));
+}
+
+/**
+ * Runs trailing side for lower bound of instructions, then steps it
+ * until it matches leading side
+ *
+ * Returns instructions run, -1 without match within limit or when
+ * trailing side ended inside lower bound.
+ */
+
+static long long diff_follow(diff_side_t *trail, const diff_side_t *lead,
+	unsigned long long bound, unsigned long long limit)
+{
+	unsigned long long steps = 0;
+
+	if (bound) {
+		trail->status = vm_run(trail->vm, bound);
+		if (trail->status != VM_RUNNING) {
+			return -1;
+		}
+		trail->now.executed += bound;
+	}
+
+	while (!diff_equal(trail, lead)) {
+		if (trail->status != VM_RUNNING || steps == limit) {
+			return -1;
+		}
+		trail->status = vm_run(trail->vm, 1);
+		if (trail->status != VM_STOPPED) {
+			trail->now.executed++;
+		}
+		steps++;
+	}
+
+	return bound + steps;
+}
+
+/* Prints state of side */
+static void diff_dump(const diff_side_t *side)
+{
+	const vm_t *vm = side->vm;
+	const unsigned short *r = vm->registers.contents;
+	const char *name = engine_names[vm->binary.engine];
+
+	vm_info("  %-8s [%s] [pc: %d] [sp: %d] [top: %d] [output: %zu B] [input: %zu B]", name,
+		status_names[side->status], vm->pc, vm->stack.position + 1,
+		vm->stack.position >= 0 ? STACK_AT(&vm->stack, vm->stack.position) : -1,
+		side->now.written, vm->input.position);
+	vm_info("  %-8s [r0: %d] [r1: %d] [r2: %d] [r3: %d] [r4: %d] [r5: %d] [r6: %d] [r7: %d]", name,
+		r[0], r[1], r[2], r[3], r[4], r[5], r[6], r[7]);
+	if (side->status == VM_ERROR) {
+		vm_info("  %-8s [%s]", name, vm->error);
+	}
+}
+
+/**
+ * Reports diverging dispatch with both states
+ *
+ * Trailing side is run again from start of round to start of the
+ * dispatch, then to first arrival at pc of leading side, so both
+ * states are side by side where paths agree.
+ */
+
+static void diff_report(diff_side_t *trail, const diff_side_t *lead, unsigned long long offset, int pc)
+{
+	const vm_t *a = trail->vm, *b = lead->vm;
+	int i, shown, steps;
+
+	diff_restore(trail);
+	if (offset) {
+		trail->status = vm_run(trail->vm, offset);
+		trail->now.executed += offset;
+	}
+	for (steps = 0; trail->status == VM_RUNNING && steps < MEMORY_SIZE; steps++) {
+		if (steps && a->pc == b->pc) {
+			break;
+		}
+		trail->status = vm_run(trail->vm, 1);
+		if (trail->status != VM_STOPPED) {
+			trail->now.executed++;
+		}
+	}
+
+	vm_info("Engines diverged ... [instruction: %llu] [pc: %d]", trail->saved.executed + offset, pc);
+	diff_dump(trail);
+	diff_dump(lead);
+
+	for (i = 0, shown = 0; i <= a->stack.position && i <= b->stack.position && shown < DIFF_DUMP; i++) {
+		if (STACK_AT(&a->stack, i) != STACK_AT(&b->stack, i)) {
+			vm_info("  stack    [%d] [%s: %d] [%s: %d]", i, engine_names[a->binary.engine],
+				STACK_AT(&a->stack, i), engine_names[b->binary.engine], STACK_AT(&b->stack, i));
+			shown++;
+		}
+	}
+	for (i = 0, shown = 0; i < MEMORY_SIZE && shown < DIFF_DUMP; i++) {
+		if (a->memory.contents[i] != b->memory.contents[i]) {
+			vm_info("  memory   [%d] [%s: %d] [%s: %d]", i, engine_names[a->binary.engine],
+				a->memory.contents[i], engine_names[b->binary.engine], b->memory.contents[i]);
+			shown++;
+		}
+	}
+}
+
+/**
+ * Replays round from snapshots one dispatch at a time
+ *
+ * Returns instructions run, -1 once first dispatch trailing side
+ * cannot match was reported.
+ */
+
+static long long diff_replay(diff_side_t *trail, diff_side_t *lead, unsigned long long dispatches)
+{
+	unsigned long long i, start;
+	long long n, total = 0;
+	int pc;
+
+	diff_restore(trail);
+	diff_restore(lead);
+	for (i = 0; i < dispatches && lead->status == VM_RUNNING; i++) {
+		pc		= lead->vm->pc;
+		start	= trail->now.executed;
+
+		/* Dispatch runs at least one instruction unless it ended */
+		lead->status = vm_run(lead->vm, 1);
+		n = diff_follow(trail, lead, lead->status == VM_RUNNING, MEMORY_SIZE);
+		if (n < 0) {
+			diff_report(trail, lead, start - trail->saved.executed, pc);
+			return -1;
+		}
+		total += n;
+	}
+
+	return total;
+}
+
+/**
+ * Runs image on -e engine and second engine in lockstep
+ *
+ * Spec is ENGINE[:N], N dispatches of leading engine per round. Input
+ * comes from -i or -s file only, output is hashed instead of printed.
+ * Returns -1 when engines diverged.
+ */
+
+int diff_run(vm_t *vm, const char *spec)
+{
+	diff_side_t side[2], *trail = &side[0], *lead = &side[1], *swap;
+	unsigned long long interval = DIFF_INTERVAL, guess = 0;
+	const char *colon = strchr(spec, ':');
+	char name[16];
+	long long n;
+	int i, ret = 0;
+
+	snprintf(name, sizeof(name), "%.*s", colon ? (int) (colon - spec) : (int) strlen(spec), spec);
+	if (colon) {
+		interval = strtoull(colon + 1, NULL, 10);
+		if (!interval) {
+			vm_fail("Invalid differential interval ... [%s]", spec);
+		}
+	}
+
+	memset(side, 0, sizeof(side));
+	for (i = 0; i < 2; i++) {
+		side[i].vm			= vm_create();
+		side[i].snapshot	= snapshot_create();
+		if (!side[i].vm) {
+			vm_fail("Cannot create virtual machine ...");
+		}
+		vm_clone(side[i].vm, vm);
+		side[i].vm->input	= vm->input;
+		side[i].vm->in		= io_buffer_in;
+		side[i].vm->out		= diff_out;
+		side[i].vm->user	= &side[i];
+		side[i].now.output	= 14695981039346656037ULL;
+		side[i].status		= VM_RUNNING;
+		hash_reset(side[i].vm);
+	}
+	if (vm_set_engine(lead->vm, name) < 0) {
+		vm_fail("Unknown engine ... [%s]", name);
+	}
+
+	/* Engine counting instructions exactly trails */
+	if (!DIFF_EXACT(trail->vm->binary.engine)) {
+		swap	= trail;
+		trail	= lead;
+		lead	= swap;
+	}
+	if (!DIFF_EXACT(trail->vm->binary.engine)) {
+		vm_fail("Differential run needs switch, threaded or paranoid engine ...");
+	}
+	for (i = 0; i < 2; i++) {
+		if (side[i].vm->binary.engine == ENGINE_DECODED || side[i].vm->binary.engine == ENGINE_JIT) {
+			cfg_build(side[i].vm);
+		}
+	}
+
+	vm_info("Differential run ... [%s] [%s] [interval: %llu]",
+		engine_names[trail->vm->binary.engine], engine_names[lead->vm->binary.engine], interval);
+
+	do {
+		diff_save(trail);
+		diff_save(lead);
+		lead->status = vm_run(lead->vm, interval);
+
+		/* Last round instruction count as bound first, guaranteed bound if that overshoots */
+		n = -1;
+		if (lead->status == VM_RUNNING && guess > interval) {
+			n = diff_follow(trail, lead, guess, guess / 8);
+			if (n < 0) {
+				diff_restore(trail);
+			}
+		}
+		if (n < 0) {
+			n = diff_follow(trail, lead, lead->status == VM_RUNNING ? interval : 0, interval * DIFF_SPAN);
+		}
+		if (n < 0) {
+			n = diff_replay(trail, lead, interval);
+		}
+		if (n < 0) {
+			ret = -1;
+			break;
+		}
+
+		guess = DIFF_EXACT(lead->vm->binary.engine) ? interval : (unsigned long long) n - n / 16;
+	} while (lead->status == VM_RUNNING);
+
+	if (!ret) {
+		vm_info("Engines agree ... [instructions: %llu] [output: %zu B] [%s]",
+			trail->now.executed, trail->now.written, status_names[trail->status]);
+		if (trail->status == VM_ERROR) {
+			diff_dump(trail);
+			diff_dump(lead);
+		}
+	}
+
+	for (i = 0; i < 2; i++) {
+		snapshot_destroy(side[i].snapshot);
+		vm_destroy(side[i].vm);
+	}
+	return ret;
+}
+
+#ifdef VM_PROFILE
+
+/**
+ * Allocates profile, root node stands for code outside of any call
+ */
+
+void profile_init(vm_t *vm)
+{
+	profile_t *profile;
+
+	profile = calloc(1, sizeof(profile_t));
+	if (profile) {
+		profile->size	= PROFILE_NODES;
+		profile->node	= calloc(profile->size, sizeof(profile_node_t));
+		profile->table	= calloc(profile->size * 2, sizeof(unsigned int));
+	}
+	if (!profile || !profile->node || !profile->table) {
+		vm_fail("Function %s() failed!", __FUNCTION__);
+	}
+
+	profile->nodes	= 1;
+	vm->profile		= profile;
+}
+
+/**
+ * Returns child node of parent for call target, creates it if missing
+ */
+
+static unsigned int profile_child(profile_t *profile, unsigned int parent, unsigned short address)
+{
+	unsigned int mask = profile->size * 2 - 1, i, n, slot;
+	profile_node_t *node;
+
+	slot = ((parent * 32771u) ^ address) & mask;
+	for (; profile->table[slot]; slot = (slot + 1) & mask) {
+		node = &profile->node[profile->table[slot] - 1];
+		if (node->parent == parent && node->address == address) {
+			return profile->table[slot] - 1;
+		}
+	}
+
+	/* Grow at half load, rehash all nodes but root */
+	if (profile->nodes == profile->size) {
+		profile->size *= 2;
+		profile->node	= realloc(profile->node, profile->size * sizeof(profile_node_t));
+		free(profile->table);
+		profile->table	= calloc(profile->size * 2, sizeof(unsigned int));
+		if (!profile->node || !profile->table) {
+			vm_fail("Function %s() failed!", __FUNCTION__);
+		}
+
+		mask = profile->size * 2 - 1;
+		for (i = 1; i < profile->nodes; i++) {
+			node = &profile->node[i];
+			for (n = ((node->parent * 32771u) ^ node->address) & mask; profile->table[n]; n = (n + 1) & mask);
+			profile->table[n] = i + 1;
+		}
+		for (slot = ((parent * 32771u) ^ address) & mask; profile->table[slot]; slot = (slot + 1) & mask);
+	}
+
+	n = profile->nodes++;
+	profile->node[n].parent		= parent;
+	profile->node[n].address	= address;
+	profile->node[n].self		= 0;
+	profile->table[slot]		= n + 1;
+	return n;
+}
+
+/**
+ * Counts instruction about to be executed
+ */
+
+void profile_step(vm_t *vm, int pc, unsigned short opcode)
+{
+	profile_t *profile = vm->profile;
+
+	profile->total++;
+	profile->pcs[pc]++;
+	if (opcode < ARCH_OPCODES) {
+		profile->opcodes[opcode]++;
+	}
+
+	profile->node[profile->depth ? profile->frame[profile->depth - 1].node : 0].self++;
+}
+
+/* Leaves frames with return address above stack position, counters are read once */
+static void profile_unwind(profile_t *profile, int position)
+{
+	unsigned long long now[PERF_COUNTERS];
+	profile_frame_t *frame;
+	int i, read = 0;
+
+	while (profile->depth && profile->frame[profile->depth - 1].position > position) {
+		frame = &profile->frame[--profile->depth];
+		if (--profile->active[frame->address]) {
+			continue;
+		}
+
+		profile->inclusive[frame->address] += profile->total - frame->start;
+		if (perf.leader < 0) {
+			continue;
+		}
+		if (!read) {
+			read = perf_read(&perf, now) < 0 ? -1 : 1;
+		}
+		if (read > 0) {
+			for (i = 0; i < PERF_COUNTERS; i++) {
+				profile->counters[frame->address][i] += now[i] - frame->counters[i];
+			}
+		}
+	}
+}
+
+/**
+ * Tracks call stack after instruction
+ *
+ * Call is entered when it did not fall through (accelerated calls do).
+ * Frames whose return address was popped are left, so ret as well as
+ * manual pops unwind. Direct recursion stays in the same node.
+ */
+
+void profile_track(vm_t *vm, int pc, unsigned short opcode, int next)
+{
+	profile_t *profile = vm->profile;
+	profile_frame_t *frame, *top;
+
+	profile_unwind(profile, vm->stack.position);
+
+	if (opcode != 17 || next == pc + 2) {
+		return;
+	}
+
+	/* Deeper calls are attributed to deepest tracked frame */
+	if (profile->depth == PROFILE_DEPTH) {
+		return;
+	}
+
+	top		= profile->depth ? &profile->frame[profile->depth - 1] : NULL;
+	frame	= &profile->frame[profile->depth++];
+	frame->position	= vm->stack.position;
+	frame->address	= next;
+	frame->start	= profile->total;
+	frame->node		= (top && top->address == next) ? top->node :
+		profile_child(profile, top ? top->node : 0, next);
+
+	/* Only outermost activation is counted, as for inclusive counts */
+	if (perf.leader >= 0 && !profile->active[next] && perf_read(&perf, frame->counters) < 0) {
+		memset(frame->counters, 0, sizeof(frame->counters));
+	}
+
+	profile->calls[next]++;
+	profile->active[next]++;
+}
+
+/* Keys for sorting indexes by count, descending */
+static const unsigned long long *profile_keys;
+
+static int profile_compare(const void *a, const void *b)
+{
+	unsigned long long x = profile_keys[*(const int *) a], y = profile_keys[*(const int *) b];
+
+	return (x < y) - (x > y);
+}
+
+/* Writes semicolon separated call path of node */
+static void profile_path_write(FILE *fp, const profile_t *profile, unsigned int n)
+{
+	if (!n) {
+		fprintf(fp, "main");
+		return;
+	}
+
+	profile_path_write(fp, profile, profile->node[n].parent);
+	fprintf(fp, ";sub_%d", profile->node[n].address);
+}
+
+/**
+ * Writes hot-spot report and folded stacks
+ *   - PREFIX.txt with sorted opcode, address and call target counts,
+ *     call targets get hardware counters with -c
+ *   - PREFIX.folded in flamegraph format, one line per call path
+ */
+
+void profile_report(vm_t *vm, const char *prefix)
+{
+	profile_t *profile = vm->profile;
+	static int order[MEMORY_SIZE];
+	double total;
+	char path[4096];
+	FILE *fp;
+	int i, n;
+
+	/* Calls still on stack end here */
+	profile_unwind(profile, -1);
+	total = profile->total ? profile->total : 1;
+
+	snprintf(path, sizeof(path), "%s.txt", prefix);
+	fp = fopen(path, "w");
+	if (!fp) {
+		vm_fail("Cannot write profile ... [%s]", path);
+	}
+
+	fprintf(fp, "Instructions: %llu\n\n", profile->total);
+
+	/* Opcodes */
+	for (i = 0; i < ARCH_OPCODES; i++) {
+		order[i] = i;
+	}
+	profile_keys = profile->opcodes;
+	qsort(order, ARCH_OPCODES, sizeof(int), profile_compare);
+
+	fprintf(fp, "%-8s %16s %8s\n", "opcode", "count", "%");
+	for (i = 0; i < ARCH_OPCODES && profile->opcodes[order[i]]; i++) {
+		fprintf(fp, "%-8s %16llu %8.2f\n", opcodes[order[i]].name,
+			profile->opcodes[order[i]], 100.0 * profile->opcodes[order[i]] / total);
+	}
+
+	/* Addresses */
+	for (i = 0; i < MEMORY_SIZE; i++) {
+		order[i] = i;
+	}
+	profile_keys = profile->pcs;
+	qsort(order, MEMORY_SIZE, sizeof(int), profile_compare);
+
+	fprintf(fp, "\n%-8s %16s %8s  %s\n", "pc", "count", "%", "insn");
+	for (i = 0; i < PROFILE_TOP && profile->pcs[order[i]]; i++) {
+		n = vm->memory.contents[order[i]];
+		fprintf(fp, "%-8d %16llu %8.2f  %s\n", order[i], profile->pcs[order[i]],
+			100.0 * profile->pcs[order[i]] / total, n < ARCH_OPCODES ? opcodes[n].name : "?");
+	}
+
+	/* Call targets by inclusive count */
+	for (i = 0; i < MEMORY_SIZE; i++) {
+		order[i] = i;
+	}
+	profile_keys = profile->inclusive;
+	qsort(order, MEMORY_SIZE, sizeof(int), profile_compare);
+
+	fprintf(fp, "\n%-8s %16s %16s %8s", "target", "calls", "inclusive", "%");
+	for (n = 0; n < PERF_COUNTERS; n++) {
+		if (perf.fd[n] >= 0) {
+			fprintf(fp, " %16s", perf_names[n]);
+		}
+	}
+	fprintf(fp, "\n");
+	for (i = 0; i < PROFILE_TOP && profile->calls[order[i]]; i++) {
+		fprintf(fp, "%-8d %16llu %16llu %8.2f", order[i], profile->calls[order[i]],
+			profile->inclusive[order[i]], 100.0 * profile->inclusive[order[i]] / total);
+		for (n = 0; n < PERF_COUNTERS; n++) {
+			if (perf.fd[n] >= 0) {
+				fprintf(fp, " %16llu", profile->counters[order[i]][n]);
+			}
+		}
+		fprintf(fp, "\n");
+	}
+	fclose(fp);
+
+	/* Folded stacks */
+	snprintf(path, sizeof(path), "%s.folded", prefix);
+	fp = fopen(path, "w");
+	if (!fp) {
+		vm_fail("Cannot write profile ... [%s]", path);
+	}
+	for (n = 0; n < (int) profile->nodes; n++) {
+		if (profile->node[n].self) {
+			profile_path_write(fp, profile, n);
+			fprintf(fp, " %llu\n", profile->node[n].self);
+		}
+	}
+	fclose(fp);
+
+	vm_info("Profile written ... [%s.txt] [%s.folded]", prefix, prefix);
+}
+
+#endif
+
+/**
+ * Prints info to standard error
+ *
+ * Messages of instance in vm_run() go to its log callback, library
+ * build prints nothing by default.
+ */
+ 
+void vm_info(const char *fmt, ...)
+{
+	char message[VM_MESSAGE_SIZE];
+	vm_t *vm = vm_active;
+	va_list args;
+
+	if (vm && vm->log) {
+		va_start(args, fmt);
+		vsnprintf(message, sizeof(message), fmt, args);
+		va_end(args);
+		vm->log(vm, VM_LOG_INFO, message);
+		return;
+	}
+
+#ifndef VM_LIBRARY
+	va_start(args, fmt);
+	fprintf	(stderr, FMT_VM_TAG);
+	vfprintf(stderr, fmt, args);
+	fprintf	(stderr, "\n");
+	va_end(args);
+#endif
+}
+
+/**
+ * Prints info to standard error and exits the program
+ *
+ * Inside vm_run() error is recorded in instance and vm_run() returns
+ * VM_ERROR instead. Never returns to caller.
+ */
+
+void vm_fail(const char *fmt, ...)
+{
+	vm_t *vm = vm_active;
+	va_list args;
+
+	if (vm && vm->trap) {
+		va_start(args, fmt);
+		vsnprintf(vm->error, sizeof(vm->error), fmt, args);
+		va_end(args);
+		if (vm->log) {
+			vm->log(vm, VM_LOG_ERROR, vm->error);
+		}
+		longjmp(*vm->trap, 1);
+	}
+
+	/* Keep program output written so far */
+	io_flush();
+
+	va_start(args, fmt);
+	fprintf	(stderr, FMT_VM_TAG);
+	vfprintf(stderr, fmt, args);
+   	fprintf	(stderr, FMT_VM_FAIL);
+	va_end(args);
+     
+	/* Exit with error */
+	exit(1);
 }
\ No newline at end of file
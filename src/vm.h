@@ -0,0 +1,118 @@
+/**
+ * Virtual machine for executing binary file from synacor challange
+ *
+ * Library interface, built from vm.c with VM_LIBRARY defined
+ *   - instances share no mutable state, any number can run in one
+ *     process, each instance used by one thread at a time
+ *   - runtime errors do not exit, vm_run() and vm_step() return
+ *     VM_ERROR and vm_error() describes the failure
+ *   - informational messages go to log callback, none by default
+ */
+
+#ifndef VM_H
+#define VM_H
+
+#include <stddef.h>
+
+typedef struct vm vm_t;
+
+/**
+ * Execution status returned by vm_run() and vm_step()
+ *   - stopped means execution can be resumed from pc, e.g. after
+ *     input callback returned VM_BLOCKED
+ *   - running means instruction budget was used up
+ *   - after error instance only accepts new image
+ */
+
+#define VM_HALTED				0
+#define VM_STOPPED				1
+#define VM_ERROR				2
+#define VM_RUNNING				3
+
+/* Returned by input callback when no input is available */
+#define VM_BLOCKED				(-2)
+
+/* Stop reasons of vm_break_reason() */
+#define VM_BREAK_NONE			0
+#define VM_BREAK_PC				1
+#define VM_BREAK_MEMORY			2
+#define VM_BREAK_REGISTER		3
+#define VM_BREAK_OUTPUT			4
+#define VM_BREAK_INPUT			5
+
+/* Log levels */
+#define VM_LOG_INFO				0
+#define VM_LOG_ERROR			1
+
+typedef struct sched sched_t;
+
+/* Input and output callbacks of opcodes 20 and 19 */
+typedef int  (*vm_in_fn)	(vm_t *vm);
+typedef void (*vm_out_fn)	(vm_t *vm, unsigned short value);
+
+/* Receives formatted message without trailing newline */
+typedef void (*vm_log_fn)	(vm_t *vm, int level, const char *message);
+
+/* Called by scheduler thread once instance halted or failed */
+typedef void (*vm_done_fn)	(vm_t *vm, int status);
+
+/* Instances */
+vm_t			*vm_create		(void);
+void			vm_destroy		(vm_t *vm);
+int				vm_load_image	(vm_t *vm, const void *image, size_t size);
+int				vm_set_engine	(vm_t *vm, const char *name);
+
+/* Instances created afterwards use huge page backed memory and stack */
+void			vm_huge_pages	(int enable);
+
+/**
+ * Execution, budget of 0 runs until halt or stop
+ *   - budget counts instructions, decoded engine counts control
+ *     transfers and JIT native blocks instead
+ */
+
+int				vm_run			(vm_t *vm, unsigned long long max_instructions);
+int				vm_step			(vm_t *vm);
+
+/* Callbacks and user data */
+void			vm_set_io		(vm_t *vm, vm_in_fn in, vm_out_fn out);
+void			vm_set_log		(vm_t *vm, vm_log_fn log);
+void			vm_set_user		(vm_t *vm, void *user);
+void			*vm_user		(const vm_t *vm);
+
+/* Machine state */
+const char		*vm_error		(const vm_t *vm);
+int				vm_pc			(const vm_t *vm);
+unsigned short	vm_register		(const vm_t *vm, int index);
+
+/**
+ * Breakpoints and watchpoints, hit returns VM_STOPPED
+ *   - pc break stops before instruction, resuming executes it
+ *   - memory and register watches stop after write
+ *   - output and input breaks stop once text seen ends with pattern
+ *     (below 64 characters), NULL pattern clears it
+ *   - instances without any point run at full speed
+ */
+
+int				vm_break		(vm_t *vm, int pc, int enable);
+int				vm_watch_memory	(vm_t *vm, int address, int enable);
+int				vm_watch_register(vm_t *vm, int index, int enable);
+int				vm_break_output	(vm_t *vm, const char *pattern);
+int				vm_break_input	(vm_t *vm, const char *pattern);
+int				vm_break_reason	(const vm_t *vm, int *address);
+
+/**
+ * Scheduler running many instances on few threads
+ *   - runnable instances get slices of vm_run(), idle threads steal
+ *   - instance stopped by input callback (VM_BLOCKED) is parked until
+ *     sched_wake(), which may be called from any thread
+ *   - sched_wait() returns once every instance finished or is parked
+ */
+
+sched_t			*sched_create	(int threads, unsigned long long slice, vm_done_fn done);
+void			sched_destroy	(sched_t *sched);
+void			sched_submit	(sched_t *sched, vm_t *vm);
+void			sched_wake		(sched_t *sched, vm_t *vm);
+void			sched_wait		(sched_t *sched);
+
+#endif